@@ -24,23 +24,161 @@
 #include "json.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define JSON_SIMD_X86
+#include <immintrin.h>
+#endif
+
 #define out_of_memory() do {                    \
 		fprintf(stderr, "Out of memory.\n");    \
 		exit(EXIT_FAILURE);                     \
 	} while (0)
 
-/* Sadly, strdup is not portable. */
-static char *json_strdup(const char *str)
+/* Arenas */
+
+#define ARENA_DEFAULT_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGN(n) (((n) + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1))
+
+typedef struct ArenaBlock ArenaBlock;
+
+struct ArenaBlock
+{
+	ArenaBlock *next;
+	size_t size;
+	size_t used;
+	max_align_t data[];
+};
+
+struct JsonArena
+{
+	/* Allocations are carved out of the first block. */
+	ArenaBlock *blocks;
+	size_t block_size;
+	JsonArenaStats stats;
+};
+
+static _Thread_local JsonArena *current_arena = NULL;
+
+static ArenaBlock *arena_new_block(JsonArena *arena, size_t size)
 {
-	char *ret = (char*) malloc(strlen(str) + 1);
-	if (ret == NULL)
+	ArenaBlock *block = (ArenaBlock*) malloc(sizeof(ArenaBlock) + size);
+	if (block == NULL)
 		out_of_memory();
-	strcpy(ret, str);
+	block->next = NULL;
+	block->size = size;
+	block->used = 0;
+	arena->stats.blocks++;
+	arena->stats.reserved += size;
+	return block;
+}
+
+static void *arena_alloc(JsonArena *arena, size_t size)
+{
+	ArenaBlock *block = arena->blocks;
+	void *ret;
+	
+	size = ARENA_ALIGN(size);
+	
+	if (block == NULL || block->size - block->used < size) {
+		if (size > arena->block_size / 4) {
+			/* Big allocations get their own block, behind the current one. */
+			block = arena_new_block(arena, size);
+			if (arena->blocks != NULL) {
+				block->next = arena->blocks->next;
+				arena->blocks->next = block;
+			} else {
+				arena->blocks = block;
+			}
+		} else {
+			block = arena_new_block(arena, arena->block_size);
+			block->next = arena->blocks;
+			arena->blocks = block;
+		}
+	}
+	
+	ret = (char*) block->data + block->used;
+	block->used += size;
+	arena->stats.used += size;
+	arena->stats.allocations++;
+	return ret;
+}
+
+JsonArena *json_arena_new(size_t block_size)
+{
+	JsonArena *arena = (JsonArena*) calloc(1, sizeof(JsonArena));
+	if (arena == NULL)
+		out_of_memory();
+	arena->block_size = block_size != 0 ? ARENA_ALIGN(block_size) : ARENA_DEFAULT_BLOCK_SIZE;
+	return arena;
+}
+
+static void arena_free_blocks(ArenaBlock *block)
+{
+	while (block != NULL) {
+		ArenaBlock *next = block->next;
+		free(block);
+		block = next;
+	}
+}
+
+void json_arena_free(JsonArena *arena)
+{
+	if (arena == NULL)
+		return;
+	if (current_arena == arena)
+		current_arena = NULL;
+	arena_free_blocks(arena->blocks);
+	free(arena);
+}
+
+void json_arena_reset(JsonArena *arena)
+{
+	ArenaBlock *keep = arena->blocks;
+	
+	if (keep != NULL) {
+		arena_free_blocks(keep->next);
+		keep->next = NULL;
+		keep->used = 0;
+		arena->stats.blocks = 1;
+		arena->stats.reserved = keep->size;
+	}
+	arena->stats.used = 0;
+	arena->stats.allocations = 0;
+}
+
+JsonArena *json_arena_use(JsonArena *arena)
+{
+	JsonArena *previous = current_arena;
+	current_arena = arena;
+	return previous;
+}
+
+void json_arena_stats(const JsonArena *arena, JsonArenaStats *stats)
+{
+	*stats = arena->stats;
+}
+
+/* Sadly, strdup is not portable. */
+static char *json_strdup(JsonArena *arena, const char *str)
+{
+	size_t size = strlen(str) + 1;
+	char *ret;
+	
+	if (arena != NULL) {
+		ret = (char*) arena_alloc(arena, size);
+	} else {
+		ret = (char*) malloc(size);
+		if (ret == NULL)
+			out_of_memory();
+	}
+	memcpy(ret, str, size);
 	return ret;
 }
 
@@ -114,6 +252,265 @@ static void sb_free(SB *sb)
 	free(sb->start);
 }
 
+/*
+ * Wide string scanning
+ *
+ * Strings are mostly runs of characters that are copied as they are.
+ * scan_plain() and scan_ascii() return the length of such a run, checking 16
+ * or 32 bytes at a time when the CPU allows it.
+ *
+ * The wide loads never cross a page boundary, so while they may read before the
+ * start of the string or past its terminating null byte, they cannot fault.
+ * AddressSanitizer would still report them, hence NO_ASAN.
+ */
+
+/* Characters emit_string() and parse_string() copy as they are. */
+#define is_plain(c) ((unsigned char) (c) >= 0x20 && (unsigned char) (c) < 0x80 && (c) != '"' && (c) != '\\')
+
+/* ASCII, except the null byte. */
+#define is_ascii(c) ((unsigned char) (c) >= 0x01 && (unsigned char) (c) < 0x80)
+
+static size_t scan_plain_scalar(const char *s)
+{
+	const char *p = s;
+	
+	while (is_plain(*p))
+		p++;
+	return p - s;
+}
+
+static size_t scan_ascii_scalar(const char *s)
+{
+	const char *p = s;
+	
+	while (is_ascii(*p))
+		p++;
+	return p - s;
+}
+
+#ifdef JSON_SIMD_X86
+
+#define NO_ASAN __attribute__((no_sanitize_address))
+
+/*
+ * Bytes to compare with, loaded rather than built with _mm_set1_epi8(), which
+ * is slow without optimization.  Filled by simd_init().
+ */
+static char scan_space[32] __attribute__((aligned(32)));
+static char scan_quote[32] __attribute__((aligned(32)));
+static char scan_backslash[32] __attribute__((aligned(32)));
+static char scan_one[32] __attribute__((aligned(32)));
+
+/*
+ * A string usually starts with an unaligned load at 's', unless that would
+ * cross a page boundary.  The loop then goes on from the next aligned block,
+ * checking a few bytes twice.  Near the end of a page, the loop starts at the
+ * aligned block holding 's' instead, and the bytes before 's' are cleared from
+ * its mask.
+ */
+#define PAGE_SIZE_MIN 4096
+
+NO_ASAN __attribute__((target("sse2")))
+static size_t scan_plain_sse2(const char *s)
+{
+	const char *p = (const char *) ((uintptr_t) s & ~(uintptr_t) 15);
+	unsigned int skip = (unsigned int) (s - p);
+	__m128i space = _mm_load_si128((const __m128i *) scan_space);
+	__m128i quote = _mm_load_si128((const __m128i *) scan_quote);
+	__m128i backslash = _mm_load_si128((const __m128i *) scan_backslash);
+	__m128i v;
+	__m128i stop;
+	unsigned int mask;
+	
+	if ((uintptr_t) s % PAGE_SIZE_MIN <= PAGE_SIZE_MIN - 16) {
+		v = _mm_loadu_si128((const __m128i *) s);
+		stop = _mm_or_si128(_mm_cmplt_epi8(v, space),
+			_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)));
+		mask = (unsigned int) _mm_movemask_epi8(stop);
+		if (mask != 0)
+			return __builtin_ctz(mask);
+		p += 16;
+		skip = 0;
+	}
+	
+	for (;; p += 16) {
+		v = _mm_load_si128((const __m128i *) p);
+		/* Signed comparison: control characters, and bytes from 0x80 up. */
+		stop = _mm_or_si128(_mm_cmplt_epi8(v, space),
+			_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)));
+		mask = (unsigned int) _mm_movemask_epi8(stop) >> skip << skip;
+		
+		if (mask != 0)
+			return p + __builtin_ctz(mask) - s;
+		skip = 0;
+	}
+}
+
+NO_ASAN __attribute__((target("sse2")))
+static size_t scan_ascii_sse2(const char *s)
+{
+	const char *p = (const char *) ((uintptr_t) s & ~(uintptr_t) 15);
+	unsigned int skip = (unsigned int) (s - p);
+	__m128i one = _mm_load_si128((const __m128i *) scan_one);
+	unsigned int mask;
+	
+	if ((uintptr_t) s % PAGE_SIZE_MIN <= PAGE_SIZE_MIN - 16) {
+		mask = (unsigned int) _mm_movemask_epi8(_mm_cmplt_epi8(_mm_loadu_si128((const __m128i *) s), one));
+		if (mask != 0)
+			return __builtin_ctz(mask);
+		p += 16;
+		skip = 0;
+	}
+	
+	for (;; p += 16) {
+		/* Signed comparison: the null byte, and bytes from 0x80 up. */
+		mask = (unsigned int) _mm_movemask_epi8(_mm_cmplt_epi8(_mm_load_si128((const __m128i *) p), one)) >> skip << skip;
+		
+		if (mask != 0)
+			return p + __builtin_ctz(mask) - s;
+		skip = 0;
+	}
+}
+
+/*
+ * The AVX2 versions clear the upper halves of the registers before returning,
+ * as the compiler does not always do it, and SSE code running after them would
+ * be slowed down.
+ */
+
+NO_ASAN __attribute__((target("avx2")))
+static size_t scan_plain_avx2(const char *s)
+{
+	const char *p = (const char *) ((uintptr_t) s & ~(uintptr_t) 31);
+	unsigned int skip = (unsigned int) (s - p);
+	__m256i space = _mm256_load_si256((const __m256i *) scan_space);
+	__m256i quote = _mm256_load_si256((const __m256i *) scan_quote);
+	__m256i backslash = _mm256_load_si256((const __m256i *) scan_backslash);
+	__m256i v;
+	__m256i stop;
+	unsigned int mask;
+	
+	if ((uintptr_t) s % PAGE_SIZE_MIN <= PAGE_SIZE_MIN - 32) {
+		v = _mm256_loadu_si256((const __m256i *) s);
+		stop = _mm256_or_si256(_mm256_cmpgt_epi8(space, v),
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, backslash)));
+		mask = (unsigned int) _mm256_movemask_epi8(stop);
+		if (mask != 0) {
+			_mm256_zeroupper();
+			return __builtin_ctz(mask);
+		}
+		p += 32;
+		skip = 0;
+	}
+	
+	for (;; p += 32) {
+		v = _mm256_load_si256((const __m256i *) p);
+		stop = _mm256_or_si256(_mm256_cmpgt_epi8(space, v),
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, backslash)));
+		mask = (unsigned int) _mm256_movemask_epi8(stop) >> skip << skip;
+		
+		if (mask != 0) {
+			_mm256_zeroupper();
+			return p + __builtin_ctz(mask) - s;
+		}
+		skip = 0;
+	}
+}
+
+NO_ASAN __attribute__((target("avx2")))
+static size_t scan_ascii_avx2(const char *s)
+{
+	const char *p = (const char *) ((uintptr_t) s & ~(uintptr_t) 31);
+	unsigned int skip = (unsigned int) (s - p);
+	__m256i one = _mm256_load_si256((const __m256i *) scan_one);
+	unsigned int mask;
+	
+	if ((uintptr_t) s % PAGE_SIZE_MIN <= PAGE_SIZE_MIN - 32) {
+		mask = (unsigned int) _mm256_movemask_epi8(_mm256_cmpgt_epi8(one, _mm256_loadu_si256((const __m256i *) s)));
+		if (mask != 0) {
+			_mm256_zeroupper();
+			return __builtin_ctz(mask);
+		}
+		p += 32;
+		skip = 0;
+	}
+	
+	for (;; p += 32) {
+		mask = (unsigned int) _mm256_movemask_epi8(_mm256_cmpgt_epi8(one, _mm256_load_si256((const __m256i *) p))) >> skip << skip;
+		
+		if (mask != 0) {
+			_mm256_zeroupper();
+			return p + __builtin_ctz(mask) - s;
+		}
+		skip = 0;
+	}
+}
+
+#endif /* JSON_SIMD_X86 */
+
+static size_t (*scan_plain)(const char *s) = scan_plain_scalar;
+static size_t (*scan_ascii)(const char *s) = scan_ascii_scalar;
+static JsonSimd simd_level = JSON_SIMD_NONE;
+
+/* Widest instruction set of this CPU. */
+static JsonSimd simd_supported(void)
+{
+#ifdef JSON_SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return JSON_SIMD_AVX2;
+	if (__builtin_cpu_supports("sse2"))
+		return JSON_SIMD_SSE2;
+#endif
+	return JSON_SIMD_NONE;
+}
+
+JsonSimd json_simd(void)
+{
+	return simd_level;
+}
+
+JsonSimd json_simd_limit(JsonSimd level)
+{
+	JsonSimd supported = simd_supported();
+	
+	if (level > supported)
+		level = supported;
+	
+	switch (level) {
+#ifdef JSON_SIMD_X86
+		case JSON_SIMD_AVX2:
+			scan_plain = scan_plain_avx2;
+			scan_ascii = scan_ascii_avx2;
+			break;
+		case JSON_SIMD_SSE2:
+			scan_plain = scan_plain_sse2;
+			scan_ascii = scan_ascii_sse2;
+			break;
+#endif
+		default:
+			scan_plain = scan_plain_scalar;
+			scan_ascii = scan_ascii_scalar;
+			level = JSON_SIMD_NONE;
+	}
+	
+	simd_level = level;
+	return level;
+}
+
+#ifdef JSON_SIMD_X86
+/* Choose before main(), hence before any thread is started. */
+__attribute__((constructor))
+static void simd_init(void)
+{
+	memset(scan_space, 0x20, sizeof(scan_space));
+	memset(scan_quote, '"', sizeof(scan_quote));
+	memset(scan_backslash, '\\', sizeof(scan_backslash));
+	memset(scan_one, 1, sizeof(scan_one));
+	json_simd_limit(JSON_SIMD_AVX2);
+}
+#endif
+
 /*
  * Unicode helper functions
  *
@@ -207,13 +604,17 @@ static bool utf8_validate(const char *s)
 {
 	int len;
 	
-	for (; *s != 0; s += len) {
+	for (;;) {
+		if (is_ascii(*s))
+			s += scan_ascii(s);
+		if (*s == 0)
+			return true;
+		
 		len = utf8_validate_cz(s);
 		if (len == 0)
 			return false;
+		s += len;
 	}
-	
-	return true;
 }
 
 /*
@@ -342,6 +743,9 @@ static void emit_value              (SB *out, const JsonNode *node);
 static void emit_value_indented     (SB *out, const JsonNode *node, const char *space, int indent_level);
 static void emit_string             (SB *out, const char *str);
 static void emit_number             (SB *out, double num);
+static void emit_integer            (SB *out, long long num);
+static void emit_unsigned           (SB *out, unsigned long long num);
+static void emit_number_node        (SB *out, const JsonNode *node);
 static void emit_array              (SB *out, const JsonNode *array);
 static void emit_array_indented     (SB *out, const JsonNode *array, const char *space, int indent_level);
 static void emit_object             (SB *out, const JsonNode *object);
@@ -350,6 +754,7 @@ static void emit_object_indented    (SB *out, const JsonNode *object, const char
 static int write_hex16(char *out, uint16_t val);
 
 static JsonNode *mknode(JsonTag tag);
+static JsonNode *mknumber_literal(const char *start, const char *end, double num);
 static void append_node(JsonNode *parent, JsonNode *child);
 static void prepend_node(JsonNode *parent, JsonNode *child);
 static void append_member(JsonNode *object, char *key, JsonNode *value);
@@ -362,17 +767,22 @@ JsonNode *json_decode(const char *json)
 {
 	const char *s = json;
 	JsonNode *ret;
+	/* The parser hands heap strings over to the nodes. */
+	JsonArena *arena = json_arena_use(NULL);
 	
 	skip_space(&s);
-	if (!parse_value(&s, &ret))
+	if (!parse_value(&s, &ret)) {
+		json_arena_use(arena);
 		return NULL;
+	}
 	
 	skip_space(&s);
 	if (*s != 0) {
 		json_delete(ret);
-		return NULL;
+		ret = NULL;
 	}
 	
+	json_arena_use(arena);
 	return ret;
 }
 
@@ -404,6 +814,183 @@ char *json_stringify(const JsonNode *node, const char *space)
 	return sb_finish(&sb);
 }
 
+/*
+ * Streaming writer
+ *
+ * The writer keeps, for each open array or object, the number of values
+ * written so far.  That is all it needs to lay out separators and indentation
+ * the way emit_value_indented() does for the equivalent tree.
+ */
+
+struct JsonWriter
+{
+	SB sb;
+	const char *space;
+	
+	size_t *counts;
+	int depth;
+	int max_depth;
+	
+	/* A key was written; its value needs no separator. */
+	bool after_key;
+};
+
+JsonWriter *json_writer_new(const char *space)
+{
+	JsonWriter *writer = (JsonWriter*) calloc(1, sizeof(JsonWriter));
+	if (writer == NULL)
+		out_of_memory();
+	sb_init(&writer->sb);
+	writer->space = space;
+	return writer;
+}
+
+void json_writer_free(JsonWriter *writer)
+{
+	if (writer == NULL)
+		return;
+	sb_free(&writer->sb);
+	free(writer->counts);
+	free(writer);
+}
+
+void json_writer_reset(JsonWriter *writer)
+{
+	writer->sb.cur = writer->sb.start;
+	writer->depth = 0;
+	writer->after_key = false;
+}
+
+const char *json_writer_data(JsonWriter *writer, size_t *length)
+{
+	/* The buffer always has room for the terminator. */
+	*writer->sb.cur = 0;
+	if (length != NULL)
+		*length = writer->sb.cur - writer->sb.start;
+	return writer->sb.start;
+}
+
+static void writer_indent(JsonWriter *writer)
+{
+	int i;
+	
+	sb_putc(&writer->sb, '\n');
+	for (i = 0; i < writer->depth; i++)
+		sb_puts(&writer->sb, writer->space);
+}
+
+/* Separate the next key or value from the previous one. */
+static void writer_prefix(JsonWriter *writer)
+{
+	if (writer->after_key) {
+		writer->after_key = false;
+		return;
+	}
+	if (writer->depth == 0)
+		return;
+	
+	if (writer->counts[writer->depth - 1]++ > 0)
+		sb_putc(&writer->sb, ',');
+	if (writer->space != NULL)
+		writer_indent(writer);
+}
+
+static void writer_open(JsonWriter *writer, char c)
+{
+	writer_prefix(writer);
+	sb_putc(&writer->sb, c);
+	
+	if (writer->depth == writer->max_depth) {
+		writer->max_depth = writer->max_depth != 0 ? writer->max_depth * 2 : 16;
+		writer->counts = (size_t*) realloc(writer->counts, writer->max_depth * sizeof(size_t));
+		if (writer->counts == NULL)
+			out_of_memory();
+	}
+	writer->counts[writer->depth++] = 0;
+}
+
+static void writer_close(JsonWriter *writer, char c)
+{
+	assert(writer->depth > 0 && !writer->after_key);
+	writer->depth--;
+	if (writer->space != NULL && writer->counts[writer->depth] > 0)
+		writer_indent(writer);
+	sb_putc(&writer->sb, c);
+}
+
+void json_writer_begin_array(JsonWriter *writer)
+{
+	writer_open(writer, '[');
+}
+
+void json_writer_end_array(JsonWriter *writer)
+{
+	writer_close(writer, ']');
+}
+
+void json_writer_begin_object(JsonWriter *writer)
+{
+	writer_open(writer, '{');
+}
+
+void json_writer_end_object(JsonWriter *writer)
+{
+	writer_close(writer, '}');
+}
+
+void json_writer_key(JsonWriter *writer, const char *key)
+{
+	assert(writer->depth > 0 && !writer->after_key);
+	writer_prefix(writer);
+	emit_string(&writer->sb, key);
+	if (writer->space != NULL)
+		sb_puts(&writer->sb, ": ");
+	else
+		sb_putc(&writer->sb, ':');
+	writer->after_key = true;
+}
+
+void json_writer_null(JsonWriter *writer)
+{
+	writer_prefix(writer);
+	sb_puts(&writer->sb, "null");
+}
+
+void json_writer_bool(JsonWriter *writer, bool b)
+{
+	writer_prefix(writer);
+	sb_puts(&writer->sb, b ? "true" : "false");
+}
+
+void json_writer_string(JsonWriter *writer, const char *str)
+{
+	writer_prefix(writer);
+	emit_string(&writer->sb, str);
+}
+
+void json_writer_number(JsonWriter *writer, double num)
+{
+	writer_prefix(writer);
+	emit_number(&writer->sb, num);
+}
+
+void json_writer_integer(JsonWriter *writer, long long num)
+{
+	writer_prefix(writer);
+	emit_integer(&writer->sb, num);
+}
+
+void json_writer_unsigned(JsonWriter *writer, unsigned long long num)
+{
+	writer_prefix(writer);
+	emit_unsigned(&writer->sb, num);
+}
+
+void json_writer_raw(JsonWriter *writer, const char *bytes, size_t length)
+{
+	sb_put(&writer->sb, bytes, (int) length);
+}
+
 void json_delete(JsonNode *node)
 {
 	if (node != NULL) {
@@ -411,7 +998,8 @@ void json_delete(JsonNode *node)
 		
 		switch (node->tag) {
 			case JSON_STRING:
-				free(node->string_);
+				if (node->arena == NULL && !(node->flags & JSON_STRING_REF))
+					free(node->string_);
 				break;
 			case JSON_ARRAY:
 			case JSON_OBJECT:
@@ -426,7 +1014,8 @@ void json_delete(JsonNode *node)
 			default:;
 		}
 		
-		free(node);
+		if (node->arena == NULL)
+			free(node);
 	}
 }
 
@@ -485,9 +1074,17 @@ JsonNode *json_first_child(const JsonNode *node)
 
 static JsonNode *mknode(JsonTag tag)
 {
-	JsonNode *ret = (JsonNode*) calloc(1, sizeof(JsonNode));
-	if (ret == NULL)
-		out_of_memory();
+	JsonNode *ret;
+	
+	if (current_arena != NULL) {
+		ret = (JsonNode*) arena_alloc(current_arena, sizeof(JsonNode));
+		memset(ret, 0, sizeof(JsonNode));
+		ret->arena = current_arena;
+	} else {
+		ret = (JsonNode*) calloc(1, sizeof(JsonNode));
+		if (ret == NULL)
+			out_of_memory();
+	}
 	ret->tag = tag;
 	return ret;
 }
@@ -513,7 +1110,15 @@ static JsonNode *mkstring(char *s)
 
 JsonNode *json_mkstring(const char *s)
 {
-	return mkstring(json_strdup(s));
+	return mkstring(json_strdup(current_arena, s));
+}
+
+JsonNode *json_mkstring_ref(const char *s)
+{
+	JsonNode *ret = mknode(JSON_STRING);
+	ret->string_ = (char*) s;
+	ret->flags |= JSON_STRING_REF;
+	return ret;
 }
 
 JsonNode *json_mknumber(double n)
@@ -523,6 +1128,55 @@ JsonNode *json_mknumber(double n)
 	return node;
 }
 
+JsonNode *json_mkinteger(long long n)
+{
+	JsonNode *node = mknode(JSON_NUMBER);
+	node->int_ = n;
+	node->flags |= JSON_NUMBER_INT;
+	return node;
+}
+
+JsonNode *json_mkunsigned(unsigned long long n)
+{
+	JsonNode *node = mknode(JSON_NUMBER);
+	node->uint_ = n;
+	node->flags |= JSON_NUMBER_UINT;
+	return node;
+}
+
+/* Keep integer literals exact when they fit in 64 bits. */
+static JsonNode *mknumber_literal(const char *start, const char *end, double num)
+{
+	const char *s;
+	
+	for (s = *start == '-' ? start + 1 : start; s < end; s++)
+		if (!is_digit(*s))
+			return json_mknumber(num);
+	
+	errno = 0;
+	if (*start == '-') {
+		long long n = strtoll(start, NULL, 10);
+		/* -0 stays a double to keep its sign. */
+		if (errno == 0 && n != 0)
+			return json_mkinteger(n);
+	} else {
+		unsigned long long n = strtoull(start, NULL, 10);
+		if (errno == 0)
+			return json_mkunsigned(n);
+	}
+	return json_mknumber(num);
+}
+
+double json_number(const JsonNode *node)
+{
+	assert(node->tag == JSON_NUMBER);
+	if (node->flags & JSON_NUMBER_INT)
+		return (double) node->int_;
+	if (node->flags & JSON_NUMBER_UINT)
+		return (double) node->uint_;
+	return node->number_;
+}
+
 JsonNode *json_mkarray(void)
 {
 	return mknode(JSON_ARRAY);
@@ -562,6 +1216,7 @@ static void prepend_node(JsonNode *parent, JsonNode *child)
 static void append_member(JsonNode *object, char *key, JsonNode *value)
 {
 	value->key = key;
+	value->flags &= ~JSON_KEY_REF;
 	append_node(object, value);
 }
 
@@ -586,7 +1241,7 @@ void json_append_member(JsonNode *object, const char *key, JsonNode *value)
 	assert(object->tag == JSON_OBJECT);
 	assert(value->parent == NULL);
 	
-	append_member(object, json_strdup(key), value);
+	append_member(object, json_strdup(value->arena, key), value);
 }
 
 void json_prepend_member(JsonNode *object, const char *key, JsonNode *value)
@@ -594,10 +1249,21 @@ void json_prepend_member(JsonNode *object, const char *key, JsonNode *value)
 	assert(object->tag == JSON_OBJECT);
 	assert(value->parent == NULL);
 	
-	value->key = json_strdup(key);
+	value->key = json_strdup(value->arena, key);
+	value->flags &= ~JSON_KEY_REF;
 	prepend_node(object, value);
 }
 
+void json_append_member_ref(JsonNode *object, const char *key, JsonNode *value)
+{
+	assert(object->tag == JSON_OBJECT);
+	assert(value->parent == NULL);
+	
+	value->key = (char*) key;
+	value->flags |= JSON_KEY_REF;
+	append_node(object, value);
+}
+
 void json_remove_from_parent(JsonNode *node)
 {
 	JsonNode *parent = node->parent;
@@ -612,11 +1278,13 @@ void json_remove_from_parent(JsonNode *node)
 		else
 			parent->children.tail = node->prev;
 		
-		free(node->key);
+		if (node->arena == NULL && !(node->flags & JSON_KEY_REF))
+			free(node->key);
 		
 		node->parent = NULL;
 		node->prev = node->next = NULL;
 		node->key = NULL;
+		node->flags &= ~JSON_KEY_REF;
 	}
 }
 
@@ -681,7 +1349,7 @@ static bool parse_value(const char **sp, JsonNode **out)
 			double num;
 			if (parse_number(&s, out ? &num : NULL)) {
 				if (out)
-					*out = json_mknumber(num);
+					*out = mknumber_literal(*sp, s, num);
 				*sp = s;
 				return true;
 			}
@@ -810,7 +1478,24 @@ bool parse_string(const char **sp, char **out)
 	}
 	
 	while (*s != '"') {
-		unsigned char c = *s++;
+		unsigned char c;
+		
+		/* Copy a run of plain characters in one go. */
+		if (is_plain(*s)) {
+			size_t run = scan_plain(s);
+			
+			if (out) {
+				sb.cur = b;
+				sb_need(&sb, (int) run + 4);
+				memcpy(sb.cur, s, run);
+				sb.cur += run;
+				b = sb.cur;
+			}
+			s += run;
+			continue;
+		}
+		
+		c = *s++;
 		
 		/* Parse next character, and write it to b. */
 		if (c == '\\') {
@@ -985,7 +1670,7 @@ static void emit_value(SB *out, const JsonNode *node)
 			emit_string(out, node->string_);
 			break;
 		case JSON_NUMBER:
-			emit_number(out, node->number_);
+			emit_number_node(out, node);
 			break;
 		case JSON_ARRAY:
 			emit_array(out, node);
@@ -1012,7 +1697,7 @@ void emit_value_indented(SB *out, const JsonNode *node, const char *space, int i
 			emit_string(out, node->string_);
 			break;
 		case JSON_NUMBER:
-			emit_number(out, node->number_);
+			emit_number_node(out, node);
 			break;
 		case JSON_ARRAY:
 			emit_array_indented(out, node, space, indent_level);
@@ -1120,7 +1805,22 @@ void emit_string(SB *out, const char *str)
 	
 	*b++ = '"';
 	while (*s != 0) {
-		unsigned char c = *s++;
+		unsigned char c;
+		
+		/* Copy a run of characters needing no escape in one go. */
+		if (is_plain(*s)) {
+			size_t run = scan_plain(s);
+			
+			out->cur = b;
+			sb_need(out, (int) run + 14);
+			b = out->cur;
+			memcpy(b, s, run);
+			b += run;
+			s += run;
+			continue;
+		}
+		
+		c = *s++;
 		
 		/* Encode the next character, and write it to b. */
 		switch (c) {
@@ -1177,7 +1877,7 @@ void emit_string(SB *out, const char *str)
 						*b++ = (char) 0xBD;
 					}
 					s++;
-				} else if (c < 0x1F || (c >= 0x80 && escape_unicode)) {
+				} else if (c <= 0x1F || (c >= 0x80 && escape_unicode)) {
 					/* Encode using \u.... */
 					uint32_t unicode;
 					
@@ -1224,6 +1924,12 @@ void emit_string(SB *out, const char *str)
 
 static void emit_number(SB *out, double num)
 {
+	/* Integers of up to 16 digits come out the same as with "%.16g". */
+	if (num > -1e16 && num < 1e16 && num == (double) (long long) num && (num != 0 || !signbit(num))) {
+		emit_integer(out, (long long) num);
+		return;
+	}
+	
 	/*
 	 * This isn't exactly how JavaScript renders numbers,
 	 * but it should produce valid JSON for reasonable numbers
@@ -1239,6 +1945,80 @@ static void emit_number(SB *out, double num)
 		sb_puts(out, "null");
 }
 
+static const char digit_pairs[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+/* Room for the digits of any unsigned long long, and a sign. */
+#define INTEGER_BUFFER_SIZE (sizeof(unsigned long long) * 3 + 1)
+
+/*
+ * Write 'num' in decimal right before 'end', two digits at a time, and return
+ * where it starts.
+ */
+static char *format_unsigned(char *end, unsigned long long num)
+{
+	char *p = end;
+	
+	while (num >= 100) {
+		const char *pair = digit_pairs + (num % 100) * 2;
+		num /= 100;
+		*--p = pair[1];
+		*--p = pair[0];
+	}
+	if (num >= 10) {
+		const char *pair = digit_pairs + num * 2;
+		*--p = pair[1];
+		*--p = pair[0];
+	} else {
+		*--p = (char) ('0' + num);
+	}
+	return p;
+}
+
+static void emit_integer(SB *out, long long num)
+{
+	char buf[INTEGER_BUFFER_SIZE];
+	char *end = buf + sizeof(buf);
+	char *start;
+	
+	if (num < 0) {
+		/* Negate as unsigned, which also works for LLONG_MIN. */
+		start = format_unsigned(end, 0ULL - (unsigned long long) num);
+		*--start = '-';
+	} else {
+		start = format_unsigned(end, (unsigned long long) num);
+	}
+	sb_put(out, start, end - start);
+}
+
+static void emit_unsigned(SB *out, unsigned long long num)
+{
+	char buf[INTEGER_BUFFER_SIZE];
+	char *end = buf + sizeof(buf);
+	char *start = format_unsigned(end, num);
+	
+	sb_put(out, start, end - start);
+}
+
+static void emit_number_node(SB *out, const JsonNode *node)
+{
+	if (node->flags & JSON_NUMBER_INT)
+		emit_integer(out, node->int_);
+	else if (node->flags & JSON_NUMBER_UINT)
+		emit_unsigned(out, node->uint_);
+	else
+		emit_number(out, node->number_);
+}
+
 static bool tag_is_valid(unsigned int tag)
 {
 	return (/* tag >= JSON_NULL && */ tag <= JSON_OBJECT);
@@ -1324,6 +2104,13 @@ bool json_check(const JsonNode *node, char errmsg[256])
 	if (!tag_is_valid(node->tag))
 		problem("tag is invalid (%u)", node->tag);
 	
+	if ((node->flags & (JSON_NUMBER_INT | JSON_NUMBER_UINT)) != 0) {
+		if (node->tag != JSON_NUMBER)
+			problem("integer flag set on a node that is not a number");
+		if ((node->flags & JSON_NUMBER_INT) && (node->flags & JSON_NUMBER_UINT))
+			problem("number is both signed and unsigned");
+	}
+	
 	if (node->tag == JSON_BOOL) {
 		if (node->bool_ != false && node->bool_ != true)
 			problem("bool_ is neither false (%d) nor true (%d)", (int)false, (int)true);
@@ -37,6 +37,15 @@ typedef enum {
 } JsonTag;
 
 typedef struct JsonNode JsonNode;
+typedef struct JsonArena JsonArena;
+
+/* The node borrows its key or string instead of owning a copy. */
+#define JSON_KEY_REF    1
+#define JSON_STRING_REF 2
+
+/* The JSON_NUMBER is an exact integer held in int_ or uint_, not number_. */
+#define JSON_NUMBER_INT  4
+#define JSON_NUMBER_UINT 8
 
 struct JsonNode
 {
@@ -47,6 +56,12 @@ struct JsonNode
 	/* only if parent is an object (NULL otherwise) */
 	char *key; /* Must be valid UTF-8. */
 	
+	/* Arena holding this node, its key and its string (NULL if on the heap) */
+	JsonArena *arena;
+	
+	/* JSON_KEY_REF, JSON_STRING_REF, JSON_NUMBER_INT, JSON_NUMBER_UINT */
+	unsigned char flags;
+	
 	JsonTag tag;
 	union {
 		/* JSON_BOOL */
@@ -57,6 +72,8 @@ struct JsonNode
 		
 		/* JSON_NUMBER */
 		double number_;
+		long long int_;           /* with JSON_NUMBER_INT */
+		unsigned long long uint_; /* with JSON_NUMBER_UINT */
 		
 		/* JSON_ARRAY */
 		/* JSON_OBJECT */
@@ -98,13 +115,115 @@ JsonNode *json_mknumber(double n);
 JsonNode *json_mkarray(void);
 JsonNode *json_mkobject(void);
 
+/*
+ * Borrow 's' instead of copying it.  It must not change and must outlive the
+ * node, e.g. a literal or an interned string.
+ */
+JsonNode *json_mkstring_ref(const char *s);
+
+/*
+ * Numbers written with all their digits, beyond the 53 bits a double keeps.
+ * json_decode() also makes these for integer literals that fit.
+ */
+JsonNode *json_mkinteger(long long n);
+JsonNode *json_mkunsigned(unsigned long long n);
+
+/* Value of a JSON_NUMBER as a double, whatever it holds. */
+double json_number(const JsonNode *node);
+
 void json_append_element(JsonNode *array, JsonNode *element);
 void json_prepend_element(JsonNode *array, JsonNode *element);
 void json_append_member(JsonNode *object, const char *key, JsonNode *value);
 void json_prepend_member(JsonNode *object, const char *key, JsonNode *value);
 
+/* Same as json_append_member(), borrowing 'key' like json_mkstring_ref(). */
+void json_append_member_ref(JsonNode *object, const char *key, JsonNode *value);
+
 void json_remove_from_parent(JsonNode *node);
 
+/*** Arenas ***/
+
+/*
+ * Nodes created while an arena is in use by the calling thread are carved out
+ * of the arena's blocks, along with their keys and strings.  json_delete() only
+ * unlinks such nodes; their memory goes away all at once with
+ * json_arena_reset() or json_arena_free().  Nodes from an arena and from the
+ * heap can be mixed in one tree.  json_decode() always builds on the heap.
+ */
+
+typedef struct {
+	size_t blocks;      /* blocks obtained from malloc */
+	size_t reserved;    /* bytes in those blocks */
+	size_t used;        /* bytes handed out */
+	size_t allocations; /* nodes, keys and strings */
+} JsonArenaStats;
+
+/* block_size of 0 means the default (64 KiB). */
+JsonArena *json_arena_new(size_t block_size);
+void json_arena_free(JsonArena *arena);
+
+/* Forget every allocation, keeping one block for reuse. */
+void json_arena_reset(JsonArena *arena);
+
+/* Use 'arena' (or the heap if NULL) in this thread.  Returns the previous one. */
+JsonArena *json_arena_use(JsonArena *arena);
+
+void json_arena_stats(const JsonArena *arena, JsonArenaStats *stats);
+
+/*** Streaming ***/
+
+/*
+ * Write JSON into a growing buffer without building a tree.  The calls must
+ * describe a well-formed value: json_writer_key() before each member of an
+ * object, and a matching end for each begin.  The result is the same as
+ * json_stringify() with the same 'space' on the equivalent tree.
+ */
+
+typedef struct JsonWriter JsonWriter;
+
+JsonWriter *json_writer_new(const char *space);
+void json_writer_free(JsonWriter *writer);
+
+/* Empty the buffer, keeping its memory for the next value. */
+void json_writer_reset(JsonWriter *writer);
+
+/* Null-terminated contents of the buffer, valid until the next call. */
+const char *json_writer_data(JsonWriter *writer, size_t *length);
+
+void json_writer_begin_array(JsonWriter *writer);
+void json_writer_end_array(JsonWriter *writer);
+void json_writer_begin_object(JsonWriter *writer);
+void json_writer_end_object(JsonWriter *writer);
+void json_writer_key(JsonWriter *writer, const char *key);
+
+void json_writer_null(JsonWriter *writer);
+void json_writer_bool(JsonWriter *writer, bool b);
+void json_writer_string(JsonWriter *writer, const char *str);
+void json_writer_number(JsonWriter *writer, double num);
+void json_writer_integer(JsonWriter *writer, long long num);
+void json_writer_unsigned(JsonWriter *writer, unsigned long long num);
+
+/* Append bytes as they are, e.g. a separator between two values. */
+void json_writer_raw(JsonWriter *writer, const char *bytes, size_t length);
+
+/*** CPU features ***/
+
+/*
+ * Strings are scanned 16 or 32 bytes at a time with SSE2 or AVX2 when the CPU
+ * has them, and byte by byte otherwise.  The choice is made at startup.
+ * json_simd_limit() caps it, e.g. to compare them, and returns the level now
+ * in use.  It must not be called while other threads use the library.
+ */
+
+typedef enum {
+	JSON_SIMD_NONE,
+	JSON_SIMD_SSE2,
+	JSON_SIMD_AVX2,
+} JsonSimd;
+
+JsonSimd json_simd(void);
+JsonSimd json_simd_limit(JsonSimd level);
+
 /*** Debugging ***/
 
 /*
@@ -35,14 +35,30 @@ Why does "ListNames" method on DBUS_SERVICE_DBUS,DBUS_PATH_DBUS does not list or
 TODO: check if all message_mangler calls get properly cleaned.
 */
 
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
 #include <signal.h>
+#include <spawn.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/time.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -57,14 +73,18 @@ TODO: check if all message_mangler calls get properly cleaned.
 /**
  * JSON
  *
- * This format is used as internal storage, as well as export.
+ * This format is used for export. Messages are stored in their wire format,
+ * see the message store.
  * Let's use an embedded implementation here.
  */
 #include "json.h"
 
+#define DBUS_JSON_BUS "bus"
+#define DBUS_JSON_SAMPLE_WEIGHT "sample_weight"
 #define DBUS_JSON_TYPE "type"
 #define DBUS_JSON_SEC "sec"
 #define DBUS_JSON_USEC "usec"
+#define DBUS_JSON_NSEC "nsec"
 #define DBUS_JSON_HOUR "hour"
 #define DBUS_JSON_MINUTE "minute"
 #define DBUS_JSON_SECOND "second"
@@ -82,11 +102,13 @@ TODO: check if all message_mangler calls get properly cleaned.
 #define DBUS_JSON_SIGNAL "signal"
 #define DBUS_JSON_ERROR_NAME "error_name"
 #define DBUS_JSON_ARGS "arg"
+#define DBUS_JSON_TRUNCATED "truncated"
 #define DBUS_JSON_UNKNOWN "unknown"
 
 #define DBUS_JSON_ARG_TYPE "type"
 #define DBUS_JSON_ARG_VALUE "value"
 #define DBUS_JSON_ARG_ARRAYTYPE "arraytype"
+#define DBUS_JSON_ARG_ENCODING "encoding"
 
 
 
@@ -95,12 +117,6 @@ TODO: check if all message_mangler calls get properly cleaned.
 
 /* TODO: check if output is always properly closed on exit. */
 
-/* This flag is used to shutdown properly when SIGINT is caught.  Since some */
-/* function (e.g. spy()) run an inifite loop, this is the only way to let them */
-/* know when it is time to quit. */
-static volatile sig_atomic_t doneflag = 0;
-static volatile sig_atomic_t spyflag = 0;
-
 /* Paths and file descriptors for output and logfile. */
 /* TODO: handle input. */
 /* TODO: Use freopen() to change output and logfile. Then perror() can be used safely. */
@@ -111,8 +127,9 @@ static const char *output_path = NULL;
 /* static const char *input_path = NULL; */
 static const char *logfile_path = NULL;
 
-/* Contains the whole bunch of messages caught using spy(); */
-JsonNode *message_array;
+/* Arguments which are rendered, then dropped. Reset after each message. */
+static JsonArena *scratch_arena = NULL;
+
 
 /* Contains HTML info. */
 char *html_message;
@@ -124,12 +141,19 @@ enum OutputFormat {
 	FORMAT_XML
 };
 /* With this variable we can set the text format / structure of reports. */
-/* static int option_output_format = FORMAT_JSON; */
+static enum OutputFormat option_output_format = FORMAT_JSON;
 
 /* If the output is set to an existing file, it will not overwrite it by default */
 /* (outputting to stdout instead). We can use an option to force overwriting. */
 static bool option_force_overwrite = false;
 
+/* Interval in seconds between two capture statistics reports. 0 means report */
+/* on exit only. */
+static unsigned int option_stats_interval = 0;
+
+/* One line of JSON per message or reply, without indentation. */
+static bool option_compact = false;
+
 /* Specify the indentation in JSON output. */
 #define JSON_FORMAT "  "
 #define JSON_FORMAT_NONE ""
@@ -174,43 +198,14 @@ json_import(const char * inputpath)
 }
 */
 
-/**
- * Profile mode (one line print).
- *
- * TODO: implement function.
- *
- *  printf (TIME_FORMAT, type, t.tv_sec, t.tv_usec);
- *
- *  if (flag & FLAG_SERIAL)
- *      printf ("\t%u", dbus_message_get_serial (message));
- *
- *  if (flag & FLAG_REPLY_SERIAL)
- *      printf ("\t%u", dbus_message_get_reply_serial (message));
- *
- *  if (flag & FLAG_SENDER)
- *      printf ("\t%s", TRAP_NULL_STRING (dbus_message_get_sender (message)));
- *
- *  if (flag & FLAG_DESTINATION)
- *      printf ("\t%s", TRAP_NULL_STRING (dbus_message_get_destination (message)));
- *
- *  if (flag & FLAG_PATH)
- *      printf ("\t%s", TRAP_NULL_STRING (dbus_message_get_path (message)));
- *
- *  if (flag & FLAG_INTERFACE)
- *      printf ("\t%s", TRAP_NULL_STRING (dbus_message_get_interface (message)));
- *
- *  if (flag & FLAG_MEMBER)
- *      printf ("\t%s", TRAP_NULL_STRING (dbus_message_get_member (message)));
- *
- *  if (flag & FLAG_ERROR_NAME)
- *      printf ("\t%s", TRAP_NULL_STRING (dbus_message_get_error_name (message)));
- *
- *  printf ("\n");
- */
+/* Indentation of JSON output, NULL for compact. */
+static const char *output_space() {
+	return option_compact ? NULL : JSON_FORMAT;
+}
 
 void json_print(JsonNode *message) {
 
-	char *tmp = json_stringify(message, JSON_FORMAT);
+	char *tmp = json_stringify(message, output_space());
 	fwrite(tmp, sizeof (char), strlen(tmp), output);
 	fwrite("\n", sizeof (char), 1, output);
 
@@ -477,6 +472,224 @@ struct JsonNode *dbus_xml_parser(char *source) {
 }
 
 
+/**
+ * String interning
+ *
+ * A bus uses a few hundred distinct names, paths, interfaces and members, while
+ * every message carries several of them. intern() returns a unique immutable
+ * copy of a string, so that JSON nodes can borrow it with json_mkstring_ref()
+ * instead of owning a copy, and two interned strings are equal if and only if
+ * the pointers are. Interned strings live until the end of the program.
+ *
+ * Names and paths come from the peers, and some never repeat, such as the
+ * unique names of new connections. So that a long capture does not grow
+ * without bound, the table stops taking new strings past INTERN_MAX_BYTES;
+ * intern() then returns NULL and callers keep their own copy.
+ *
+ * The table is an open addressing hash set shared by the capture thread and the
+ * decode workers. Lookups of known strings only take the read lock.
+ */
+#define INTERN_INITIAL_SIZE 1024
+#define INTERN_BLOCK_SIZE (64 * 1024)
+#define INTERN_MAX_BYTES (4 * 1024 * 1024)
+
+struct intern_slot {
+	uint64_t hash;
+	const char *string;
+};
+
+struct intern_block {
+	struct intern_block *next;
+	size_t used;
+	size_t size;
+	char data[];
+};
+
+struct intern_table {
+	pthread_rwlock_t lock;
+	struct intern_slot *slots;
+	size_t size;
+	size_t count;
+	size_t bytes;
+	struct intern_block *blocks;
+	atomic_ulong lookups;
+	atomic_ulong misses;
+	/* Misses turned down because the table is full. */
+	atomic_ulong refused;
+};
+
+static struct intern_table intern_table = {
+	.lock = PTHREAD_RWLOCK_INITIALIZER
+};
+
+/* FNV-1a. */
+static uint64_t intern_hash(const char *s, size_t *length) {
+	uint64_t hash = 14695981039346656037ULL;
+	const unsigned char *p = (const unsigned char *)s;
+
+	while (*p != '\0') {
+		hash ^= *p++;
+		hash *= 1099511628211ULL;
+	}
+	*length = p - (const unsigned char *)s;
+	return hash;
+}
+
+/* Caller holds the lock. */
+static struct intern_slot *intern_find(struct intern_table *t, const char *s, uint64_t hash) {
+	size_t i;
+
+	if (t->slots == NULL) {
+		return NULL;
+	}
+	for (i = hash & (t->size - 1); t->slots[i].string != NULL; i = (i + 1) & (t->size - 1)) {
+		if (t->slots[i].hash == hash && strcmp(t->slots[i].string, s) == 0) {
+			return &t->slots[i];
+		}
+	}
+	return &t->slots[i];
+}
+
+/* Caller holds the write lock. */
+static bool intern_grow(struct intern_table *t) {
+	size_t size = t->size == 0 ? INTERN_INITIAL_SIZE : t->size * 2;
+	struct intern_slot *slots = calloc(size, sizeof (struct intern_slot));
+	size_t i;
+
+	if (slots == NULL) {
+		return false;
+	}
+	for (i = 0; i < t->size; i++) {
+		if (t->slots[i].string != NULL) {
+			size_t j = t->slots[i].hash & (size - 1);
+			while (slots[j].string != NULL) {
+				j = (j + 1) & (size - 1);
+			}
+			slots[j] = t->slots[i];
+		}
+	}
+	free(t->slots);
+	t->slots = slots;
+	t->size = size;
+	return true;
+}
+
+/* Caller holds the write lock. */
+static const char *intern_copy(struct intern_table *t, const char *s, size_t length) {
+	struct intern_block *block = t->blocks;
+	char *copy;
+
+	if (block == NULL || block->size - block->used < length + 1) {
+		size_t size = length + 1 > INTERN_BLOCK_SIZE ? length + 1 : INTERN_BLOCK_SIZE;
+		block = malloc(sizeof (struct intern_block) + size);
+		if (block == NULL) {
+			return NULL;
+		}
+		block->used = 0;
+		block->size = size;
+		block->next = t->blocks;
+		t->blocks = block;
+	}
+
+	copy = block->data + block->used;
+	memcpy(copy, s, length + 1);
+	block->used += length + 1;
+	t->bytes += length + 1;
+	return copy;
+}
+
+/* Unique copy of 's'. NULL if the table is full or out of memory. */
+static const char *intern(const char *s) {
+	struct intern_table *t = &intern_table;
+	struct intern_slot *slot;
+	const char *result = NULL;
+	size_t length;
+	uint64_t hash = intern_hash(s, &length);
+
+	atomic_fetch_add_explicit(&t->lookups, 1, memory_order_relaxed);
+
+	pthread_rwlock_rdlock(&t->lock);
+	slot = intern_find(t, s, hash);
+	if (slot != NULL) {
+		result = slot->string;
+	}
+	pthread_rwlock_unlock(&t->lock);
+	if (result != NULL) {
+		return result;
+	}
+
+	pthread_rwlock_wrlock(&t->lock);
+	if (t->bytes + length + 1 > INTERN_MAX_BYTES) {
+		pthread_rwlock_unlock(&t->lock);
+		atomic_fetch_add_explicit(&t->refused, 1, memory_order_relaxed);
+		return NULL;
+	}
+	/* Keep the load factor under one half. */
+	if ((t->count + 1) * 2 > t->size && !intern_grow(t)) {
+		pthread_rwlock_unlock(&t->lock);
+		return NULL;
+	}
+	/* Another thread may have inserted it meanwhile. */
+	slot = intern_find(t, s, hash);
+	if (slot->string == NULL) {
+		slot->string = intern_copy(t, s, length);
+		if (slot->string != NULL) {
+			slot->hash = hash;
+			t->count++;
+			atomic_fetch_add_explicit(&t->misses, 1, memory_order_relaxed);
+		}
+	}
+	result = slot->string;
+	pthread_rwlock_unlock(&t->lock);
+	return result;
+}
+
+static const char *intern_or_null(const char *s) {
+	return s != NULL ? intern(s) : NULL;
+}
+
+/* JSON string node for an interned copy of 's'. */
+static JsonNode *json_mkstring_interned(const char *s) {
+	const char *interned = intern(s);
+
+	if (interned == NULL) {
+		return json_mkstring(s);
+	}
+	return json_mkstring_ref(interned);
+}
+
+static void intern_clear(struct intern_table *t) {
+	struct intern_block *block = t->blocks;
+
+	while (block != NULL) {
+		struct intern_block *next = block->next;
+		free(block);
+		block = next;
+	}
+	free(t->slots);
+	t->slots = NULL;
+	t->blocks = NULL;
+	t->size = 0;
+	t->count = 0;
+	t->bytes = 0;
+}
+
+static void print_intern_stats(struct intern_table *t) {
+	unsigned long lookups = atomic_load(&t->lookups);
+	unsigned long misses = atomic_load(&t->misses);
+	unsigned long refused = atomic_load(&t->refused);
+
+	pthread_rwlock_rdlock(&t->lock);
+	fprintf(logfile, "STATS: Interned strings: %zu distinct, %zu bytes, %lu lookups (%.1f%% hits).\n",
+		t->count, t->bytes, lookups,
+		lookups == 0 ? 0.0 : 100.0 * (lookups - misses - refused) / lookups);
+	if (refused > 0) {
+		fprintf(logfile, "STATS: Interned strings: table full, %lu strings not interned.\n", refused);
+	}
+	pthread_rwlock_unlock(&t->lock);
+}
+
+
 /**
  * Arguments can be of the following types:
  *
@@ -502,130 +715,455 @@ struct JsonNode *dbus_xml_parser(char *source) {
 
 
 /**
- * Since arguments in D-Bus can be complicated stuff, we dedicate a function to
- * transform the received arguments to a JSON structure.
+ * Decode budget
+ *
+ * A single argument can be a byte array of many megabytes or containers nested
+ * 64 levels deep, and decoding it stalls the capture. -D limits the number of
+ * arguments, the nesting depth of containers, the number of elements of each
+ * array and the bytes of each string decoded for a message. What goes beyond
+ * is left out, and the argument holding it, as well as the message, get a
+ * "truncated" field. With -D none, arguments are not decoded at all.
+ *
+ * With every limit set, the work done for a message is bounded whatever its
+ * size: the rest of an array is skipped without being read, and strings are
+ * only scanned up to the limit.
+ *
+ * The decoders walk nested containers with an explicit stack rather than by
+ * recursion. The specification bounds the nesting to 64 levels, variants
+ * included, and so does the stack: anything deeper is left out as if it were
+ * beyond the depth limit.
  */
-/* TODO: get arg name. */
-struct JsonNode *args_mangler(DBusMessageIter *args) {
-	struct JsonNode *args_node = json_mkobject();
+#define DECODE_STACK_SIZE (2 * DBUS_MAXIMUM_TYPE_RECURSION_DEPTH)
+
+struct decode_limits {
+	bool header_only;
+	unsigned int args;
+	unsigned int depth;
+	unsigned int elements;
+	size_t bytes;
+};
+
+/* 0 means no limit. */
+static struct decode_limits decode_limits;
+static const char *decode_spec = NULL;
+
+/* Messages with something left out. */
+static atomic_ulong decode_truncated;
+
+/* Deepest nesting of containers seen. */
+static atomic_uint decode_max_depth;
+
+/* Decoding state of one message. */
+struct decode_budget {
+	unsigned int depth;
+	unsigned int max_depth;
+	unsigned long truncated;
+};
+
+static const char *arg_type_name(int type);
+static bool arg_has_value(int type);
+static size_t parse_size(const char *arg);
+
+/* Parse "none" or "[args=N][,depth=N][,elements=N][,bytes=SIZE]". */
+static bool decode_limits_parse(const char *spec) {
+	enum { OPT_ARGS, OPT_DEPTH, OPT_ELEMENTS, OPT_BYTES };
+	char *const tokens[] = { "args", "depth", "elements", "bytes", NULL };
+	/* getsubopt() cuts the string. */
+	char *copy = strdup(spec);
+	char *options = copy;
+	char *value;
+	bool ok = true;
+
+	if (strcmp(spec, "none") == 0) {
+		decode_limits.header_only = true;
+		free(copy);
+		return true;
+	}
+
+	while (ok && *options != '\0') {
+		int token = getsubopt(&options, tokens, &value);
+		unsigned long number;
+
+		if (token == -1 || value == NULL) {
+			ok = false;
+			break;
+		}
+		number = token == OPT_BYTES ? parse_size(value) : strtoul(value, NULL, 10);
+		ok = number > 0;
+		switch (token) {
+		case OPT_ARGS:
+			decode_limits.args = number;
+			break;
+		case OPT_DEPTH:
+			decode_limits.depth = number;
+			break;
+		case OPT_ELEMENTS:
+			decode_limits.elements = number;
+			break;
+		default:
+			decode_limits.bytes = number;
+			break;
+		}
+	}
+
+	free(copy);
+	if (!ok) {
+		fprintf(logfile, "ERROR: Invalid decode limits '%s'.\n", spec);
+	}
+	return ok;
+}
+
+static void print_decode_stats(void) {
+	unsigned long truncated = atomic_load(&decode_truncated);
+	unsigned int depth = atomic_load(&decode_max_depth);
+
+	if (truncated > 0 || depth > 0) {
+		fprintf(logfile, "STATS: Decode: %lu messages truncated, containers nested up to %u levels.\n",
+			truncated, depth);
+	}
+}
+
+/* Account for a decoded message. */
+static void decode_finish(struct decode_budget *budget) {
+	unsigned int depth = atomic_load_explicit(&decode_max_depth, memory_order_relaxed);
+
+	if (budget->truncated > 0) {
+		atomic_fetch_add(&decode_truncated, 1);
+	}
+	while (budget->max_depth > depth &&
+		!atomic_compare_exchange_weak_explicit(&decode_max_depth, &depth, budget->max_depth,
+			memory_order_relaxed, memory_order_relaxed)) {
+	}
+}
+
+/* Going into a container. */
+static void decode_enter(struct decode_budget *budget) {
+	budget->depth++;
+	if (budget->depth > budget->max_depth) {
+		budget->max_depth = budget->depth;
+	}
+}
+
+static void decode_leave(struct decode_budget *budget) {
+	budget->depth--;
+}
+
+/* True if a message already has as many arguments as allowed and more follow. */
+static bool decode_enough_args(struct decode_budget *budget, unsigned int count) {
+	if (decode_limits.args != 0 && count >= decode_limits.args) {
+		budget->truncated++;
+		return true;
+	}
+	return false;
+}
+
+/* True if a container at the current depth must be left out. */
+static bool decode_too_deep(struct decode_budget *budget, int type) {
+	if (dbus_type_is_container(type) && (budget->depth >= DECODE_STACK_SIZE ||
+			(decode_limits.depth != 0 && budget->depth >= decode_limits.depth))) {
+		budget->truncated++;
+		return true;
+	}
+	return false;
+}
+
+/* True if an array already has as many elements as allowed and more follow. */
+static bool decode_enough_elements(struct decode_budget *budget, unsigned int count) {
+	if (decode_limits.elements != 0 && count >= decode_limits.elements) {
+		budget->truncated++;
+		return true;
+	}
+	return false;
+}
+
+/* Copy of 'value' cut within the byte limit on a UTF-8 character boundary, or */
+/* NULL if it fits. WARNING: manual free. */
+static char *decode_string_cut(const char *value, struct decode_budget *budget) {
+	size_t length;
+	char *cut;
+
+	if (decode_limits.bytes == 0 || (length = strnlen(value, decode_limits.bytes + 1)) <= decode_limits.bytes) {
+		return NULL;
+	}
+
+	length = decode_limits.bytes;
+	while (length > 0 && ((unsigned char)value[length] & 0xc0) == 0x80) {
+		length--;
+	}
+	cut = malloc(length + 1);
+	memcpy(cut, value, length);
+	cut[length] = '\0';
+	budget->truncated++;
+	return cut;
+}
+
+
+/**
+ * Fixed-size arrays
+ *
+ * Arrays of fixed-size basic types (ay, ab, an, aq, ai, au, ax, at, ad) are
+ * contiguous in the wire format. They are read in one go with
+ * dbus_message_iter_get_fixed_array() instead of one iterator step and one
+ * {type,value} object per element. With -y, byte arrays, e.g. images and
+ * blobs, are written as a single base64 or hex string. Only those which are
+ * the value of an argument object are, since the "encoding" field of that
+ * object tells how to read them: the elements of an array, e.g. of 'aay' or
+ * 'a{say}', have no object and stay arrays of numbers.
+ */
+enum ByteArrayFormat {
+	BYTES_ARRAY,
+	BYTES_BASE64,
+	BYTES_HEX
+};
+
+static enum ByteArrayFormat option_byte_format = BYTES_ARRAY;
+
+/* Unix FDs are fixed-size too, but only have a type. */
+static bool fixed_array_type(int type) {
+	return type != DBUS_TYPE_UNIX_FD && dbus_type_is_fixed(type);
+}
+
+static int byte_format_parse(const char *name) {
+	if (strcmp(name, "array") == 0) {
+		option_byte_format = BYTES_ARRAY;
+	} else if (strcmp(name, "base64") == 0) {
+		option_byte_format = BYTES_BASE64;
+	} else if (strcmp(name, "hex") == 0) {
+		option_byte_format = BYTES_HEX;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+/* Name of the byte array encoding, as found in the "encoding" field. NULL */
+/* for plain arrays. */
+static const char *byte_format_name(void) {
+	switch (option_byte_format) {
+	case BYTES_BASE64:
+		return "base64";
+	case BYTES_HEX:
+		return "hex";
+	default:
+		return NULL;
+	}
+}
+
+/* Encoding of the array 'args', as found in the "encoding" field. NULL if */
+/* its elements are numbers. */
+static const char *array_encoding(DBusMessageIter *args) {
+	if (dbus_message_iter_get_element_type(args) != DBUS_TYPE_BYTE) {
+		return NULL;
+	}
+	return byte_format_name();
+}
 
-	int type = dbus_message_iter_get_arg_type(args);
+/* 'data' as a base64 or hex string, following option_byte_format. WARNING: */
+/* manual free. */
+static char *bytes_encode(const unsigned char *data, size_t count) {
+	static const char base64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	static const char hex[] = "0123456789abcdef";
+	char *result;
+	char *p;
+	size_t i;
+
+	if (option_byte_format == BYTES_HEX) {
+		result = p = malloc(count * 2 + 1);
+		for (i = 0; i < count; i++) {
+			*p++ = hex[data[i] >> 4];
+			*p++ = hex[data[i] & 0x0f];
+		}
+		*p = '\0';
+		return result;
+	}
 
-	/* TODO: check if useful to log it or not. I guess so. See below. */
-	/* if (type == DBUS_TYPE_INVALID) */
-	/*     break; */
+	result = p = malloc((count + 2) / 3 * 4 + 1);
+	for (i = 0; i + 2 < count; i += 3) {
+		uint32_t v = (uint32_t)data[i] << 16 | (uint32_t)data[i + 1] << 8 | data[i + 2];
+		*p++ = base64[v >> 18];
+		*p++ = base64[(v >> 12) & 0x3f];
+		*p++ = base64[(v >> 6) & 0x3f];
+		*p++ = base64[v & 0x3f];
+	}
+	if (i < count) {
+		uint32_t v = (uint32_t)data[i] << 16 | (i + 1 < count ? (uint32_t)data[i + 1] << 8 : 0);
+		*p++ = base64[v >> 18];
+		*p++ = base64[(v >> 12) & 0x3f];
+		*p++ = i + 1 < count ? base64[(v >> 6) & 0x3f] : '=';
+		*p++ = '=';
+	}
+	*p = '\0';
+	return result;
+}
 
+/* Element 'i' of a fixed array of 'type', as a JSON number. */
+static JsonNode *fixed_array_node(const void *data, int type, size_t i) {
 	switch (type) {
-	case DBUS_TYPE_STRING:
-	{
-		char *value;
-		dbus_message_iter_get_basic(args, &value);
-		json_append_member(args_node, DBUS_JSON_ARG_TYPE, json_mkstring("string"));
-		json_append_member(args_node, DBUS_JSON_ARG_VALUE,
-			json_mkstring(value));
-		break;
+	case DBUS_TYPE_BYTE:
+		return json_mkunsigned(((const unsigned char *)data)[i]);
+	case DBUS_TYPE_BOOLEAN:
+		return json_mkinteger(((const dbus_bool_t *)data)[i]);
+	case DBUS_TYPE_INT16:
+		return json_mkinteger(((const dbus_int16_t *)data)[i]);
+	case DBUS_TYPE_UINT16:
+		return json_mkunsigned(((const dbus_uint16_t *)data)[i]);
+	case DBUS_TYPE_INT32:
+		return json_mkinteger(((const dbus_int32_t *)data)[i]);
+	case DBUS_TYPE_UINT32:
+		return json_mkunsigned(((const dbus_uint32_t *)data)[i]);
+	case DBUS_TYPE_INT64:
+		return json_mkinteger(((const dbus_int64_t *)data)[i]);
+	case DBUS_TYPE_UINT64:
+		return json_mkunsigned(((const dbus_uint64_t *)data)[i]);
+	default:
+		return json_mknumber(((const double *)data)[i]);
 	}
+}
 
-	case DBUS_TYPE_SIGNATURE:
-	{
-		char *value;
-		dbus_message_iter_get_basic(args, &value);
-		json_append_member(args_node, DBUS_JSON_ARG_TYPE, json_mkstring("signature"));
-		json_append_member(args_node, DBUS_JSON_ARG_VALUE,
-			json_mkstring(value));
+/* Same as fixed_array_node(), streamed. */
+static void fixed_array_write(JsonWriter *w, const void *data, int type, size_t i) {
+	switch (type) {
+	case DBUS_TYPE_BYTE:
+		json_writer_unsigned(w, ((const unsigned char *)data)[i]);
+		break;
+	case DBUS_TYPE_BOOLEAN:
+		json_writer_integer(w, ((const dbus_bool_t *)data)[i]);
+		break;
+	case DBUS_TYPE_INT16:
+		json_writer_integer(w, ((const dbus_int16_t *)data)[i]);
+		break;
+	case DBUS_TYPE_UINT16:
+		json_writer_unsigned(w, ((const dbus_uint16_t *)data)[i]);
+		break;
+	case DBUS_TYPE_INT32:
+		json_writer_integer(w, ((const dbus_int32_t *)data)[i]);
+		break;
+	case DBUS_TYPE_UINT32:
+		json_writer_unsigned(w, ((const dbus_uint32_t *)data)[i]);
+		break;
+	case DBUS_TYPE_INT64:
+		json_writer_integer(w, ((const dbus_int64_t *)data)[i]);
+		break;
+	case DBUS_TYPE_UINT64:
+		json_writer_unsigned(w, ((const dbus_uint64_t *)data)[i]);
+		break;
+	default:
+		json_writer_number(w, ((const double *)data)[i]);
 		break;
 	}
+}
+
+/* Read the fixed array under 'subargs'. Returns the number of elements to */
+/* decode, within the element limit. */
+static size_t fixed_array_get(DBusMessageIter *subargs, const void **data, struct decode_budget *budget) {
+	int count;
+
+	dbus_message_iter_get_fixed_array(subargs, data, &count);
+	if (decode_limits.elements != 0 && (size_t)count > decode_limits.elements) {
+		budget->truncated++;
+		return decode_limits.elements;
+	}
+	return count;
+}
+
+
+/**
+ * Since arguments in D-Bus can be complicated stuff, we dedicate a function to
+ * transform the received arguments to a JSON structure.
+ *
+ * Every argument is an object with its 'type' and 'value'. Since D-Bus array
+ * elements are all of the same type, we store this information once as
+ * 'arraytype', and elements only have their value. Variants, structs and dict
+ * entries hold full argument objects.
+ *
+ * Containers are walked with an explicit stack: a frame per open container,
+ * holding the iterator on its contents and the JSON nodes they go to. JSON
+ * nodes can be filled after they have a parent, so every node is attached as
+ * soon as it is created.
+ */
+struct mangler_frame {
+	DBusMessageIter iter;
+	int type;
+	/* Argument object holding the container, NULL for array elements. */
+	JsonNode *object;
+	/* Where contents go, NULL for variants: their content is the value. */
+	JsonNode *array;
+	unsigned long truncated;
+	unsigned int count;
+};
 
-	/* TODO: object_path or path? */
+/* JSON value of a basic type, NULL for others. */
+static JsonNode *args_basic_node(DBusMessageIter *args, int type, struct decode_budget *budget) {
+	switch (type) {
+	case DBUS_TYPE_STRING:
+	case DBUS_TYPE_SIGNATURE:
 	case DBUS_TYPE_OBJECT_PATH:
 	{
 		char *value;
+		char *cut;
+		JsonNode *node;
+
 		dbus_message_iter_get_basic(args, &value);
-		json_append_member(args_node, DBUS_JSON_ARG_TYPE, json_mkstring("object_path"));
-		json_append_member(args_node, DBUS_JSON_ARG_VALUE,
-			json_mkstring(value));
-		break;
+		cut = decode_string_cut(value, budget);
+		node = json_mkstring(cut != NULL ? cut : value);
+		free(cut);
+		return node;
 	}
 
 	case DBUS_TYPE_INT16:
 	{
 		dbus_int16_t value;
 		dbus_message_iter_get_basic(args, &value);
-		json_append_member(args_node, DBUS_JSON_ARG_TYPE, json_mkstring("int16"));
-		json_append_member(args_node, DBUS_JSON_ARG_VALUE,
-			json_mknumber(value));
-		break;
+		return json_mkinteger(value);
 	}
 
 	case DBUS_TYPE_UINT16:
 	{
 		dbus_uint16_t value;
 		dbus_message_iter_get_basic(args, &value);
-		json_append_member(args_node, DBUS_JSON_ARG_TYPE, json_mkstring("uint16"));
-		json_append_member(args_node, DBUS_JSON_ARG_VALUE,
-			json_mknumber(value));
-		break;
+		return json_mkunsigned(value);
 	}
 
 	case DBUS_TYPE_INT32:
 	{
 		dbus_int32_t value;
 		dbus_message_iter_get_basic(args, &value);
-		json_append_member(args_node, DBUS_JSON_ARG_TYPE, json_mkstring("int32"));
-		json_append_member(args_node, DBUS_JSON_ARG_VALUE,
-			json_mknumber(value));
-		break;
+		return json_mkinteger(value);
 	}
 
 	case DBUS_TYPE_UINT32:
 	{
 		dbus_uint32_t value;
 		dbus_message_iter_get_basic(args, &value);
-		json_append_member(args_node, DBUS_JSON_ARG_TYPE, json_mkstring("uint32"));
-		json_append_member(args_node, DBUS_JSON_ARG_VALUE,
-			json_mknumber(value));
-		break;
+		return json_mkunsigned(value);
 	}
 
-	/* TODO: check if 64 bit works properly. */
 	case DBUS_TYPE_INT64:
 	{
 		dbus_int64_t value;
 		dbus_message_iter_get_basic(args, &value);
-		json_append_member(args_node, DBUS_JSON_ARG_TYPE, json_mkstring("int64"));
-		json_append_member(args_node, DBUS_JSON_ARG_VALUE,
-			json_mknumber(value));
-		break;
+		return json_mkinteger(value);
 	}
 
 	case DBUS_TYPE_UINT64:
 	{
 		dbus_uint64_t value;
 		dbus_message_iter_get_basic(args, &value);
-		json_append_member(args_node, DBUS_JSON_ARG_TYPE, json_mkstring("uint64"));
-		json_append_member(args_node, DBUS_JSON_ARG_VALUE,
-			json_mknumber(value));
-		break;
+		return json_mkunsigned(value);
 	}
 
 	case DBUS_TYPE_DOUBLE:
 	{
 		double value;
 		dbus_message_iter_get_basic(args, &value);
-		json_append_member(args_node, DBUS_JSON_ARG_TYPE, json_mkstring("double"));
-		json_append_member(args_node, DBUS_JSON_ARG_VALUE,
-			json_mknumber(value));
-		break;
+		return json_mknumber(value);
 	}
 
 	case DBUS_TYPE_BYTE:
 	{
 		unsigned char value;
 		dbus_message_iter_get_basic(args, &value);
-		json_append_member(args_node, DBUS_JSON_ARG_TYPE, json_mkstring("byte"));
-		json_append_member(args_node, DBUS_JSON_ARG_VALUE,
-			json_mknumber(value));
-		break;
+		return json_mkunsigned(value);
 	}
 
 	/* TODO: bool or boolean? */
@@ -633,113 +1171,172 @@ struct JsonNode *args_mangler(DBusMessageIter *args) {
 	{
 		dbus_bool_t value;
 		dbus_message_iter_get_basic(args, &value);
-		json_append_member(args_node, DBUS_JSON_ARG_TYPE, json_mkstring("bool"));
-		json_append_member(args_node, DBUS_JSON_ARG_VALUE,
-			json_mknumber(value));
-		break;
+		return json_mkinteger(value);
 	}
 
-	/* TODO: Needs testing. */
-	case DBUS_TYPE_VARIANT:
-	{
-		DBusMessageIter subargs;
-		dbus_message_iter_recurse(args, &subargs);
-		json_append_member(args_node, DBUS_JSON_ARG_TYPE, json_mkstring("variant"));
-		json_append_member(args_node, DBUS_JSON_ARG_VALUE,
-			args_mangler(&subargs));
-		break;
+	default:
+		return NULL;
 	}
+}
 
-	/* TODO: Needs testing. Seems to be ok. */
-
-	/* Since D-Bus array elements are all of the same type, we store this */
-	/* information along 'type' and 'value', 'value' being a JSON array with the */
-	/* values. That's why we need to strip the type information from the */
-	/* recursive call. But since JSON does not allow multiple parents, with must */
-	/* remove the parent first. */
-	case DBUS_TYPE_ARRAY:
-	{
-		DBusMessageIter subargs;
-		dbus_message_iter_recurse(args, &subargs);
-		struct JsonNode *array = json_mkarray();
-		struct JsonNode *arraytype;
-		struct JsonNode *arrayvalue;
-		struct JsonNode *arrayarg;
-
-		arraytype = json_find_member(args_mangler(&subargs), DBUS_JSON_ARG_TYPE);
-		json_remove_from_parent(arraytype);
-
-		while (dbus_message_iter_get_arg_type(&subargs) !=
-			DBUS_TYPE_INVALID) {
-			arrayarg = args_mangler(&subargs);
-			arrayvalue = json_find_member(arrayarg, DBUS_JSON_ARG_VALUE);
-			json_remove_from_parent(arrayvalue);
-			json_append_element(array, arrayvalue);
+/* JSON value of an array read in one go, NULL if it cannot be. An 'element' */
+/* of another array is never encoded, having no object to say so. */
+static JsonNode *args_fixed_array_node(DBusMessageIter *args, bool element, struct decode_budget *budget) {
+	DBusMessageIter subargs;
+	int subtype = dbus_message_iter_get_element_type(args);
+	const char *encoding = element ? NULL : array_encoding(args);
+	const void *data;
+	size_t length;
+	JsonNode *array;
+	size_t i;
+
+	if (!fixed_array_type(subtype)) {
+		return NULL;
+	}
 
-			/* TODO: CHECK if no JSON element is lost. */
-			json_delete(arrayarg);
-			dbus_message_iter_next(&subargs);
-		}
+	dbus_message_iter_recurse(args, &subargs);
+	length = fixed_array_get(&subargs, &data, budget);
+	if (encoding != NULL) {
+		char *encoded = bytes_encode(data, length);
 
-		json_append_member(args_node, DBUS_JSON_ARG_TYPE, json_mkstring("array"));
-		json_append_member(args_node, DBUS_JSON_ARG_ARRAYTYPE, arraytype);
-		json_append_member(args_node, DBUS_JSON_ARG_VALUE, array);
+		array = json_mkstring(encoded);
+		free(encoded);
+		return array;
+	}
 
-		break;
+	array = json_mkarray();
+	for (i = 0; i < length; i++) {
+		json_append_element(array, fixed_array_node(data, subtype, i));
 	}
+	return array;
+}
 
-	/* TODO: check if JSON structure is right here. */
-	case DBUS_TYPE_DICT_ENTRY:
-	{
-		DBusMessageIter subargs;
-		dbus_message_iter_recurse(args, &subargs);
-
-		struct JsonNode *dict = json_mkarray();
-		json_append_element(dict, args_mangler(&subargs));
-		dbus_message_iter_next(&subargs);
-		json_append_element(dict, args_mangler(&subargs));
-
-		json_append_member(args_node, DBUS_JSON_ARG_TYPE, json_mkstring("dict_entry"));
-		json_append_member(args_node, DBUS_JSON_ARG_VALUE, dict);
-		break;
+/* Add 'node' to the container of 'frame'. */
+static void args_attach(struct mangler_frame *frame, JsonNode *node) {
+	if (frame->array != NULL) {
+		json_append_element(frame->array, node);
+	} else {
+		json_append_member_ref(frame->object, DBUS_JSON_ARG_VALUE, node);
 	}
+}
 
-	case DBUS_TYPE_STRUCT:
-	{
-		DBusMessageIter subargs;
-		dbus_message_iter_recurse(args, &subargs);
-		struct JsonNode *structure = json_mkarray();
+/* TODO: get arg name. */
+struct JsonNode *args_mangler(DBusMessageIter *args, struct decode_budget *budget) {
+	struct mangler_frame stack[DECODE_STACK_SIZE];
+	unsigned int sp = 0;
+	DBusMessageIter *iter = args;
+	bool element = false;
+	JsonNode *result = NULL;
+
+	for (;;) {
+		int type = dbus_message_iter_get_arg_type(iter);
+		const char *name = arg_type_name(type);
+		unsigned long truncated = budget->truncated;
+		JsonNode *object = NULL;
+		JsonNode *value = NULL;
+		bool pushed = false;
+
+		/* The argument object, with what is known before the value. */
+		if (!element) {
+			object = json_mkobject();
+			if (sp == 0) {
+				result = object;
+			} else {
+				args_attach(&stack[sp - 1], object);
+			}
+			if (name == NULL) {
+				fprintf(logfile, "WARNING: Type (%c) out of specification!\n", type);
+			} else {
+				json_append_member_ref(object, DBUS_JSON_ARG_TYPE, json_mkstring_ref(name));
+			}
+			if (type == DBUS_TYPE_ARRAY) {
+				DBusMessageIter subargs;
+				const char *subname;
+
+				dbus_message_iter_recurse(iter, &subargs);
+				subname = arg_type_name(dbus_message_iter_get_arg_type(&subargs));
+				json_append_member_ref(object, DBUS_JSON_ARG_ARRAYTYPE,
+					subname != NULL ? json_mkstring_ref(subname) : json_mknull());
+				if (array_encoding(iter) != NULL) {
+					json_append_member_ref(object, DBUS_JSON_ARG_ENCODING,
+						json_mkstring_ref(array_encoding(iter)));
+				}
+			}
+		}
 
-		while (dbus_message_iter_get_arg_type(&subargs) !=
-			DBUS_TYPE_INVALID) {
-			json_append_element(structure, args_mangler(&subargs));
-			dbus_message_iter_next(&subargs);
+		/* The value. Unix FDs and invalid arguments have none: the tree */
+		/* gets a null in arrays. */
+		if (!arg_has_value(type)) {
+			if (element) {
+				value = json_mknull();
+			}
+		} else if (decode_too_deep(budget, type)) {
+			value = json_mknull();
+		} else if (!dbus_type_is_container(type)) {
+			value = args_basic_node(iter, type, budget);
+		} else if (type == DBUS_TYPE_ARRAY && (value = args_fixed_array_node(iter, element, budget)) != NULL) {
+			/* Read in one go. */
+		} else {
+			struct mangler_frame *frame = &stack[sp++];
+
+			dbus_message_iter_recurse(iter, &frame->iter);
+			frame->type = type;
+			frame->object = object;
+			/* The content of a variant is its value, or the element itself in */
+			/* an array. */
+			if (type != DBUS_TYPE_VARIANT) {
+				frame->array = json_mkarray();
+			} else {
+				frame->array = object == NULL ? stack[sp - 2].array : NULL;
+			}
+			frame->truncated = truncated;
+			frame->count = 0;
+			value = type != DBUS_TYPE_VARIANT ? frame->array : NULL;
+			decode_enter(budget);
+			pushed = true;
 		}
 
-		json_append_member(args_node, DBUS_JSON_ARG_TYPE, json_mkstring("struct"));
-		json_append_member(args_node, DBUS_JSON_ARG_VALUE, structure);
-		break;
-	}
+		if (value != NULL) {
+			if (object != NULL) {
+				json_append_member_ref(object, DBUS_JSON_ARG_VALUE, value);
+			} else {
+				args_attach(&stack[sp - (pushed ? 2 : 1)], value);
+			}
+		}
 
-	/* TODO: write something else ? */
-	case DBUS_TYPE_UNIX_FD:
-	{
-		json_append_member(args_node, DBUS_JSON_ARG_TYPE, json_mkstring("unix_fd"));
-		break;
-	}
+		if (!pushed) {
+			if (object != NULL && budget->truncated != truncated) {
+				json_append_member_ref(object, DBUS_JSON_TRUNCATED, json_mkbool(true));
+			}
+			if (sp == 0) {
+				return result;
+			}
+			dbus_message_iter_next(&stack[sp - 1].iter);
+		}
 
-	case DBUS_TYPE_INVALID:
-	{
-		json_append_member(args_node, DBUS_JSON_ARG_TYPE, json_mkstring("invalid"));
-		break;
-	}
+		/* Close the containers which are done, then go on with the next */
+		/* item of the innermost one. */
+		for (;;) {
+			struct mangler_frame *frame = &stack[sp - 1];
 
-	default:
-		fprintf(logfile, "WARNING: Type (%c) out of specification!\n", type);
-		break;
-	}
+			if (dbus_message_iter_get_arg_type(&frame->iter) != DBUS_TYPE_INVALID &&
+				!(frame->type == DBUS_TYPE_ARRAY && decode_enough_elements(budget, frame->count))) {
+				frame->count++;
+				iter = &frame->iter;
+				element = frame->type == DBUS_TYPE_ARRAY;
+				break;
+			}
 
-	return args_node;
+			decode_leave(budget);
+			if (frame->object != NULL && budget->truncated != frame->truncated) {
+				json_append_member_ref(frame->object, DBUS_JSON_TRUNCATED, json_mkbool(true));
+			}
+			if (--sp == 0) {
+				return result;
+			}
+			dbus_message_iter_next(&stack[sp - 1].iter);
+		}
+	}
 }
 
 
@@ -794,131 +1391,205 @@ enum Flags {
 	FLAG_ERROR_NAME = 64
 };
 
-/* WARNING: manual free with json_delete(node). */
-struct JsonNode *message_mangler(DBusMessage *message) {
-	struct JsonNode *message_node = json_mkobject();
-	enum Flags flag = 0;
+/**
+ * Timestamps
+ *
+ * Messages are timestamped with clock_gettime(), which is served by the vDSO
+ * without a system call. The clock is chosen with -t. With 'batch', all the
+ * messages read in one wakeup of the event loop share the same timestamp.
+ *
+ * The human readable time only changes once per second, so the broken-down
+ * time of the last second seen is kept per thread instead of calling gmtime()
+ * for every message.
+ */
+enum TimestampClock {
+	TIMESTAMP_REALTIME,
+	TIMESTAMP_COARSE,
+	TIMESTAMP_MONOTONIC,
+	TIMESTAMP_BATCH
+};
 
-	/* TIME */
-	struct timeval time_machine;
-	struct tm *time_human;
+static enum TimestampClock option_clock = TIMESTAMP_REALTIME;
 
-	/* TODO: check APPLE support since it is supposed to have a different struct */
-	/* timeval. */
-	if (gettimeofday(&time_machine, NULL) < 0) {
-		fprintf(logfile, "ERROR: Could not get timestamp.\n");
-		return NULL;
+static void timestamp_now(struct timespec *ts) {
+	clockid_t id = CLOCK_REALTIME;
+
+	switch (option_clock) {
+	case TIMESTAMP_COARSE:
+		id = CLOCK_REALTIME_COARSE;
+		break;
+	case TIMESTAMP_MONOTONIC:
+		id = CLOCK_MONOTONIC;
+		break;
+	default:
+		break;
 	}
 
-	/* TODO: use argv parameter to request human readable time and local/UTC. */
-	/* Use "localtime" or "gmtime" to get date and time from the elapsed seconds */
-	/* since epoch. */
-	/* time_human = localtime( &(time_machine.tv_sec) ); */
-	time_human = gmtime(&(time_machine.tv_sec));
+	if (clock_gettime(id, ts) == -1) {
+		ts->tv_sec = 0;
+		ts->tv_nsec = 0;
+	}
+}
 
-	json_append_member(message_node, DBUS_JSON_SEC,
-		json_mknumber(time_machine.tv_sec));
-	json_append_member(message_node, DBUS_JSON_USEC,
-		json_mknumber(time_machine.tv_usec));
+/* Return -1 if 'name' is not a clock. */
+static int timestamp_parse_clock(const char *name) {
+	if (strcmp(name, "realtime") == 0) {
+		option_clock = TIMESTAMP_REALTIME;
+	} else if (strcmp(name, "coarse") == 0) {
+		option_clock = TIMESTAMP_COARSE;
+	} else if (strcmp(name, "monotonic") == 0) {
+		option_clock = TIMESTAMP_MONOTONIC;
+	} else if (strcmp(name, "batch") == 0) {
+		option_clock = TIMESTAMP_BATCH;
+	} else {
+		return -1;
+	}
+	return 0;
+}
 
-	/* TODO: make this field optional. */
-	struct JsonNode *time_node = json_mkobject();
-	json_append_member(time_node, DBUS_JSON_HOUR,
-		json_mknumber(time_human->tm_hour));
-	json_append_member(time_node, DBUS_JSON_MINUTE, json_mknumber(time_human->tm_min));
-	json_append_member(time_node, DBUS_JSON_SECOND, json_mknumber(time_human->tm_sec));
-	json_append_member(message_node, DBUS_JSON_TIME_HUMAN, time_node);
+/* Broken-down UTC time of 'sec'. The result is valid until the next call from */
+/* the same thread. */
+static const struct tm *timestamp_human(time_t sec) {
+	static _Thread_local struct tm cache_tm;
+	static _Thread_local time_t cache_sec = -1;
 
-	/* TYPE */
-	switch (dbus_message_get_type(message)) {
-	/* TODO: check if serial is different / needed for error and method return. */
-	case DBUS_MESSAGE_TYPE_ERROR:
-		json_append_member(message_node, DBUS_JSON_TYPE,
-			json_mkstring(DBUS_JSON_ERROR));
-		flag = FLAG_SERIAL | FLAG_ERROR_NAME | FLAG_REPLY_SERIAL;
-		break;
+	if (sec != cache_sec) {
+		/* TODO: use argv parameter to request local time. */
+		if (gmtime_r(&sec, &cache_tm) == NULL) {
+			memset(&cache_tm, 0, sizeof cache_tm);
+		}
+		cache_sec = sec;
+	}
+	return &cache_tm;
+}
 
+/* Name of a message type, as found in the "type" field. */
+static const char *message_type_name(int type) {
+	switch (type) {
+	case DBUS_MESSAGE_TYPE_ERROR:
+		return DBUS_JSON_ERROR;
 	case DBUS_MESSAGE_TYPE_METHOD_CALL:
-		json_append_member(message_node, DBUS_JSON_TYPE,
-			json_mkstring(DBUS_JSON_METHOD_CALL));
-		flag = FLAG_SERIAL | FLAG_PATH | FLAG_INTERFACE | FLAG_MEMBER;
-		break;
-
+		return DBUS_JSON_METHOD_CALL;
 	case DBUS_MESSAGE_TYPE_METHOD_RETURN:
-		json_append_member(message_node, DBUS_JSON_TYPE,
-			json_mkstring(DBUS_JSON_METHOD_RETURN));
-		flag = FLAG_SERIAL | FLAG_REPLY_SERIAL;
-		break;
-
+		return DBUS_JSON_METHOD_RETURN;
 	case DBUS_MESSAGE_TYPE_SIGNAL:
-		json_append_member(message_node, DBUS_JSON_TYPE,
-			json_mkstring(DBUS_JSON_SIGNAL));
-		flag = FLAG_SERIAL | FLAG_PATH | FLAG_INTERFACE | FLAG_MEMBER;
-		break;
+		return DBUS_JSON_SIGNAL;
+	default:
+		return DBUS_JSON_UNKNOWN;
+	}
+}
 
+/* Header fields reported for a message type. */
+static enum Flags message_type_flags(int type) {
+	switch (type) {
+	/* TODO: check if serial is different / needed for error and method return. */
+	case DBUS_MESSAGE_TYPE_ERROR:
+		return FLAG_SERIAL | FLAG_ERROR_NAME | FLAG_REPLY_SERIAL;
+	case DBUS_MESSAGE_TYPE_METHOD_CALL:
+		return FLAG_SERIAL | FLAG_PATH | FLAG_INTERFACE | FLAG_MEMBER;
+	case DBUS_MESSAGE_TYPE_METHOD_RETURN:
+		return FLAG_SERIAL | FLAG_REPLY_SERIAL;
+	case DBUS_MESSAGE_TYPE_SIGNAL:
+		return FLAG_SERIAL | FLAG_PATH | FLAG_INTERFACE | FLAG_MEMBER;
 	default:
-		json_append_member(message_node, DBUS_JSON_TYPE,
-			json_mkstring(DBUS_JSON_UNKNOWN));
-		flag =
-			FLAG_SERIAL | FLAG_PATH | FLAG_INTERFACE | FLAG_MEMBER |
+		return FLAG_SERIAL | FLAG_PATH | FLAG_INTERFACE | FLAG_MEMBER |
 			FLAG_ERROR_NAME | FLAG_REPLY_SERIAL;
-		break;
 	}
+}
+
+/* WARNING: manual free with json_delete(node). */
+/* The timestamp is the time the message was caught. If NULL, the current time */
+/* is used. */
+struct JsonNode *message_mangler(DBusMessage *message, const struct timespec *timestamp) {
+	struct JsonNode *message_node = json_mkobject();
+	enum Flags flag = 0;
+
+	/* TIME */
+	struct timespec time_machine;
+	const struct tm *time_human;
+
+	if (timestamp != NULL) {
+		time_machine = *timestamp;
+	} else {
+		timestamp_now(&time_machine);
+	}
+
+	time_human = timestamp_human(time_machine.tv_sec);
+
+	json_append_member_ref(message_node, DBUS_JSON_SEC,
+		json_mkinteger(time_machine.tv_sec));
+	json_append_member_ref(message_node, DBUS_JSON_USEC,
+		json_mkinteger(time_machine.tv_nsec / 1000));
+	json_append_member_ref(message_node, DBUS_JSON_NSEC,
+		json_mkinteger(time_machine.tv_nsec));
+
+	/* TODO: make this field optional. */
+	struct JsonNode *time_node = json_mkobject();
+	json_append_member_ref(time_node, DBUS_JSON_HOUR,
+		json_mkinteger(time_human->tm_hour));
+	json_append_member_ref(time_node, DBUS_JSON_MINUTE, json_mkinteger(time_human->tm_min));
+	json_append_member_ref(time_node, DBUS_JSON_SECOND, json_mkinteger(time_human->tm_sec));
+	json_append_member_ref(message_node, DBUS_JSON_TIME_HUMAN, time_node);
+
+	/* TYPE */
+	json_append_member_ref(message_node, DBUS_JSON_TYPE,
+		json_mkstring_ref(message_type_name(dbus_message_get_type(message))));
+	flag = message_type_flags(dbus_message_get_type(message));
 
 	/* TODO: get unique name for sender and destination instead of well-known */
 	/* names. Well-known names should be an option. */
 
 	/* SENDER */
-	json_append_member(message_node, DBUS_JSON_SENDER,
-		json_mkstring(TRAP_NULL_STRING
+	json_append_member_ref(message_node, DBUS_JSON_SENDER,
+		json_mkstring_interned(TRAP_NULL_STRING
 			(dbus_message_get_sender(message))));
 
 	/* DESTINATION */
-	json_append_member(message_node, DBUS_JSON_DESTINATION,
-		json_mkstring(TRAP_NULL_STRING
+	json_append_member_ref(message_node, DBUS_JSON_DESTINATION,
+		json_mkstring_interned(TRAP_NULL_STRING
 			(dbus_message_get_destination
 			(message))));
 
 	/* FLAGS */
 	if (flag & FLAG_SERIAL) {
-		json_append_member(message_node, DBUS_JSON_SERIAL,
-			json_mknumber(dbus_message_get_serial
+		json_append_member_ref(message_node, DBUS_JSON_SERIAL,
+			json_mkunsigned(dbus_message_get_serial
 				(message)));
 	}
 
 	if (flag & FLAG_REPLY_SERIAL) {
-		json_append_member(message_node, DBUS_JSON_REPLY_SERIAL,
-			json_mknumber(dbus_message_get_reply_serial
+		json_append_member_ref(message_node, DBUS_JSON_REPLY_SERIAL,
+			json_mkunsigned(dbus_message_get_reply_serial
 				(message)));
 	}
 
 	/* TRAP_NULL_STRING is not needed here if specification is correctly handled. */
 	if (flag & FLAG_PATH) {
-		json_append_member(message_node, DBUS_JSON_PATH,
-			json_mkstring(TRAP_NULL_STRING
+		json_append_member_ref(message_node, DBUS_JSON_PATH,
+			json_mkstring_interned(TRAP_NULL_STRING
 				(dbus_message_get_path
 				(message))));
 	}
 
 	/* Interface is optional for method calls. */
 	if (flag & FLAG_INTERFACE) {
-		json_append_member(message_node, DBUS_JSON_INTERFACE,
-			json_mkstring(TRAP_NULL_STRING
+		json_append_member_ref(message_node, DBUS_JSON_INTERFACE,
+			json_mkstring_interned(TRAP_NULL_STRING
 				(dbus_message_get_interface
 				(message))));
 	}
 
 	if (flag & FLAG_MEMBER) {
-		json_append_member(message_node, DBUS_JSON_MEMBER,
-			json_mkstring(TRAP_NULL_STRING
+		json_append_member_ref(message_node, DBUS_JSON_MEMBER,
+			json_mkstring_interned(TRAP_NULL_STRING
 				(dbus_message_get_member
 				(message))));
 	}
 
 	/* TRAP_NULL_STRING is not needed here if specification is correctly handled. */
 	if (flag & FLAG_ERROR_NAME) {
-		json_append_member(message_node, DBUS_JSON_ERROR_NAME,
-			json_mkstring(TRAP_NULL_STRING
+		json_append_member_ref(message_node, DBUS_JSON_ERROR_NAME,
+			json_mkstring_interned(TRAP_NULL_STRING
 				(dbus_message_get_error_name
 				(message))));
 	}
@@ -926,16 +1597,25 @@ struct JsonNode *message_mangler(DBusMessage *message) {
 
 	/* ARGUMENTS */
 	DBusMessageIter args;
-	if (dbus_message_iter_init(message, &args)) {
+	if (!decode_limits.header_only && dbus_message_iter_init(message, &args)) {
 		/* fprintf (logfile, "ERROR: Message has no arguments.\n"); */
 		/* return NULL; */
 
 		JsonNode *args_array = json_mkarray();
+		struct decode_budget budget = { 0, 0, 0 };
+		unsigned int count = 0;
 		do {
-			json_append_element(args_array, args_mangler(&args));
+			if (decode_enough_args(&budget, count++)) {
+				break;
+			}
+			json_append_element(args_array, args_mangler(&args, &budget));
 		} while (dbus_message_iter_next(&args));
 
-		json_append_member(message_node, DBUS_JSON_ARGS, args_array);
+		json_append_member_ref(message_node, DBUS_JSON_ARGS, args_array);
+		if (budget.truncated > 0) {
+			json_append_member_ref(message_node, DBUS_JSON_TRUNCATED, json_mkbool(true));
+		}
+		decode_finish(&budget);
 	}
 
 	return message_node;
@@ -943,454 +1623,5149 @@ struct JsonNode *message_mangler(DBusMessage *message) {
 
 
 /**
- * Bus Queries
+ * Buses
  *
- * D-Bus provides a service with method that can return useful details about
- * current session / system. We use one function to centralize this: the
- * 'query' parameter will define what information we want.
+ * A bus is given by name, 'session' or 'system', or by D-Bus address. Several
+ * buses can be captured at once; messages are then tagged with the bus they
+ * come from.
  */
-enum Queries {
-	QUERY_NONE,
-	QUERY_LIST_NAMES,
-	QUERY_ACTIVATABLE_NAMES,
-	QUERY_GET_NAME_OWNER,
-	QUERY_GET_CONNECTION_UNIX_USER,
-	QUERY_GET_CONNECTION_UNIX_PROCESS_ID,
-	QUERY_INTROSPECT
-};
-
-struct JsonNode *query_bus(enum Queries query, const char *parameter) {
-	DBusConnection *connection;
-	DBusError error;
+#define MAX_BUSES 8
 
-	DBusMessage *message = NULL;
-	DBusMessageIter args;
-	bool need_parameter = false;
+/* Buses from -b, in order. Empty means the session bus. */
+static const char *option_buses[MAX_BUSES];
+static unsigned int option_bus_count = 0;
 
-	DBusPendingCall *pending;
+static const char *bus_name(unsigned int index) {
+	if (option_bus_count == 0) {
+		return "session";
+	}
+	return option_buses[index];
+}
 
-	/* Init */
-	dbus_error_init(&error);
+/* Connect to bus 'name' and register with it. A private connection must be */
+/* closed before its last unref. */
+static DBusConnection *bus_open(const char *name, bool private, DBusError *error) {
+	DBusConnection *connection;
 
-	connection = dbus_bus_get(DBUS_BUS_SESSION, &error);
-	if (dbus_error_is_set(&error)) {
-		fprintf(logfile, "ERROR: Connection Error (%s).\n", error.message);
-		dbus_error_free(&error);
+	if (strcmp(name, "session") == 0) {
+		return private ? dbus_bus_get_private(DBUS_BUS_SESSION, error) :
+			dbus_bus_get(DBUS_BUS_SESSION, error);
+	}
+	if (strcmp(name, "system") == 0) {
+		return private ? dbus_bus_get_private(DBUS_BUS_SYSTEM, error) :
+			dbus_bus_get(DBUS_BUS_SYSTEM, error);
 	}
+
+	connection = private ? dbus_connection_open_private(name, error) :
+		dbus_connection_open(name, error);
 	if (connection == NULL) {
-		exit(1);
+		return NULL;
+	}
+	if (!dbus_bus_register(connection, error)) {
+		if (private) {
+			dbus_connection_close(connection);
+		}
+		dbus_connection_unref(connection);
+		return NULL;
 	}
+	return connection;
+}
 
 
-	/* Create a new method call. */
-	switch (query) {
-	case QUERY_LIST_NAMES:
-	{
-		message = dbus_message_new_method_call(DBUS_SERVICE_DBUS,
-				DBUS_PATH_DBUS,
-				DBUS_INTERFACE_DBUS,
-				"ListNames");
-		break;
-	}
+/**
+ * Sampling
+ *
+ * On a bus busier than we can follow, -S keeps a sample of the messages which
+ * passed the filter:
+ *
+ * - N keeps one message in N, deterministically.
+ * - N,hash keeps one message in N depending on a hash of the sender and the
+ *   serial of method calls and signals, and of the destination and the reply
+ *   serial of replies, so that a call and its reply are kept or dropped
+ *   together.
+ * - rate=R lets at most R messages per second and per interface through a
+ *   token bucket, with bursts of up to one second. Replies, which have no
+ *   interface, share one bucket. Past SAMPLE_BUCKETS_MAX interfaces, the new
+ *   ones share one more bucket.
+ *
+ * Each kept message stands for a number of caught messages, its weight,
+ * written in the output as 'sample_weight', so that counts can be scaled back
+ * up: N times the number of messages dropped by the bucket since the last one
+ * kept, plus one.
+ */
+#define SAMPLE_BUCKETS_INITIAL 64
+#define SAMPLE_BUCKETS_MAX 4096
+
+struct sample_bucket {
+	/* Owned copy, or NULL for the unused slots. */
+	char *interface;
+	uint64_t hash;
+	double tokens;
+	struct timespec last;
+	unsigned long dropped;
+};
 
-	case QUERY_ACTIVATABLE_NAMES:
-	{
-		message = dbus_message_new_method_call(DBUS_SERVICE_DBUS,
-				DBUS_PATH_DBUS,
-				DBUS_INTERFACE_DBUS,
-				"ListActivatableNames");
-		break;
-	}
+struct sampler {
+	unsigned int every;
+	bool hash;
+	unsigned int rate;
+
+	unsigned long count;
+	struct sample_bucket *buckets;
+	size_t size;
+	size_t used;
+	/* For the interfaces which do not get a bucket of their own. */
+	struct sample_bucket overflow;
+
+	unsigned long seen;
+	unsigned long kept;
+	unsigned long overflowed;
+};
 
-	case QUERY_GET_NAME_OWNER:
-	{
-		message = dbus_message_new_method_call(DBUS_SERVICE_DBUS,
-				DBUS_PATH_DBUS,
-				DBUS_INTERFACE_DBUS,
-				"GetNameOwner");
-		need_parameter = true;
-		break;
+static const char *sample_spec = NULL;
+/* Non-NULL if -S was given. */
+static struct sampler *sampler = NULL;
+
+/* Parse "[N][,hash][,rate=R]". */
+static struct sampler *sampler_new(const char *spec) {
+	enum { OPT_HASH, OPT_RATE };
+	char *const tokens[] = { "hash", "rate", NULL };
+	struct sampler *s = calloc(1, sizeof (struct sampler));
+	/* getsubopt() cuts the string. */
+	char *copy = strdup(spec);
+	char *options = copy;
+	char *value;
+
+	s->every = 1;
+	if (*options >= '0' && *options <= '9') {
+		s->every = strtoul(options, &options, 10);
+		if (*options == ',') {
+			options++;
+		} else if (*options != '\0') {
+			s->every = 0;
+		}
 	}
 
-	case QUERY_GET_CONNECTION_UNIX_USER:
-	{
-		message = dbus_message_new_method_call(DBUS_SERVICE_DBUS,
-				DBUS_PATH_DBUS,
-				DBUS_INTERFACE_DBUS,
-				"GetConnectionUnixUser");
-		need_parameter = true;
-		break;
+	while (s->every > 0 && *options != '\0') {
+		switch (getsubopt(&options, tokens, &value)) {
+		case OPT_HASH:
+			s->hash = true;
+			break;
+		case OPT_RATE:
+			s->rate = value != NULL ? strtoul(value, NULL, 10) : 0;
+			if (s->rate == 0) {
+				s->every = 0;
+			}
+			break;
+		default:
+			s->every = 0;
+			break;
+		}
 	}
 
-	case QUERY_GET_CONNECTION_UNIX_PROCESS_ID:
-	{
-		message = dbus_message_new_method_call(DBUS_SERVICE_DBUS,
-				DBUS_PATH_DBUS,
-				DBUS_INTERFACE_DBUS,
-				"GetConnectionUnixProcessID");
-		need_parameter = true;
-		break;
+	free(copy);
+	if (s->every == 0) {
+		fprintf(logfile, "ERROR: Invalid sampling '%s'.\n", spec);
+		free(s);
+		return NULL;
 	}
+	s->overflow.tokens = s->rate;
+	return s;
+}
 
-	case QUERY_INTROSPECT:
-	{
-		/* TODO: Need to check if parameter is a valid busname. */
-		message = dbus_message_new_method_call(parameter,
-				DBUS_PATH_DBUS,
-				"org.freedesktop.DBus.Introspectable",
-				"Introspect");
-		break;
+static void sampler_free(struct sampler *s) {
+	size_t i;
+
+	for (i = 0; i < s->size; i++) {
+		free(s->buckets[i].interface);
 	}
+	free(s->buckets);
+	free(s);
+}
+
+/* Same sample for a call and its reply. */
+static bool sample_hash_keep(const struct sampler *s, DBusMessage *message) {
+	const char *name;
+	dbus_uint32_t serial;
+	size_t length;
+	uint64_t hash;
 
+	switch (dbus_message_get_type(message)) {
+	case DBUS_MESSAGE_TYPE_METHOD_RETURN:
+	case DBUS_MESSAGE_TYPE_ERROR:
+		name = dbus_message_get_destination(message);
+		serial = dbus_message_get_reply_serial(message);
+		break;
 	default:
-		fprintf(logfile, "ERROR: Query unrecognized.\n");
-		return NULL;
+		name = dbus_message_get_sender(message);
+		serial = dbus_message_get_serial(message);
+		break;
 	}
 
-	if (message == NULL) {
-		fprintf(logfile, "ERROR: Message creation error.\n");
-		return NULL;
+	/* FNV-1a, then the splitmix64 finalizer to spread the serial. */
+	hash = intern_hash(TRAP_NULL_STRING(name), &length) ^ serial;
+	hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+	hash ^= hash >> 31;
+	return hash % s->every == 0;
+}
+
+/* Bucket of 'interface', the overflow one if there are too many of them or */
+/* no memory for another. */
+static struct sample_bucket *sample_bucket_find(struct sampler *s, const char *interface) {
+	size_t length;
+	uint64_t hash = intern_hash(interface, &length);
+	size_t i;
+
+	if (s->size > 0) {
+		for (i = hash & (s->size - 1); s->buckets[i].interface != NULL; i = (i + 1) & (s->size - 1)) {
+			if (s->buckets[i].hash == hash && strcmp(s->buckets[i].interface, interface) == 0) {
+				return &s->buckets[i];
+			}
+		}
+	}
+	if (s->used >= SAMPLE_BUCKETS_MAX) {
+		s->overflowed++;
+		return &s->overflow;
 	}
 
-	if (need_parameter) {
-		/* Append parameter. */
-		dbus_message_iter_init_append(message, &args);
-		if (!dbus_message_iter_append_basic(&args, DBUS_TYPE_STRING, &parameter)) {
-			fprintf(logfile, "ERROR: Out Of Memory!\n");
-			return NULL;
+	/* Keep the load factor under one half. */
+	if ((s->used + 1) * 2 > s->size) {
+		size_t size = s->size == 0 ? SAMPLE_BUCKETS_INITIAL : s->size * 2;
+		struct sample_bucket *buckets = calloc(size, sizeof (struct sample_bucket));
+
+		if (buckets == NULL) {
+			s->overflowed++;
+			return &s->overflow;
 		}
+		for (i = 0; i < s->size; i++) {
+			if (s->buckets[i].interface != NULL) {
+				size_t j = s->buckets[i].hash & (size - 1);
+				while (buckets[j].interface != NULL) {
+					j = (j + 1) & (size - 1);
+				}
+				buckets[j] = s->buckets[i];
+			}
+		}
+		free(s->buckets);
+		s->buckets = buckets;
+		s->size = size;
 	}
 
-	/* Send message and get a handle for a reply. */
-	/* -1 is default timeout. */
-	if (!dbus_connection_send_with_reply(connection, message, &pending, -1)) {
-		fprintf(logfile, "ERROR: Out Of Memory!\n");
-		return NULL;
+	for (i = hash & (s->size - 1); s->buckets[i].interface != NULL; i = (i + 1) & (s->size - 1)) {
 	}
-	if (pending == NULL) {
-		fprintf(logfile, "ERROR: Pending Call Null\n");
-		return NULL;
+	s->buckets[i].interface = malloc(length + 1);
+	if (s->buckets[i].interface == NULL) {
+		s->overflowed++;
+		return &s->overflow;
 	}
+	memcpy(s->buckets[i].interface, interface, length + 1);
+	s->buckets[i].hash = hash;
+	s->buckets[i].tokens = s->rate;
+	s->used++;
+	return &s->buckets[i];
+}
 
-	/* Force sending request without waiting. */
-	dbus_connection_flush(connection);
+/* Weight of 'message' if it is kept, 0 if it is dropped. */
+static unsigned long sample(struct sampler *s, DBusMessage *message, const struct timespec *timestamp) {
+	unsigned long weight = s->every;
 
-	/* Free message. */
-	dbus_message_unref(message);
+	s->seen++;
+
+	if (s->hash) {
+		if (!sample_hash_keep(s, message)) {
+			return 0;
+		}
+	} else if (s->count++ % s->every != 0) {
+		return 0;
+	}
+
+	if (s->rate > 0) {
+		struct sample_bucket *bucket = sample_bucket_find(s, TRAP_NULL_STRING(dbus_message_get_interface(message)));
+
+		/* Refill with the time elapsed since the last message. */
+		if (bucket->last.tv_sec != 0 || bucket->last.tv_nsec != 0) {
+			double elapsed = (timestamp->tv_sec - bucket->last.tv_sec) +
+				(timestamp->tv_nsec - bucket->last.tv_nsec) / 1e9;
+			if (elapsed > 0) {
+				bucket->tokens += elapsed * s->rate;
+				if (bucket->tokens > s->rate) {
+					bucket->tokens = s->rate;
+				}
+			}
+		}
+		bucket->last = *timestamp;
+
+		if (bucket->tokens < 1) {
+			bucket->dropped++;
+			return 0;
+		}
+		bucket->tokens -= 1;
+		weight *= bucket->dropped + 1;
+		bucket->dropped = 0;
+	}
+
+	s->kept++;
+	return weight;
+}
+
+static void print_sampler_stats(struct sampler *s) {
+	fprintf(logfile, "STATS: Sampling: kept %lu of %lu messages (1 in %u%s", s->kept, s->seen,
+		s->every, s->hash ? " by call" : "");
+	if (s->rate > 0) {
+		fprintf(logfile, ", at most %u per second for each of %zu interfaces", s->rate, s->used);
+		if (s->overflowed > 0) {
+			fprintf(logfile, ", %lu messages in the shared bucket of the others", s->overflowed);
+		}
+	}
+	fprintf(logfile, ").\n");
+}
+
+
+/**
+ * Streaming output
+ *
+ * Live output does not keep the messages, so there is no point in building a
+ * JSON tree only to stringify it. The message header and arguments are walked
+ * once and written straight into a JsonWriter buffer, which is reused from one
+ * message to the next. The output is the same as json_print() on the tree
+ * returned by message_mangler().
+ */
+
+/* Name of an argument type, as found in the "type" field. NULL if out of */
+/* specification. */
+static const char *arg_type_name(int type) {
+	switch (type) {
+	case DBUS_TYPE_STRING:
+		return "string";
+	case DBUS_TYPE_SIGNATURE:
+		return "signature";
+	case DBUS_TYPE_OBJECT_PATH:
+		return "object_path";
+	case DBUS_TYPE_INT16:
+		return "int16";
+	case DBUS_TYPE_UINT16:
+		return "uint16";
+	case DBUS_TYPE_INT32:
+		return "int32";
+	case DBUS_TYPE_UINT32:
+		return "uint32";
+	case DBUS_TYPE_INT64:
+		return "int64";
+	case DBUS_TYPE_UINT64:
+		return "uint64";
+	case DBUS_TYPE_DOUBLE:
+		return "double";
+	case DBUS_TYPE_BYTE:
+		return "byte";
+	case DBUS_TYPE_BOOLEAN:
+		return "bool";
+	case DBUS_TYPE_VARIANT:
+		return "variant";
+	case DBUS_TYPE_ARRAY:
+		return "array";
+	case DBUS_TYPE_DICT_ENTRY:
+		return "dict_entry";
+	case DBUS_TYPE_STRUCT:
+		return "struct";
+	case DBUS_TYPE_UNIX_FD:
+		return "unix_fd";
+	case DBUS_TYPE_INVALID:
+		return "invalid";
+	default:
+		return NULL;
+	}
+}
+
+/* Unix FDs and invalid arguments only have a type. */
+static bool arg_has_value(int type) {
+	return type != DBUS_TYPE_UNIX_FD && type != DBUS_TYPE_INVALID &&
+		arg_type_name(type) != NULL;
+}
+
+/* Writer of the value of a basic type. */
+typedef void (*value_emitter)(JsonWriter *w, DBusMessageIter *args, struct decode_budget *budget);
+
+static void emit_string(JsonWriter *w, DBusMessageIter *args, struct decode_budget *budget) {
+	char *value;
+	char *cut;
+
+	dbus_message_iter_get_basic(args, &value);
+	cut = decode_string_cut(value, budget);
+	json_writer_string(w, cut != NULL ? cut : value);
+	free(cut);
+}
+
+static void emit_int16(JsonWriter *w, DBusMessageIter *args, struct decode_budget *budget) {
+	dbus_int16_t value;
+	(void)budget;
+	dbus_message_iter_get_basic(args, &value);
+	json_writer_integer(w, value);
+}
+
+static void emit_uint16(JsonWriter *w, DBusMessageIter *args, struct decode_budget *budget) {
+	dbus_uint16_t value;
+	(void)budget;
+	dbus_message_iter_get_basic(args, &value);
+	json_writer_unsigned(w, value);
+}
+
+static void emit_int32(JsonWriter *w, DBusMessageIter *args, struct decode_budget *budget) {
+	dbus_int32_t value;
+	(void)budget;
+	dbus_message_iter_get_basic(args, &value);
+	json_writer_integer(w, value);
+}
+
+static void emit_uint32(JsonWriter *w, DBusMessageIter *args, struct decode_budget *budget) {
+	dbus_uint32_t value;
+	(void)budget;
+	dbus_message_iter_get_basic(args, &value);
+	json_writer_unsigned(w, value);
+}
+
+static void emit_int64(JsonWriter *w, DBusMessageIter *args, struct decode_budget *budget) {
+	dbus_int64_t value;
+	(void)budget;
+	dbus_message_iter_get_basic(args, &value);
+	json_writer_integer(w, value);
+}
+
+static void emit_uint64(JsonWriter *w, DBusMessageIter *args, struct decode_budget *budget) {
+	dbus_uint64_t value;
+	(void)budget;
+	dbus_message_iter_get_basic(args, &value);
+	json_writer_unsigned(w, value);
+}
+
+static void emit_double(JsonWriter *w, DBusMessageIter *args, struct decode_budget *budget) {
+	double value;
+	(void)budget;
+	dbus_message_iter_get_basic(args, &value);
+	json_writer_number(w, value);
+}
+
+static void emit_byte(JsonWriter *w, DBusMessageIter *args, struct decode_budget *budget) {
+	unsigned char value;
+	(void)budget;
+	dbus_message_iter_get_basic(args, &value);
+	json_writer_unsigned(w, value);
+}
+
+/* Booleans are numbers, like in args_mangler(). */
+static void emit_boolean(JsonWriter *w, DBusMessageIter *args, struct decode_budget *budget) {
+	dbus_bool_t value;
+	(void)budget;
+	dbus_message_iter_get_basic(args, &value);
+	json_writer_integer(w, value);
+}
+
+/* NULL for containers and types without a value. */
+static value_emitter value_emitter_for(int type) {
+	switch (type) {
+	case DBUS_TYPE_STRING:
+	case DBUS_TYPE_SIGNATURE:
+	case DBUS_TYPE_OBJECT_PATH:
+		return emit_string;
+	case DBUS_TYPE_INT16:
+		return emit_int16;
+	case DBUS_TYPE_UINT16:
+		return emit_uint16;
+	case DBUS_TYPE_INT32:
+		return emit_int32;
+	case DBUS_TYPE_UINT32:
+		return emit_uint32;
+	case DBUS_TYPE_INT64:
+		return emit_int64;
+	case DBUS_TYPE_UINT64:
+		return emit_uint64;
+	case DBUS_TYPE_DOUBLE:
+		return emit_double;
+	case DBUS_TYPE_BYTE:
+		return emit_byte;
+	case DBUS_TYPE_BOOLEAN:
+		return emit_boolean;
+	default:
+		return NULL;
+	}
+}
+
+/**
+ * Decode plans
+ *
+ * A bus carries a few hundred distinct signatures, while decoding finds out
+ * the type of every value, its name and how to write it, again and again. The
+ * signature of a message is compiled once into a plan: a flat array with one
+ * step per complete type, in signature order, giving its type, its name and
+ * the writer of its values. The contents of a container follow it, and 'size'
+ * skips to the next sibling. args_emit() then follows the plan along the
+ * arguments instead of asking the iterator.
+ *
+ * Plans are cached in a hash table keyed by the signature and never freed
+ * before the end of the program, so that the decode workers share them. Each
+ * thread also remembers the plans it used last, which saves taking the lock
+ * for the few signatures that make most of the traffic. Variants hold a
+ * signature of their own and are decoded without a plan.
+ */
+#define PLAN_INITIAL_SIZE 256
+#define PLAN_MAX_COUNT 4096
+#define PLAN_RECENT_SIZE 64
+
+struct plan_step {
+	int type;
+	const char *name;
+	/* NULL for containers and Unix FDs. */
+	value_emitter emit;
+	/* Number of steps of this complete type, itself included. */
+	unsigned int size;
+};
+
+struct decode_plan {
+	uint64_t hash;
+	char *signature;
+	struct plan_step steps[];
+};
+
+struct plan_cache {
+	pthread_rwlock_t lock;
+	struct decode_plan **slots;
+	size_t size;
+	size_t count;
+};
+
+static struct plan_cache plan_cache = {
+	.lock = PTHREAD_RWLOCK_INITIALIZER
+};
+
+static _Thread_local const struct decode_plan *plan_recent[PLAN_RECENT_SIZE];
+
+/* Compile the complete type starting at '*signature' into 'steps', which has */
+/* room for it, and move past it. Returns the number of steps, 0 if a type is */
+/* out of specification. */
+static unsigned int plan_compile_type(struct plan_step *steps, const char **signature) {
+	int type = *(*signature)++;
+	unsigned int size = 1;
+	unsigned int n;
+
+	switch (type) {
+	case DBUS_TYPE_ARRAY:
+		n = plan_compile_type(steps + 1, signature);
+		if (n == 0) {
+			return 0;
+		}
+		size += n;
+		break;
+
+	case DBUS_STRUCT_BEGIN_CHAR:
+	case DBUS_DICT_ENTRY_BEGIN_CHAR:
+	{
+		int end = type == DBUS_STRUCT_BEGIN_CHAR ? DBUS_STRUCT_END_CHAR : DBUS_DICT_ENTRY_END_CHAR;
+
+		type = type == DBUS_STRUCT_BEGIN_CHAR ? DBUS_TYPE_STRUCT : DBUS_TYPE_DICT_ENTRY;
+		while (**signature != end) {
+			if (**signature == '\0') {
+				return 0;
+			}
+			n = plan_compile_type(steps + size, signature);
+			if (n == 0) {
+				return 0;
+			}
+			size += n;
+		}
+		(*signature)++;
+		break;
+	}
+
+	default:
+		break;
+	}
+
+	steps->type = type;
+	steps->name = arg_type_name(type);
+	steps->emit = value_emitter_for(type);
+	steps->size = size;
+	return steps->name != NULL ? size : 0;
+}
+
+/* WARNING: manual free. */
+static struct decode_plan *plan_compile(const char *signature, uint64_t hash, size_t length) {
+	/* No more steps than characters. */
+	struct decode_plan *plan = malloc(sizeof (struct decode_plan) + length * sizeof (struct plan_step));
+	const char *p = signature;
+	unsigned int count = 0;
+
+	while (*p != '\0') {
+		unsigned int n = plan_compile_type(plan->steps + count, &p);
+		if (n == 0) {
+			fprintf(logfile, "WARNING: Could not compile signature '%s'.\n", signature);
+			free(plan);
+			return NULL;
+		}
+		count += n;
+	}
+
+	plan->hash = hash;
+	plan->signature = strdup(signature);
+	return plan;
+}
+
+/* Caller holds the lock. */
+static struct decode_plan **plan_slot(struct plan_cache *c, const char *signature, uint64_t hash) {
+	size_t i;
+
+	for (i = hash & (c->size - 1); c->slots[i] != NULL; i = (i + 1) & (c->size - 1)) {
+		if (c->slots[i]->hash == hash && strcmp(c->slots[i]->signature, signature) == 0) {
+			break;
+		}
+	}
+	return &c->slots[i];
+}
+
+/* Caller holds the write lock. */
+static bool plan_cache_grow(struct plan_cache *c) {
+	size_t size = c->size == 0 ? PLAN_INITIAL_SIZE : c->size * 2;
+	struct decode_plan **slots = calloc(size, sizeof (struct decode_plan *));
+	size_t i;
+
+	if (slots == NULL) {
+		return false;
+	}
+	for (i = 0; i < c->size; i++) {
+		if (c->slots[i] != NULL) {
+			size_t j = c->slots[i]->hash & (size - 1);
+			while (slots[j] != NULL) {
+				j = (j + 1) & (size - 1);
+			}
+			slots[j] = c->slots[i];
+		}
+	}
+	free(c->slots);
+	c->slots = slots;
+	c->size = size;
+	return true;
+}
+
+/* Plan of 'signature', compiled on first use. NULL if it cannot be compiled */
+/* or the cache is full: args_emit() does the job then. */
+static const struct decode_plan *plan_find(const char *signature) {
+	struct plan_cache *c = &plan_cache;
+	const struct decode_plan **recent;
+	struct decode_plan *plan = NULL;
+	size_t length;
+	uint64_t hash = intern_hash(signature, &length);
+
+	recent = &plan_recent[hash & (PLAN_RECENT_SIZE - 1)];
+	if (*recent != NULL && (*recent)->hash == hash && strcmp((*recent)->signature, signature) == 0) {
+		return *recent;
+	}
+
+	pthread_rwlock_rdlock(&c->lock);
+	if (c->slots != NULL) {
+		plan = *plan_slot(c, signature, hash);
+	}
+	pthread_rwlock_unlock(&c->lock);
+
+	if (plan == NULL) {
+		pthread_rwlock_wrlock(&c->lock);
+		/* Keep the load factor under one half. */
+		if (c->count < PLAN_MAX_COUNT && ((c->count + 1) * 2 <= c->size || plan_cache_grow(c))) {
+			struct decode_plan **slot = plan_slot(c, signature, hash);
+
+			/* Another thread may have compiled it meanwhile. */
+			if (*slot == NULL) {
+				*slot = plan_compile(signature, hash, length);
+				if (*slot != NULL) {
+					c->count++;
+				}
+			}
+			plan = *slot;
+		}
+		pthread_rwlock_unlock(&c->lock);
+	}
+
+	if (plan != NULL) {
+		*recent = plan;
+	}
+	return plan;
+}
+
+static void plan_cache_clear(struct plan_cache *c) {
+	size_t i;
+
+	for (i = 0; i < c->size; i++) {
+		if (c->slots[i] != NULL) {
+			free(c->slots[i]->signature);
+			free(c->slots[i]);
+		}
+	}
+	free(c->slots);
+	c->slots = NULL;
+	c->size = 0;
+	c->count = 0;
+}
+
+static void print_plan_stats(struct plan_cache *c) {
+	pthread_rwlock_rdlock(&c->lock);
+	fprintf(logfile, "STATS: Decode plans: %zu signatures compiled%s.\n",
+		c->count, c->count >= PLAN_MAX_COUNT ? " (cache full)" : "");
+	pthread_rwlock_unlock(&c->lock);
+}
+
+/* Write an array read in one go. False if it cannot be. See */
+/* args_fixed_array_node() for 'element'. */
+static bool args_emit_fixed_array(JsonWriter *w, DBusMessageIter *args, bool element, struct decode_budget *budget) {
+	DBusMessageIter subargs;
+	int subtype = dbus_message_iter_get_element_type(args);
+	const char *encoding = element ? NULL : array_encoding(args);
+	const void *data;
+	size_t length;
+	size_t i;
+
+	if (!fixed_array_type(subtype)) {
+		return false;
+	}
+
+	dbus_message_iter_recurse(args, &subargs);
+	length = fixed_array_get(&subargs, &data, budget);
+	if (encoding != NULL) {
+		char *encoded = bytes_encode(data, length);
+
+		json_writer_string(w, encoded);
+		free(encoded);
+		return true;
+	}
+
+	json_writer_begin_array(w);
+	for (i = 0; i < length; i++) {
+		fixed_array_write(w, data, subtype, i);
+	}
+	json_writer_end_array(w);
+	return true;
+}
+
+/* Open container of args_emit(). */
+struct emit_frame {
+	DBusMessageIter iter;
+	int type;
+	/* Plan step of the next item, NULL without a plan. */
+	const struct plan_step *step;
+	/* Whether the container is the value of an argument object to close. */
+	bool object;
+	unsigned long truncated;
+	unsigned int count;
+};
+
+/* Move to the next item of 'frame'. */
+static void args_emit_next(struct emit_frame *frame) {
+	dbus_message_iter_next(&frame->iter);
+	/* Array elements share a step. */
+	if (frame->step != NULL && frame->type != DBUS_TYPE_ARRAY) {
+		frame->step += frame->step->size;
+	}
+}
+
+/* Same fields as args_mangler(), walking containers the same way. 'step' is */
+/* the plan step of the argument, or NULL. */
+static void args_emit(JsonWriter *w, DBusMessageIter *args, const struct plan_step *step,
+		struct decode_budget *budget) {
+	struct emit_frame stack[DECODE_STACK_SIZE];
+	unsigned int sp = 0;
+	DBusMessageIter *iter = args;
+	bool element = false;
+
+	for (;;) {
+		int type = step != NULL ? step->type : dbus_message_iter_get_arg_type(iter);
+		const char *name = step != NULL ? step->name : arg_type_name(type);
+		unsigned long truncated = budget->truncated;
+		bool pushed = false;
+
+		if (!element) {
+			json_writer_begin_object(w);
+			if (name == NULL) {
+				fprintf(logfile, "WARNING: Type (%c) out of specification!\n", type);
+			} else {
+				json_writer_key(w, DBUS_JSON_ARG_TYPE);
+				json_writer_string(w, name);
+			}
+
+			/* Array elements are all of the same type, given once. */
+			if (type == DBUS_TYPE_ARRAY) {
+				DBusMessageIter subargs;
+				const char *subname;
+
+				dbus_message_iter_recurse(iter, &subargs);
+				subname = arg_type_name(dbus_message_iter_get_arg_type(&subargs));
+				json_writer_key(w, DBUS_JSON_ARG_ARRAYTYPE);
+				if (subname != NULL) {
+					json_writer_string(w, subname);
+				} else {
+					json_writer_null(w);
+				}
+				if (array_encoding(iter) != NULL) {
+					json_writer_key(w, DBUS_JSON_ARG_ENCODING);
+					json_writer_string(w, array_encoding(iter));
+				}
+			}
+
+			if (arg_has_value(type)) {
+				json_writer_key(w, DBUS_JSON_ARG_VALUE);
+			}
+		}
+
+		/* The tree has no value to take in arrays for types without one. */
+		if (step != NULL && step->emit != NULL) {
+			step->emit(w, iter, budget);
+		} else if (!arg_has_value(type)) {
+			if (element) {
+				json_writer_null(w);
+			}
+		} else if (decode_too_deep(budget, type)) {
+			json_writer_null(w);
+		} else if (!dbus_type_is_container(type)) {
+			value_emitter_for(type)(w, iter, budget);
+		} else if (type == DBUS_TYPE_ARRAY && args_emit_fixed_array(w, iter, element, budget)) {
+			/* Read in one go. */
+		} else {
+			struct emit_frame *frame = &stack[sp++];
+
+			dbus_message_iter_recurse(iter, &frame->iter);
+			frame->type = type;
+			frame->step = step != NULL && type != DBUS_TYPE_VARIANT ? step + 1 : NULL;
+			frame->object = !element;
+			frame->truncated = truncated;
+			frame->count = 0;
+			/* The content of a variant is its value. */
+			if (type != DBUS_TYPE_VARIANT) {
+				json_writer_begin_array(w);
+			}
+			decode_enter(budget);
+			pushed = true;
+		}
+
+		if (!pushed) {
+			if (!element) {
+				if (budget->truncated != truncated) {
+					json_writer_key(w, DBUS_JSON_TRUNCATED);
+					json_writer_bool(w, true);
+				}
+				json_writer_end_object(w);
+			}
+			if (sp == 0) {
+				return;
+			}
+			args_emit_next(&stack[sp - 1]);
+		}
+
+		/* Close the containers which are done, then go on with the next */
+		/* item of the innermost one. */
+		for (;;) {
+			struct emit_frame *frame = &stack[sp - 1];
+
+			if (dbus_message_iter_get_arg_type(&frame->iter) != DBUS_TYPE_INVALID &&
+				!(frame->type == DBUS_TYPE_ARRAY && decode_enough_elements(budget, frame->count))) {
+				frame->count++;
+				iter = &frame->iter;
+				step = frame->step;
+				element = frame->type == DBUS_TYPE_ARRAY;
+				break;
+			}
+
+			if (frame->type != DBUS_TYPE_VARIANT) {
+				json_writer_end_array(w);
+			}
+			decode_leave(budget);
+			if (frame->object) {
+				if (budget->truncated != frame->truncated) {
+					json_writer_key(w, DBUS_JSON_TRUNCATED);
+					json_writer_bool(w, true);
+				}
+				json_writer_end_object(w);
+			}
+			if (--sp == 0) {
+				return;
+			}
+			args_emit_next(&stack[sp - 1]);
+		}
+	}
+}
+
+
+/* Same fields as message_mangler(). The bus comes first, unless there is only */
+/* one, then the sample weight when sampling. */
+static void message_emit(JsonWriter *w, DBusMessage *message, const struct timespec *timestamp, unsigned int bus,
+		unsigned long weight) {
+	struct timespec time_machine;
+	const struct tm *time_human;
+	int type = dbus_message_get_type(message);
+	enum Flags flag = message_type_flags(type);
+	DBusMessageIter args;
+
+	if (timestamp != NULL) {
+		time_machine = *timestamp;
+	} else {
+		timestamp_now(&time_machine);
+	}
+	time_human = timestamp_human(time_machine.tv_sec);
+
+	json_writer_begin_object(w);
+
+	if (option_bus_count > 1) {
+		json_writer_key(w, DBUS_JSON_BUS);
+		json_writer_string(w, bus_name(bus));
+	}
+	if (sampler != NULL) {
+		json_writer_key(w, DBUS_JSON_SAMPLE_WEIGHT);
+		json_writer_unsigned(w, weight);
+	}
+
+	json_writer_key(w, DBUS_JSON_SEC);
+	json_writer_integer(w, time_machine.tv_sec);
+	json_writer_key(w, DBUS_JSON_USEC);
+	json_writer_integer(w, time_machine.tv_nsec / 1000);
+	json_writer_key(w, DBUS_JSON_NSEC);
+	json_writer_integer(w, time_machine.tv_nsec);
+
+	json_writer_key(w, DBUS_JSON_TIME_HUMAN);
+	json_writer_begin_object(w);
+	json_writer_key(w, DBUS_JSON_HOUR);
+	json_writer_integer(w, time_human->tm_hour);
+	json_writer_key(w, DBUS_JSON_MINUTE);
+	json_writer_integer(w, time_human->tm_min);
+	json_writer_key(w, DBUS_JSON_SECOND);
+	json_writer_integer(w, time_human->tm_sec);
+	json_writer_end_object(w);
+
+	json_writer_key(w, DBUS_JSON_TYPE);
+	json_writer_string(w, message_type_name(type));
+
+	json_writer_key(w, DBUS_JSON_SENDER);
+	json_writer_string(w, TRAP_NULL_STRING(dbus_message_get_sender(message)));
+	json_writer_key(w, DBUS_JSON_DESTINATION);
+	json_writer_string(w, TRAP_NULL_STRING(dbus_message_get_destination(message)));
+
+	if (flag & FLAG_SERIAL) {
+		json_writer_key(w, DBUS_JSON_SERIAL);
+		json_writer_unsigned(w, dbus_message_get_serial(message));
+	}
+	if (flag & FLAG_REPLY_SERIAL) {
+		json_writer_key(w, DBUS_JSON_REPLY_SERIAL);
+		json_writer_unsigned(w, dbus_message_get_reply_serial(message));
+	}
+	if (flag & FLAG_PATH) {
+		json_writer_key(w, DBUS_JSON_PATH);
+		json_writer_string(w, TRAP_NULL_STRING(dbus_message_get_path(message)));
+	}
+	if (flag & FLAG_INTERFACE) {
+		json_writer_key(w, DBUS_JSON_INTERFACE);
+		json_writer_string(w, TRAP_NULL_STRING(dbus_message_get_interface(message)));
+	}
+	if (flag & FLAG_MEMBER) {
+		json_writer_key(w, DBUS_JSON_MEMBER);
+		json_writer_string(w, TRAP_NULL_STRING(dbus_message_get_member(message)));
+	}
+	if (flag & FLAG_ERROR_NAME) {
+		json_writer_key(w, DBUS_JSON_ERROR_NAME);
+		json_writer_string(w, TRAP_NULL_STRING(dbus_message_get_error_name(message)));
+	}
+
+	if (!decode_limits.header_only && dbus_message_iter_init(message, &args)) {
+		struct decode_budget budget = { 0, 0, 0 };
+		const struct decode_plan *plan = plan_find(dbus_message_get_signature(message));
+		const struct plan_step *step = plan != NULL ? plan->steps : NULL;
+		unsigned int count = 0;
+
+		json_writer_key(w, DBUS_JSON_ARGS);
+		json_writer_begin_array(w);
+		do {
+			if (decode_enough_args(&budget, count++)) {
+				break;
+			}
+			args_emit(w, &args, step, &budget);
+			if (step != NULL) {
+				step += step->size;
+			}
+		} while (dbus_message_iter_next(&args));
+		json_writer_end_array(w);
+		if (budget.truncated > 0) {
+			json_writer_key(w, DBUS_JSON_TRUNCATED);
+			json_writer_bool(w, true);
+		}
+		decode_finish(&budget);
+	}
+
+	json_writer_end_object(w);
+}
+
+
+/**
+ * Profile output
+ *
+ * With -P, every message is a single tab-separated line in the spirit of
+ * 'dbus-monitor --profile': type, seconds, microseconds, then the header
+ * fields of message_emit(). Arguments are not decoded at all and no JSON is
+ * involved: the line is built in a fixed-size buffer on the stack, from the
+ * header fields libdbus has already parsed.
+ *
+ * Header fields are at most 255 bytes, except object paths. Lines which do not
+ * fit are cut.
+ */
+#define PROFILE_LINE_SIZE 2048
+
+static const char *profile_type_name(int type) {
+	switch (type) {
+	case DBUS_MESSAGE_TYPE_ERROR:
+		return "err";
+	case DBUS_MESSAGE_TYPE_METHOD_CALL:
+		return "mc";
+	case DBUS_MESSAGE_TYPE_METHOD_RETURN:
+		return "mr";
+	case DBUS_MESSAGE_TYPE_SIGNAL:
+		return "sig";
+	default:
+		return DBUS_JSON_UNKNOWN;
+	}
+}
+
+/* Room is always left for the final newline. */
+static size_t profile_put(char *line, size_t at, const char *bytes, size_t length) {
+	if (length > PROFILE_LINE_SIZE - 1 - at) {
+		length = PROFILE_LINE_SIZE - 1 - at;
+	}
+	memcpy(line + at, bytes, length);
+	return at + length;
+}
+
+static size_t profile_put_string(char *line, size_t at, const char *string) {
+	at = profile_put(line, at, "\t", 1);
+	return profile_put(line, at, string, strlen(string));
+}
+
+static size_t profile_put_number(char *line, size_t at, unsigned long long value) {
+	char digits[24];
+	size_t i = sizeof digits;
+
+	do {
+		digits[--i] = '0' + value % 10;
+		value /= 10;
+	} while (value != 0);
+
+	at = profile_put(line, at, "\t", 1);
+	return profile_put(line, at, digits + i, sizeof digits - i);
+}
+
+/* Format 'message' in 'line', newline included, and return its length. The bus */
+/* comes first, unless there is only one. The sample weight comes last when */
+/* sampling. */
+static size_t profile_format(char *line, DBusMessage *message, const struct timespec *timestamp, unsigned int bus,
+		unsigned long weight) {
+	struct timespec time_machine;
+	int type = dbus_message_get_type(message);
+	enum Flags flag = message_type_flags(type);
+	size_t at = 0;
+
+	if (timestamp != NULL) {
+		time_machine = *timestamp;
+	} else {
+		timestamp_now(&time_machine);
+	}
+
+	if (option_bus_count > 1) {
+		at = profile_put(line, at, bus_name(bus), strlen(bus_name(bus)));
+		at = profile_put(line, at, "\t", 1);
+	}
+	at = profile_put(line, at, profile_type_name(type), strlen(profile_type_name(type)));
+	at = profile_put_number(line, at, time_machine.tv_sec);
+	at = profile_put_number(line, at, time_machine.tv_nsec / 1000);
+
+	if (flag & FLAG_SERIAL) {
+		at = profile_put_number(line, at, dbus_message_get_serial(message));
+	}
+	if (flag & FLAG_REPLY_SERIAL) {
+		at = profile_put_number(line, at, dbus_message_get_reply_serial(message));
+	}
+	at = profile_put_string(line, at, TRAP_NULL_STRING(dbus_message_get_sender(message)));
+	at = profile_put_string(line, at, TRAP_NULL_STRING(dbus_message_get_destination(message)));
+	if (flag & FLAG_PATH) {
+		at = profile_put_string(line, at, TRAP_NULL_STRING(dbus_message_get_path(message)));
+	}
+	if (flag & FLAG_INTERFACE) {
+		at = profile_put_string(line, at, TRAP_NULL_STRING(dbus_message_get_interface(message)));
+	}
+	if (flag & FLAG_MEMBER) {
+		at = profile_put_string(line, at, TRAP_NULL_STRING(dbus_message_get_member(message)));
+	}
+	if (flag & FLAG_ERROR_NAME) {
+		at = profile_put_string(line, at, TRAP_NULL_STRING(dbus_message_get_error_name(message)));
+	}
+	if (sampler != NULL) {
+		at = profile_put_number(line, at, weight);
+	}
+
+	line[at++] = '\n';
+	return at;
+}
+
+/* One line of live output, in the selected format. */
+static void message_emit_line(JsonWriter *w, DBusMessage *message, const struct timespec *timestamp, unsigned int bus,
+		unsigned long weight) {
+	if (option_output_format == FORMAT_PROFILE) {
+		char line[PROFILE_LINE_SIZE];
+		json_writer_raw(w, line, profile_format(line, message, timestamp, bus, weight));
+		return;
+	}
+	message_emit(w, message, timestamp, bus, weight);
+	json_writer_raw(w, "\n", 1);
+}
+
+
+/**
+ * Filters
+ *
+ * Match rules are applied by the bus, but they can only test header fields and
+ * string arguments for equality. -e takes a local filter expression, e.g.
+ *
+ *   type == signal && member ~ 'Properties*' && !(sender in @/etc/noisy)
+ *
+ * Tests compare a field with a string ('==', '!='), a glob ('~', '!~') or a
+ * set of strings ('in', '!in'), given as {a, b, c} or as @FILE with one string
+ * per line. Fields are bus, type, sender, destination, path, interface,
+ * member, error and arg0 to arg63. Tests combine with '!', '&&', '||' and
+ * parentheses.
+ *
+ * The expression is compiled once into a flat program of tests and short
+ * circuit jumps. Operands of '&&' and '||' are reordered so that header tests
+ * run before argument tests, which have to walk the message body. Sets are
+ * hash sets of precomputed FNV-1a hashes. Evaluating the program allocates
+ * nothing.
+ */
+#define FILTER_MAX_ARG 63
+#define FILTER_ARG_BUFFER 32
+
+/* Limits of the pushdown to the bus. */
+#define FILTER_MAX_RULES 64
+#define FILTER_TERM_MAX 16
+#define FILTER_SET_EXPAND 16
+
+enum filter_field {
+	FILTER_FIELD_BUS,
+	FILTER_FIELD_TYPE,
+	FILTER_FIELD_SENDER,
+	FILTER_FIELD_DESTINATION,
+	FILTER_FIELD_PATH,
+	FILTER_FIELD_INTERFACE,
+	FILTER_FIELD_MEMBER,
+	FILTER_FIELD_ERROR_NAME,
+	FILTER_FIELD_ARG
+};
+
+enum filter_op {
+	FILTER_OP_EQUAL,
+	FILTER_OP_GLOB,
+	FILTER_OP_IN
+};
+
+enum filter_code {
+	FILTER_TEST,
+	FILTER_NOT,
+	FILTER_JUMP_IF_TRUE,
+	FILTER_JUMP_IF_FALSE
+};
+
+struct filter_set {
+	struct intern_slot *slots;
+	size_t size;
+	size_t count;
+};
+
+struct filter_test {
+	enum filter_field field;
+	enum filter_op op;
+	unsigned int arg;
+	char *value;
+	struct filter_set set;
+	/* As written, for reports. */
+	char *text;
+	bool pushed;
+};
+
+struct filter_insn {
+	enum filter_code code;
+	/* Test index, or jump target. */
+	unsigned int operand;
+};
+
+/* Parse tree, kept for the pushdown. */
+struct filter_node {
+	enum { FILTER_NODE_TEST, FILTER_NODE_NOT, FILTER_NODE_AND, FILTER_NODE_OR } kind;
+	unsigned int test;
+	struct filter_node *left;
+	struct filter_node *right;
+};
+
+struct filter_literal {
+	unsigned int test;
+	/* Element of an 'in' set, or -1. */
+	int slot;
+	bool negated;
+};
+
+struct filter_term {
+	struct filter_literal literals[FILTER_TERM_MAX];
+	size_t count;
+};
+
+struct filter_dnf {
+	struct filter_term *terms;
+	size_t count;
+};
+
+struct filter {
+	struct filter_test *tests;
+	size_t test_count;
+	struct filter_insn *program;
+	size_t length;
+	size_t alloc;
+
+	/* Pushdown. The bus rules are exact if they match the same messages as */
+	/* the program, and 'on_bus' is set once the bus applies them. */
+	struct filter_node *root;
+	char **bus_rules;
+	size_t bus_rule_count;
+	bool exact;
+	bool on_bus;
+
+	unsigned long tested;
+	unsigned long rejected;
+};
+
+static const char *filter_expression = NULL;
+/* Non-NULL if -e was given. */
+static struct filter *message_filter = NULL;
+
+static const char *const filter_field_names[] = {
+	[FILTER_FIELD_BUS] = "bus",
+	[FILTER_FIELD_TYPE] = "type",
+	[FILTER_FIELD_SENDER] = "sender",
+	[FILTER_FIELD_DESTINATION] = "destination",
+	[FILTER_FIELD_PATH] = "path",
+	[FILTER_FIELD_INTERFACE] = "interface",
+	[FILTER_FIELD_MEMBER] = "member",
+	[FILTER_FIELD_ERROR_NAME] = "error"
+};
+
+static bool filter_set_add(struct filter_set *set, const char *s) {
+	size_t length;
+	uint64_t hash = intern_hash(s, &length);
+	size_t i;
+
+	/* Keep the load factor under one half. */
+	if ((set->count + 1) * 2 > set->size) {
+		size_t size = set->size == 0 ? 64 : set->size * 2;
+		struct intern_slot *slots = calloc(size, sizeof (struct intern_slot));
+
+		if (slots == NULL) {
+			return false;
+		}
+		for (i = 0; i < set->size; i++) {
+			if (set->slots[i].string != NULL) {
+				size_t j = set->slots[i].hash & (size - 1);
+				while (slots[j].string != NULL) {
+					j = (j + 1) & (size - 1);
+				}
+				slots[j] = set->slots[i];
+			}
+		}
+		free(set->slots);
+		set->slots = slots;
+		set->size = size;
+	}
+
+	for (i = hash & (set->size - 1); set->slots[i].string != NULL; i = (i + 1) & (set->size - 1)) {
+		if (set->slots[i].hash == hash && strcmp(set->slots[i].string, s) == 0) {
+			return true;
+		}
+	}
+	set->slots[i].string = strdup(s);
+	if (set->slots[i].string == NULL) {
+		return false;
+	}
+	set->slots[i].hash = hash;
+	set->count++;
+	return true;
+}
+
+static bool filter_set_contains(const struct filter_set *set, const char *s) {
+	size_t length;
+	uint64_t hash;
+	size_t i;
+
+	if (set->count == 0) {
+		return false;
+	}
+	hash = intern_hash(s, &length);
+	for (i = hash & (set->size - 1); set->slots[i].string != NULL; i = (i + 1) & (set->size - 1)) {
+		if (set->slots[i].hash == hash && strcmp(set->slots[i].string, s) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void filter_set_free(struct filter_set *set) {
+	size_t i;
+
+	for (i = 0; i < set->size; i++) {
+		free((char *)set->slots[i].string);
+	}
+	free(set->slots);
+}
+
+/* One string per line. Empty lines and lines starting with '#' are skipped. */
+static bool filter_set_load(struct filter_set *set, const char *path) {
+	FILE *file = fopen(path, "r");
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t length;
+	bool ok = true;
+
+	if (file == NULL) {
+		perror(path);
+		return false;
+	}
+	while (ok && (length = getline(&line, &size, file)) != -1) {
+		while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r' ||
+				line[length - 1] == ' ' || line[length - 1] == '\t')) {
+			line[--length] = '\0';
+		}
+		if (length > 0 && line[0] != '#') {
+			ok = filter_set_add(set, line);
+		}
+	}
+	free(line);
+	fclose(file);
+	if (!ok) {
+		fprintf(logfile, "ERROR: Out Of Memory! Could not load %s.\n", path);
+	}
+	return ok;
+}
+
+/* Recursive descent parser. Errors are reported with the rest of the input. */
+struct filter_parser {
+	struct filter *filter;
+	const char *p;
+	bool failed;
+};
+
+static void filter_error(struct filter_parser *parser, const char *what) {
+	if (!parser->failed) {
+		fprintf(logfile, "ERROR: Filter: %s at '%s'.\n", what, parser->p);
+		parser->failed = true;
+	}
+}
+
+static void filter_skip_space(struct filter_parser *parser) {
+	while (*parser->p == ' ' || *parser->p == '\t' || *parser->p == '\n') {
+		parser->p++;
+	}
+}
+
+static bool filter_accept(struct filter_parser *parser, const char *token) {
+	size_t length = strlen(token);
+
+	filter_skip_space(parser);
+	if (strncmp(parser->p, token, length) == 0) {
+		parser->p += length;
+		return true;
+	}
+	return false;
+}
+
+static bool filter_word_char(char c) {
+	return c != '\0' && strchr(" \t\n()!{},=~&|'\"", c) == NULL;
+}
+
+/* A quoted or bare word. WARNING: manual free. */
+static char *filter_parse_word(struct filter_parser *parser) {
+	const char *start;
+	char *word;
+	size_t length;
+
+	filter_skip_space(parser);
+	if (*parser->p == '\'' || *parser->p == '"') {
+		char quote = *parser->p++;
+		start = parser->p;
+		while (*parser->p != '\0' && *parser->p != quote) {
+			parser->p++;
+		}
+		if (*parser->p == '\0') {
+			parser->p = start - 1;
+			filter_error(parser, "unterminated string");
+			return NULL;
+		}
+		length = parser->p++ - start;
+	} else {
+		start = parser->p;
+		while (filter_word_char(*parser->p)) {
+			parser->p++;
+		}
+		length = parser->p - start;
+		if (length == 0) {
+			filter_error(parser, "expected a value");
+			return NULL;
+		}
+	}
+
+	word = malloc(length + 1);
+	if (word == NULL) {
+		filter_error(parser, "out of memory");
+		return NULL;
+	}
+	memcpy(word, start, length);
+	word[length] = '\0';
+	return word;
+}
+
+static void filter_node_free(struct filter_node *node) {
+	if (node != NULL) {
+		filter_node_free(node->left);
+		filter_node_free(node->right);
+		free(node);
+	}
+}
+
+/* NULL if out of memory, in which case 'left' and 'right' are freed. */
+static struct filter_node *filter_node_new(struct filter_parser *parser, int kind, struct filter_node *left,
+		struct filter_node *right) {
+	struct filter_node *node = calloc(1, sizeof (struct filter_node));
+
+	if (node == NULL) {
+		filter_error(parser, "out of memory");
+		filter_node_free(left);
+		filter_node_free(right);
+		return NULL;
+	}
+	node->kind = kind;
+	node->left = left;
+	node->right = right;
+	return node;
+}
+
+static bool filter_parse_set(struct filter_parser *parser, struct filter_set *set) {
+	char *word;
+
+	if (filter_accept(parser, "{")) {
+		if (filter_accept(parser, "}")) {
+			return true;
+		}
+		do {
+			bool added;
+
+			word = filter_parse_word(parser);
+			if (word == NULL) {
+				return false;
+			}
+			added = filter_set_add(set, word);
+			free(word);
+			/* A set missing members would let too much through. */
+			if (!added) {
+				filter_error(parser, "out of memory");
+				return false;
+			}
+		} while (filter_accept(parser, ","));
+		if (!filter_accept(parser, "}")) {
+			filter_error(parser, "expected '}'");
+			return false;
+		}
+		return true;
+	}
+
+	if (filter_accept(parser, "@")) {
+		bool ok;
+
+		word = filter_parse_word(parser);
+		if (word == NULL) {
+			return false;
+		}
+		ok = filter_set_load(set, word);
+		free(word);
+		if (!ok) {
+			parser->failed = true;
+		}
+		return ok;
+	}
+
+	filter_error(parser, "expected {...} or @FILE");
+	return false;
+}
+
+static struct filter_node *filter_parse_test(struct filter_parser *parser) {
+	struct filter *f = parser->filter;
+	struct filter_test test;
+	struct filter_test *tests;
+	struct filter_node *node;
+	bool negate = false;
+	const char *text;
+	const char *start;
+	size_t length;
+	unsigned int i;
+
+	memset(&test, 0, sizeof test);
+
+	filter_skip_space(parser);
+	start = parser->p;
+	text = start;
+	while ((*parser->p >= 'a' && *parser->p <= 'z') || (*parser->p >= '0' && *parser->p <= '9')) {
+		parser->p++;
+	}
+	length = parser->p - start;
+
+	test.field = FILTER_FIELD_ARG;
+	for (i = 0; i < sizeof filter_field_names / sizeof filter_field_names[0]; i++) {
+		if (strlen(filter_field_names[i]) == length && strncmp(start, filter_field_names[i], length) == 0) {
+			test.field = i;
+			break;
+		}
+	}
+	if (test.field == FILTER_FIELD_ARG) {
+		char *end;
+
+		if (length <= 3 || strncmp(start, "arg", 3) != 0 ||
+			(test.arg = strtoul(start + 3, &end, 10)) > FILTER_MAX_ARG || end != start + length) {
+			parser->p = start;
+			filter_error(parser, "unknown field");
+			return NULL;
+		}
+	}
+
+	if (filter_accept(parser, "==")) {
+		test.op = FILTER_OP_EQUAL;
+	} else if (filter_accept(parser, "!=")) {
+		test.op = FILTER_OP_EQUAL;
+		negate = true;
+	} else if (filter_accept(parser, "~")) {
+		test.op = FILTER_OP_GLOB;
+	} else if (filter_accept(parser, "!~")) {
+		test.op = FILTER_OP_GLOB;
+		negate = true;
+	} else if (filter_accept(parser, "in")) {
+		test.op = FILTER_OP_IN;
+	} else if (filter_accept(parser, "!in")) {
+		test.op = FILTER_OP_IN;
+		negate = true;
+	} else {
+		filter_error(parser, "expected an operator");
+		return NULL;
+	}
+
+	if (test.op == FILTER_OP_IN) {
+		if (!filter_parse_set(parser, &test.set)) {
+			filter_set_free(&test.set);
+			return NULL;
+		}
+	} else {
+		test.value = filter_parse_word(parser);
+		if (test.value == NULL) {
+			return NULL;
+		}
+	}
+
+	test.text = malloc(parser->p - text + 1);
+	tests = realloc(f->tests, (f->test_count + 1) * sizeof (struct filter_test));
+	if (tests != NULL) {
+		f->tests = tests;
+	}
+	if (test.text == NULL || tests == NULL) {
+		filter_error(parser, "out of memory");
+		free(test.text);
+		free(test.value);
+		filter_set_free(&test.set);
+		return NULL;
+	}
+	memcpy(test.text, text, parser->p - text);
+	test.text[parser->p - text] = '\0';
+	f->tests[f->test_count++] = test;
+
+	node = filter_node_new(parser, FILTER_NODE_TEST, NULL, NULL);
+	if (node == NULL) {
+		return NULL;
+	}
+	node->test = f->test_count - 1;
+	return negate ? filter_node_new(parser, FILTER_NODE_NOT, node, NULL) : node;
+}
+
+static struct filter_node *filter_parse_or(struct filter_parser *parser);
+
+static struct filter_node *filter_parse_unary(struct filter_parser *parser) {
+	struct filter_node *node;
+
+	if (filter_accept(parser, "!")) {
+		node = filter_parse_unary(parser);
+		return node != NULL ? filter_node_new(parser, FILTER_NODE_NOT, node, NULL) : NULL;
+	}
+	if (filter_accept(parser, "(")) {
+		node = filter_parse_or(parser);
+		if (node != NULL && !filter_accept(parser, ")")) {
+			filter_error(parser, "expected ')'");
+			filter_node_free(node);
+			return NULL;
+		}
+		return node;
+	}
+	return filter_parse_test(parser);
+}
+
+static struct filter_node *filter_parse_and(struct filter_parser *parser) {
+	struct filter_node *node = filter_parse_unary(parser);
+
+	while (node != NULL && filter_accept(parser, "&&")) {
+		struct filter_node *right = filter_parse_unary(parser);
+		if (right == NULL) {
+			filter_node_free(node);
+			return NULL;
+		}
+		node = filter_node_new(parser, FILTER_NODE_AND, node, right);
+	}
+	return node;
+}
+
+static struct filter_node *filter_parse_or(struct filter_parser *parser) {
+	struct filter_node *node = filter_parse_and(parser);
+
+	while (node != NULL && filter_accept(parser, "||")) {
+		struct filter_node *right = filter_parse_and(parser);
+		if (right == NULL) {
+			filter_node_free(node);
+			return NULL;
+		}
+		node = filter_node_new(parser, FILTER_NODE_OR, node, right);
+	}
+	return node;
+}
+
+/* True if evaluating 'node' may need the message body. */
+static bool filter_node_reads_args(const struct filter *f, const struct filter_node *node) {
+	if (node == NULL) {
+		return false;
+	}
+	if (node->kind == FILTER_NODE_TEST) {
+		return f->tests[node->test].field == FILTER_FIELD_ARG;
+	}
+	return filter_node_reads_args(f, node->left) || filter_node_reads_args(f, node->right);
+}
+
+static unsigned int filter_emit(struct filter *f, enum filter_code code, unsigned int operand) {
+	if (f->length == f->alloc) {
+		f->alloc = f->alloc != 0 ? f->alloc * 2 : 16;
+		f->program = realloc(f->program, f->alloc * sizeof (struct filter_insn));
+	}
+	f->program[f->length].code = code;
+	f->program[f->length].operand = operand;
+	return f->length++;
+}
+
+/* Leave the result of 'node' in the accumulator. */
+static void filter_compile(struct filter *f, struct filter_node *node) {
+	unsigned int jump;
+
+	switch (node->kind) {
+	case FILTER_NODE_TEST:
+		filter_emit(f, FILTER_TEST, node->test);
+		break;
+
+	case FILTER_NODE_NOT:
+		filter_compile(f, node->left);
+		filter_emit(f, FILTER_NOT, 0);
+		break;
+
+	case FILTER_NODE_AND:
+	case FILTER_NODE_OR:
+		/* Tests have no side effects: cheap operands go first. */
+		if (filter_node_reads_args(f, node->left) && !filter_node_reads_args(f, node->right)) {
+			struct filter_node *swap = node->left;
+			node->left = node->right;
+			node->right = swap;
+		}
+		filter_compile(f, node->left);
+		jump = filter_emit(f, node->kind == FILTER_NODE_AND ? FILTER_JUMP_IF_FALSE : FILTER_JUMP_IF_TRUE, 0);
+		filter_compile(f, node->right);
+		f->program[jump].operand = f->length;
+		break;
+	}
+}
+
+static void filter_free(struct filter *f) {
+	size_t i;
+
+	for (i = 0; i < f->test_count; i++) {
+		free(f->tests[i].value);
+		free(f->tests[i].text);
+		filter_set_free(&f->tests[i].set);
+	}
+	free(f->tests);
+	free(f->program);
+	filter_node_free(f->root);
+	for (i = 0; i < f->bus_rule_count; i++) {
+		free(f->bus_rules[i]);
+	}
+	free(f->bus_rules);
+	free(f);
+}
+
+static struct filter *filter_new(const char *expression) {
+	struct filter_parser parser;
+	struct filter_node *root;
+
+	parser.filter = calloc(1, sizeof (struct filter));
+	if (parser.filter == NULL) {
+		fprintf(logfile, "ERROR: Out Of Memory!\n");
+		return NULL;
+	}
+	parser.p = expression;
+	parser.failed = false;
+
+	root = filter_parse_or(&parser);
+	filter_skip_space(&parser);
+	if (root != NULL && *parser.p != '\0') {
+		filter_error(&parser, "unexpected input");
+	}
+	if (root == NULL || parser.failed) {
+		filter_node_free(root);
+		filter_free(parser.filter);
+		return NULL;
+	}
+
+	filter_compile(parser.filter, root);
+	parser.filter->root = root;
+	return parser.filter;
+}
+
+/* Argument 'index' as a string, if it has a basic type. Numbers are formatted */
+/* in 'buffer'. */
+static const char *filter_arg(DBusMessage *message, unsigned int index, char *buffer) {
+	DBusMessageIter args;
+	DBusBasicValue value;
+	unsigned int i;
+
+	if (!dbus_message_iter_init(message, &args)) {
+		return NULL;
+	}
+	for (i = 0; i < index; i++) {
+		if (!dbus_message_iter_next(&args)) {
+			return NULL;
+		}
+	}
+
+	switch (dbus_message_iter_get_arg_type(&args)) {
+	case DBUS_TYPE_STRING:
+	case DBUS_TYPE_OBJECT_PATH:
+	case DBUS_TYPE_SIGNATURE:
+		dbus_message_iter_get_basic(&args, &value);
+		return value.str;
+	case DBUS_TYPE_BOOLEAN:
+		dbus_message_iter_get_basic(&args, &value);
+		return value.bool_val ? "true" : "false";
+	case DBUS_TYPE_BYTE:
+		dbus_message_iter_get_basic(&args, &value);
+		snprintf(buffer, FILTER_ARG_BUFFER, "%u", value.byt);
+		return buffer;
+	case DBUS_TYPE_INT16:
+		dbus_message_iter_get_basic(&args, &value);
+		snprintf(buffer, FILTER_ARG_BUFFER, "%d", value.i16);
+		return buffer;
+	case DBUS_TYPE_UINT16:
+		dbus_message_iter_get_basic(&args, &value);
+		snprintf(buffer, FILTER_ARG_BUFFER, "%u", value.u16);
+		return buffer;
+	case DBUS_TYPE_INT32:
+		dbus_message_iter_get_basic(&args, &value);
+		snprintf(buffer, FILTER_ARG_BUFFER, "%d", value.i32);
+		return buffer;
+	case DBUS_TYPE_UINT32:
+		dbus_message_iter_get_basic(&args, &value);
+		snprintf(buffer, FILTER_ARG_BUFFER, "%u", value.u32);
+		return buffer;
+	case DBUS_TYPE_INT64:
+		dbus_message_iter_get_basic(&args, &value);
+		snprintf(buffer, FILTER_ARG_BUFFER, "%lld", (long long)value.i64);
+		return buffer;
+	case DBUS_TYPE_UINT64:
+		dbus_message_iter_get_basic(&args, &value);
+		snprintf(buffer, FILTER_ARG_BUFFER, "%llu", (unsigned long long)value.u64);
+		return buffer;
+	case DBUS_TYPE_DOUBLE:
+		dbus_message_iter_get_basic(&args, &value);
+		snprintf(buffer, FILTER_ARG_BUFFER, "%g", value.dbl);
+		return buffer;
+	default:
+		return NULL;
+	}
+}
+
+static bool filter_test(const struct filter_test *test, DBusMessage *message, unsigned int bus) {
+	char buffer[FILTER_ARG_BUFFER];
+	const char *value;
+
+	switch (test->field) {
+	case FILTER_FIELD_BUS:
+		value = bus_name(bus);
+		break;
+	case FILTER_FIELD_TYPE:
+		value = message_type_name(dbus_message_get_type(message));
+		break;
+	case FILTER_FIELD_SENDER:
+		value = dbus_message_get_sender(message);
+		break;
+	case FILTER_FIELD_DESTINATION:
+		value = dbus_message_get_destination(message);
+		break;
+	case FILTER_FIELD_PATH:
+		value = dbus_message_get_path(message);
+		break;
+	case FILTER_FIELD_INTERFACE:
+		value = dbus_message_get_interface(message);
+		break;
+	case FILTER_FIELD_MEMBER:
+		value = dbus_message_get_member(message);
+		break;
+	case FILTER_FIELD_ERROR_NAME:
+		value = dbus_message_get_error_name(message);
+		break;
+	default:
+		value = filter_arg(message, test->arg, buffer);
+		break;
+	}
+
+	/* Missing fields never match. */
+	if (value == NULL) {
+		return false;
+	}
+
+	switch (test->op) {
+	case FILTER_OP_EQUAL:
+		return strcmp(value, test->value) == 0;
+	case FILTER_OP_GLOB:
+		return fnmatch(test->value, value, 0) == 0;
+	default:
+		return filter_set_contains(&test->set, value);
+	}
+}
+
+/* Run the program on 'message'. */
+static bool filter_match(struct filter *f, DBusMessage *message, unsigned int bus) {
+	bool result = false;
+	size_t pc = 0;
+
+	while (pc < f->length) {
+		const struct filter_insn *insn = &f->program[pc++];
+
+		switch (insn->code) {
+		case FILTER_TEST:
+			result = filter_test(&f->tests[insn->operand], message, bus);
+			break;
+		case FILTER_NOT:
+			result = !result;
+			break;
+		case FILTER_JUMP_IF_TRUE:
+			if (result) {
+				pc = insn->operand;
+			}
+			break;
+		case FILTER_JUMP_IF_FALSE:
+			if (!result) {
+				pc = insn->operand;
+			}
+			break;
+		}
+	}
+
+	f->tested++;
+	if (!result) {
+		f->rejected++;
+	}
+	return result;
+}
+
+/* Pushdown: as much of the filter as possible is turned into match rules, so */
+/* that the bus does not even send us what would be rejected. The expression */
+/* is put in disjunctive normal form, each conjunction becoming one rule made */
+/* of the tests the bus can evaluate. The rules are exact if every test made */
+/* it into them, in which case nothing is left to check locally. Otherwise */
+/* they only narrow down what the bus sends, and the program still runs. */
+static bool filter_dnf_add(struct filter_dnf *dnf, const struct filter_term *term) {
+	if (dnf->count == FILTER_MAX_RULES) {
+		return false;
+	}
+	if (dnf->terms == NULL) {
+		dnf->terms = malloc(FILTER_MAX_RULES * sizeof (struct filter_term));
+	}
+	dnf->terms[dnf->count++] = *term;
+	return true;
+}
+
+/* Fields the bus can compare for equality. */
+static bool filter_field_pushable(enum filter_field field) {
+	return field == FILTER_FIELD_TYPE || field == FILTER_FIELD_SENDER || field == FILTER_FIELD_PATH ||
+		field == FILTER_FIELD_INTERFACE || field == FILTER_FIELD_MEMBER;
+}
+
+/* Disjunctive normal form of 'node', negated if 'negate'. False if too big. */
+static bool filter_dnf(const struct filter *f, const struct filter_node *node, bool negate, struct filter_dnf *dnf) {
+	struct filter_dnf left = { NULL, 0 };
+	struct filter_dnf right = { NULL, 0 };
+	struct filter_term term;
+	bool ok = true;
+	size_t i, j;
+
+	switch (node->kind) {
+	case FILTER_NODE_TEST:
+	{
+		const struct filter_test *test = &f->tests[node->test];
+
+		term.count = 1;
+		term.literals[0].test = node->test;
+		term.literals[0].slot = -1;
+		term.literals[0].negated = negate;
+
+		/* A small set is a disjunction of equalities. */
+		if (!negate && test->op == FILTER_OP_IN && filter_field_pushable(test->field) &&
+			test->set.count <= FILTER_SET_EXPAND) {
+			for (i = 0; i < test->set.size && ok; i++) {
+				if (test->set.slots[i].string != NULL) {
+					term.literals[0].slot = i;
+					ok = filter_dnf_add(dnf, &term);
+				}
+			}
+			return ok;
+		}
+		return filter_dnf_add(dnf, &term);
+	}
+
+	case FILTER_NODE_NOT:
+		return filter_dnf(f, node->left, !negate, dnf);
+
+	case FILTER_NODE_AND:
+	case FILTER_NODE_OR:
+		ok = filter_dnf(f, node->left, negate, &left) && filter_dnf(f, node->right, negate, &right);
+
+		if ((node->kind == FILTER_NODE_OR) != negate) {
+			/* Union. */
+			for (i = 0; i < left.count && ok; i++) {
+				ok = filter_dnf_add(dnf, &left.terms[i]);
+			}
+			for (i = 0; i < right.count && ok; i++) {
+				ok = filter_dnf_add(dnf, &right.terms[i]);
+			}
+		} else {
+			/* Distribute. */
+			for (i = 0; i < left.count && ok; i++) {
+				for (j = 0; j < right.count && ok; j++) {
+					if (left.terms[i].count + right.terms[j].count > FILTER_TERM_MAX) {
+						ok = false;
+						break;
+					}
+					term = left.terms[i];
+					memcpy(term.literals + term.count, right.terms[j].literals,
+						right.terms[j].count * sizeof (struct filter_literal));
+					term.count += right.terms[j].count;
+					ok = filter_dnf_add(dnf, &term);
+				}
+			}
+		}
+		free(left.terms);
+		free(right.terms);
+		return ok;
+	}
+	return false;
+}
+
+/* Match rule key and value for 'literal', if the bus can evaluate it. 'exact' */
+/* tells whether the bus matches the same messages, or more. */
+static bool filter_literal_key(const struct filter *f, const struct filter_literal *literal,
+		const char **key, const char **value, size_t *length, bool *exact) {
+	const struct filter_test *test = &f->tests[literal->test];
+	const char *v = literal->slot >= 0 ? test->set.slots[literal->slot].string : test->value;
+
+	if (literal->negated || v == NULL || strchr(v, '\'') != NULL) {
+		return false;
+	}
+	*value = v;
+	*length = strlen(v);
+	*exact = true;
+
+	if (test->op == FILTER_OP_GLOB) {
+		size_t wildcard = strcspn(v, "*?[\\");
+
+		/* Not a glob at all. */
+		if (test->field == FILTER_FIELD_PATH && v[wildcard] == '\0') {
+			*key = "path";
+			return true;
+		}
+		/* '/a/b/' followed by '*' is within path_namespace='/a/b'. */
+		if (test->field == FILTER_FIELD_PATH && wildcard > 1 && strcmp(v + wildcard, "*") == 0 &&
+			v[wildcard - 1] == '/') {
+			*key = "path_namespace";
+			*length = wildcard - 1;
+			*exact = false;
+			return true;
+		}
+		/* 'a.b.*' is within arg0namespace='a.b'. A number never matches */
+		/* such a glob, so the bus seeing only strings loses nothing. */
+		if (test->field == FILTER_FIELD_ARG && test->arg == 0 && wildcard > 1 &&
+			strcmp(v + wildcard, "*") == 0 && v[wildcard - 1] == '.' &&
+			((v[0] >= 'a' && v[0] <= 'z') || (v[0] >= 'A' && v[0] <= 'Z') || v[0] == '_')) {
+			*key = "arg0namespace";
+			*length = wildcard - 1;
+			*exact = false;
+			return true;
+		}
+		return false;
+	}
+
+	if (!filter_field_pushable(test->field)) {
+		return false;
+	}
+	switch (test->field) {
+	case FILTER_FIELD_TYPE:
+		*key = "type";
+		return strcmp(v, DBUS_JSON_SIGNAL) == 0 || strcmp(v, DBUS_JSON_METHOD_CALL) == 0 ||
+			strcmp(v, DBUS_JSON_METHOD_RETURN) == 0 || strcmp(v, DBUS_JSON_ERROR) == 0;
+	case FILTER_FIELD_SENDER:
+		/* The bus also matches the owner of a well-known name, while the */
+		/* sender field always holds a unique name. */
+		*key = "sender";
+		*exact = v[0] == ':' || strcmp(v, DBUS_SERVICE_DBUS) == 0;
+		return true;
+	case FILTER_FIELD_PATH:
+		*key = "path";
+		return true;
+	case FILTER_FIELD_INTERFACE:
+		*key = "interface";
+		return true;
+	default:
+		*key = "member";
+		return true;
+	}
+}
+
+/* The bus refuses rules with invalid names. Such tests are false anyway. */
+static bool filter_literal_rule(const struct filter *f, const struct filter_literal *literal,
+		const char **key, const char **value, size_t *length, bool *exact) {
+	char *copy;
+	bool valid;
+
+	if (!filter_literal_key(f, literal, key, value, length, exact)) {
+		return false;
+	}
+
+	copy = strndup(*value, *length);
+	if (strcmp(*key, "path") == 0 || strcmp(*key, "path_namespace") == 0) {
+		valid = dbus_validate_path(copy, NULL);
+	} else if (strcmp(*key, "interface") == 0) {
+		valid = dbus_validate_interface(copy, NULL);
+	} else if (strcmp(*key, "member") == 0) {
+		valid = dbus_validate_member(copy, NULL);
+	} else if (strcmp(*key, "sender") == 0 || strcmp(*key, "arg0namespace") == 0) {
+		valid = dbus_validate_bus_name(copy, NULL);
+	} else {
+		valid = true;
+	}
+	free(copy);
+	return valid;
+}
+
+/* Key of the group 'key' belongs to. The bus refuses a rule with both path */
+/* and path_namespace, so they count as one. */
+static const char *rule_key_group(const char *key) {
+	return strcmp(key, "path_namespace") == 0 ? "path" : key;
+}
+
+/* Match rule for a conjunction, "" if the bus can check none of its tests. */
+/* NULL if it can never be true. WARNING: manual free. */
+static char *filter_term_rule(struct filter *f, const struct filter_term *term, bool *exact) {
+	struct {
+		const char *key;
+		const char *value;
+		size_t length;
+		bool exact;
+	} pushed[FILTER_TERM_MAX];
+	size_t count = 0;
+	size_t size = 1;
+	char *rule;
+	size_t i, j;
+
+	for (i = 0; i < term->count; i++) {
+		bool duplicate = false;
+		/* Whether the rule checks this literal, reported for its test. */
+		bool written = false;
+
+		if (!filter_literal_rule(f, &term->literals[i], &pushed[count].key, &pushed[count].value,
+				&pushed[count].length, &pushed[count].exact)) {
+			*exact = false;
+			continue;
+		}
+
+		for (j = 0; j < count && !duplicate; j++) {
+			if (strcmp(rule_key_group(pushed[j].key), rule_key_group(pushed[count].key)) != 0) {
+				continue;
+			}
+			duplicate = true;
+			/* path == /a/b && path ~ '/a/...': only the first one goes to the bus. */
+			if (strcmp(pushed[j].key, pushed[count].key) != 0) {
+				*exact = false;
+				continue;
+			}
+			if (pushed[j].length == pushed[count].length &&
+				strncmp(pushed[j].value, pushed[count].value, pushed[j].length) == 0) {
+				written = true;
+				continue;
+			}
+			/* member == a && member == b. */
+			if (pushed[j].exact && pushed[count].exact) {
+				return NULL;
+			}
+			*exact = false;
+		}
+		if (!duplicate) {
+			if (!pushed[count].exact) {
+				*exact = false;
+			}
+			size += strlen(pushed[count].key) + pushed[count].length + 4;
+			count++;
+			written = true;
+		}
+		if (written) {
+			f->tests[term->literals[i].test].pushed = true;
+		}
+	}
+
+	rule = malloc(size);
+	rule[0] = '\0';
+	for (i = 0; i < count; i++) {
+		size_t at = strlen(rule);
+		snprintf(rule + at, size - at, "%s%s='%.*s'", i > 0 ? "," : "",
+			pushed[i].key, (int)pushed[i].length, pushed[i].value);
+	}
+	return rule;
+}
+
+/* True if 'rule' has 'key', as "key=". */
+static bool rule_has_key(const char *rule, const char *key) {
+	size_t length = strlen(key);
+	const char *p = strstr(rule, key);
+
+	while (p != NULL) {
+		if ((p == rule || p[-1] == ',' || p[-1] == ' ') && p[length] == '=') {
+			return true;
+		}
+		p = strstr(p + 1, key);
+	}
+	return false;
+}
+
+/* True if 'rule' has a key of the group 'group', see rule_key_group(). */
+static bool rule_has_group(const char *rule, const char *group) {
+	return rule_has_key(rule, group) || (strcmp(group, "path") == 0 && rule_has_key(rule, "path_namespace"));
+}
+
+static void filter_add_rule(struct filter *f, char *rule) {
+	f->bus_rules = realloc(f->bus_rules, (f->bus_rule_count + 2) * sizeof (char *));
+	f->bus_rules[f->bus_rule_count++] = rule;
+	f->bus_rules[f->bus_rule_count] = NULL;
+}
+
+/* Combine the user match rules with the pushed down filter. Returns the rules */
+/* to give to the bus: the filter keeps them. */
+static char **filter_bus_rules(struct filter *f, char **user_rules) {
+	const char *keys[] = { "type", "sender", "path", "interface", "member", "arg0namespace" };
+	char *empty[] = { "", NULL };
+	struct filter_dnf dnf = { NULL, 0 };
+	char **user;
+	char **rules = NULL;
+	size_t count = 0;
+	size_t i, k;
+	bool exact = true;
+	bool combined = false;
+
+	if (f->bus_rules != NULL) {
+		return f->bus_rules;
+	}
+	if (!filter_dnf(f, f->root, false, &dnf)) {
+		fprintf(logfile, "NOTE: Filter is too complex to be pushed to the bus, it is evaluated locally.\n");
+		free(dnf.terms);
+		return user_rules;
+	}
+
+	/* One rule per conjunction, skipping those which cannot be true. */
+	for (i = 0; i < dnf.count; i++) {
+		char *rule = filter_term_rule(f, &dnf.terms[i], &exact);
+
+		if (rule == NULL) {
+			continue;
+		}
+		if (rule[0] == '\0') {
+			/* This conjunction lets everything through the bus. */
+			free(rule);
+			for (k = 0; k < count; k++) {
+				free(rules[k]);
+			}
+			free(rules);
+			for (k = 0; k < f->test_count; k++) {
+				f->tests[k].pushed = false;
+			}
+			free(dnf.terms);
+			fprintf(logfile, "NOTE: Filter cannot be pushed to the bus, it is evaluated locally.\n");
+			return user_rules;
+		}
+		rules = realloc(rules, (count + 1) * sizeof (char *));
+		rules[count++] = rule;
+	}
+	free(dnf.terms);
+	if (count == 0) {
+		fprintf(logfile, "WARNING: Filter can never match.\n");
+		return user_rules;
+	}
+
+	if (*user_rules == NULL) {
+		user_rules = empty;
+	}
+	for (user = user_rules; *user != NULL; user++) {
+		for (i = 0; i < count; i++) {
+			bool conflict = false;
+			size_t size;
+			char *rule;
+
+			for (k = 0; k < sizeof keys / sizeof keys[0] && !conflict; k++) {
+				conflict = rule_has_group(rules[i], keys[k]) && rule_has_group(*user, keys[k]);
+			}
+			/* The user rule alone lets more through. */
+			if (conflict) {
+				filter_add_rule(f, strdup(*user));
+				exact = false;
+				continue;
+			}
+			size = strlen(*user) + strlen(rules[i]) + 2;
+			rule = malloc(size);
+			snprintf(rule, size, "%s%s%s", *user, **user != '\0' ? "," : "", rules[i]);
+			filter_add_rule(f, rule);
+			combined = true;
+		}
+	}
+	for (i = 0; i < count; i++) {
+		free(rules[i]);
+	}
+	free(rules);
+
+	f->exact = exact;
+	for (i = 0; i < f->test_count; i++) {
+		if (!combined) {
+			f->tests[i].pushed = false;
+		}
+		fprintf(logfile, "NOTE: Filter test %s is evaluated %s.\n", f->tests[i].text,
+			f->tests[i].pushed ? (exact ? "by the bus" : "by the bus, then locally") : "locally");
+	}
+	return f->bus_rules;
+}
+
+static void print_filter_stats(struct filter *f) {
+	if (f->on_bus) {
+		fprintf(logfile, "STATS: Filter: evaluated by the bus with %zu match rules.\n", f->bus_rule_count);
+		return;
+	}
+	fprintf(logfile, "STATS: Filter: %lu of %lu messages rejected, %zu tests in %zu instructions.\n",
+		f->rejected, f->tested, f->test_count, f->length);
+}
+
+
+/**
+ * Bus Queries
+ *
+ * D-Bus provides a service with method that can return useful details about
+ * current session / system. We use one function to centralize this: the
+ * 'query' parameter will define what information we want.
+ */
+enum Queries {
+	QUERY_NONE,
+	QUERY_LIST_NAMES,
+	QUERY_ACTIVATABLE_NAMES,
+	QUERY_GET_NAME_OWNER,
+	QUERY_GET_CONNECTION_UNIX_USER,
+	QUERY_GET_CONNECTION_UNIX_PROCESS_ID,
+	QUERY_INTROSPECT
+};
+
+struct JsonNode *query_bus(enum Queries query, const char *parameter) {
+	DBusConnection *connection;
+	DBusError error;
+
+	DBusMessage *message = NULL;
+	DBusMessageIter args;
+	bool need_parameter = false;
+
+	DBusPendingCall *pending;
+
+	/* Init */
+	dbus_error_init(&error);
+
+	/* Queries go to the first bus. */
+	connection = bus_open(bus_name(0), false, &error);
+	if (dbus_error_is_set(&error)) {
+		fprintf(logfile, "ERROR: Connection Error (%s).\n", error.message);
+		dbus_error_free(&error);
+	}
+	if (connection == NULL) {
+		exit(1);
+	}
+
+
+	/* Create a new method call. */
+	switch (query) {
+	case QUERY_LIST_NAMES:
+	{
+		message = dbus_message_new_method_call(DBUS_SERVICE_DBUS,
+				DBUS_PATH_DBUS,
+				DBUS_INTERFACE_DBUS,
+				"ListNames");
+		break;
+	}
+
+	case QUERY_ACTIVATABLE_NAMES:
+	{
+		message = dbus_message_new_method_call(DBUS_SERVICE_DBUS,
+				DBUS_PATH_DBUS,
+				DBUS_INTERFACE_DBUS,
+				"ListActivatableNames");
+		break;
+	}
+
+	case QUERY_GET_NAME_OWNER:
+	{
+		message = dbus_message_new_method_call(DBUS_SERVICE_DBUS,
+				DBUS_PATH_DBUS,
+				DBUS_INTERFACE_DBUS,
+				"GetNameOwner");
+		need_parameter = true;
+		break;
+	}
+
+	case QUERY_GET_CONNECTION_UNIX_USER:
+	{
+		message = dbus_message_new_method_call(DBUS_SERVICE_DBUS,
+				DBUS_PATH_DBUS,
+				DBUS_INTERFACE_DBUS,
+				"GetConnectionUnixUser");
+		need_parameter = true;
+		break;
+	}
+
+	case QUERY_GET_CONNECTION_UNIX_PROCESS_ID:
+	{
+		message = dbus_message_new_method_call(DBUS_SERVICE_DBUS,
+				DBUS_PATH_DBUS,
+				DBUS_INTERFACE_DBUS,
+				"GetConnectionUnixProcessID");
+		need_parameter = true;
+		break;
+	}
+
+	case QUERY_INTROSPECT:
+	{
+		/* TODO: Need to check if parameter is a valid busname. */
+		message = dbus_message_new_method_call(parameter,
+				DBUS_PATH_DBUS,
+				"org.freedesktop.DBus.Introspectable",
+				"Introspect");
+		break;
+	}
+
+	default:
+		fprintf(logfile, "ERROR: Query unrecognized.\n");
+		return NULL;
+	}
+
+	if (message == NULL) {
+		fprintf(logfile, "ERROR: Message creation error.\n");
+		return NULL;
+	}
+
+	if (need_parameter) {
+		/* Append parameter. */
+		dbus_message_iter_init_append(message, &args);
+		if (!dbus_message_iter_append_basic(&args, DBUS_TYPE_STRING, &parameter)) {
+			fprintf(logfile, "ERROR: Out Of Memory!\n");
+			return NULL;
+		}
+	}
+
+	/* Send message and get a handle for a reply. */
+	/* -1 is default timeout. */
+	if (!dbus_connection_send_with_reply(connection, message, &pending, -1)) {
+		fprintf(logfile, "ERROR: Out Of Memory!\n");
+		return NULL;
+	}
+	if (pending == NULL) {
+		fprintf(logfile, "ERROR: Pending Call Null\n");
+		return NULL;
+	}
+
+	/* Force sending request without waiting. */
+	dbus_connection_flush(connection);
+
+	/* Free message. */
+	dbus_message_unref(message);
 
 	/* Block until we recieve a reply. */
 	dbus_pending_call_block(pending);
 
-	/* Get the reply message. */
-	message = dbus_pending_call_steal_reply(pending);
-	if (message == NULL) {
-		fprintf(logfile, "ERROR: Reply Null\n");
-		return NULL;
+	/* Get the reply message. */
+	message = dbus_pending_call_steal_reply(pending);
+	if (message == NULL) {
+		fprintf(logfile, "ERROR: Reply Null\n");
+		return NULL;
+	}
+
+	/* Free the pending message handle. */
+	dbus_pending_call_unref(pending);
+
+	/* Read the arguments. */
+	JsonNode *message_node = message_mangler(message, NULL);
+
+	/* free reply and close connection */
+	dbus_message_unref(message);
+	dbus_connection_unref(connection);
+
+	return message_node;
+}
+
+
+
+/**
+ * Message store
+ *
+ * Messages caught by the daemon are stored as fixed-layout records in large
+ * contiguous blocks. A record holds the header fields, with the strings
+ * interned while the table has room, followed by the message in wire format as
+ * given by dbus_message_marshal(). Reading a field is a load; the arguments are
+ * decoded only when they are needed, e.g. for the HTML report. JSON is only
+ * produced for export.
+ *
+ * A JSON tree takes several kilobytes per message in dozens of allocations,
+ * while a record is usually a few hundred bytes.
+ *
+ * With -k or -K, the store is a flight recorder: it keeps only the most recent
+ * messages, up to a number of messages or bytes. The oldest record is evicted
+ * by moving the head offset past it. A block is recycled as soon as all its
+ * records are gone, so a full recorder neither allocates nor frees memory.
+ */
+#define STORE_BLOCK_SIZE (1 << 20)
+#define STORE_MIN_BLOCK_SIZE (64 * 1024)
+#define STORE_ALIGN 8
+
+/* The intern table was full: read the header from the wire format. */
+#define RECORD_NOT_INTERNED 1
+
+struct message_record {
+	/* Nanoseconds since the origin of the clock. */
+	int64_t timestamp;
+	uint32_t serial;
+	uint32_t reply_serial;
+	uint8_t type;
+	uint8_t bus;
+	uint16_t flags;
+	uint32_t length;
+	/* Messages it stands for when sampling, see sample(). */
+	uint32_t weight;
+	/* Interned, NULL if absent. */
+	const char *sender;
+	const char *destination;
+	const char *path;
+	const char *interface;
+	const char *member;
+	const char *error_name;
+	/* Followed by 'length' bytes of wire format, padded to STORE_ALIGN. */
+};
+
+struct store_block {
+	struct store_block *next;
+	size_t used;
+	size_t size;
+	unsigned char data[];
+};
+
+struct message_store {
+	struct store_block *head;
+	struct store_block *tail;
+	/* Offset of the oldest record in 'head'. */
+	size_t head_offset;
+	/* Empty blocks waiting for reuse. */
+	struct store_block *spare;
+	size_t count;
+	size_t bytes;
+	unsigned long evicted;
+
+	/* Flight recorder limits. 0 means unlimited. */
+	size_t max_count;
+	size_t max_bytes;
+};
+
+/* Where to find a record. */
+struct store_iter {
+	struct store_block *block;
+	size_t offset;
+};
+
+static struct message_store message_store;
+
+#define STORE_PAD(n) (((n) + STORE_ALIGN - 1) & ~(size_t)(STORE_ALIGN - 1))
+
+static struct store_block *store_new_block(size_t size) {
+	struct store_block *block = malloc(sizeof (struct store_block) + size);
+	if (block == NULL) {
+		return NULL;
+	}
+	block->next = NULL;
+	block->used = 0;
+	block->size = size;
+	return block;
+}
+
+/* Drop the oldest record. */
+static void store_evict(struct message_store *store) {
+	struct message_record *record = (struct message_record *)(store->head->data + store->head_offset);
+	size_t size = sizeof (struct message_record) + STORE_PAD(record->length);
+
+	store->head_offset += size;
+	store->count--;
+	store->bytes -= size;
+	store->evicted++;
+
+	if (store->head_offset >= store->head->used) {
+		struct store_block *block = store->head;
+
+		store->head_offset = 0;
+		if (block == store->tail) {
+			block->used = 0;
+		} else {
+			store->head = block->next;
+			block->next = store->spare;
+			store->spare = block;
+		}
+	}
+}
+
+/* A block for at least 'need' bytes, recycled if possible. */
+static struct store_block *store_get_block(struct message_store *store, size_t need) {
+	size_t size = STORE_BLOCK_SIZE;
+
+	if (store->spare != NULL && store->spare->size >= need) {
+		struct store_block *block = store->spare;
+		store->spare = block->next;
+		block->next = NULL;
+		block->used = 0;
+		return block;
+	}
+
+	/* Small recorders would waste most of a full size block. */
+	if (store->max_bytes != 0 && store->max_bytes / 4 < size) {
+		size = store->max_bytes / 4;
+		if (size < STORE_MIN_BLOCK_SIZE) {
+			size = STORE_MIN_BLOCK_SIZE;
+		}
+	}
+	/* Oversized messages get a block of their own. */
+	return store_new_block(need > size ? need : size);
+}
+
+/* Interned copy of 's' in 'field', unless the intern table is full. */
+static void record_set_string(struct message_record *record, const char **field, const char *s) {
+	*field = intern_or_null(s);
+	if (s != NULL && *field == NULL) {
+		record->flags |= RECORD_NOT_INTERNED;
+	}
+}
+
+static bool store_append(struct message_store *store, DBusMessage *message, const struct timespec *timestamp, unsigned int bus,
+		unsigned long weight) {
+	char *wire;
+	int wire_len;
+	size_t need;
+	struct message_record *record;
+
+	if (!dbus_message_marshal(message, &wire, &wire_len)) {
+		fprintf(logfile, "ERROR: Out Of Memory!\n");
+		return false;
+	}
+
+	need = sizeof (struct message_record) + STORE_PAD((size_t)wire_len);
+
+	/* Make room in the flight recorder. */
+	while (store->count > 0 &&
+		((store->max_count != 0 && store->count >= store->max_count) ||
+			(store->max_bytes != 0 && store->bytes + need > store->max_bytes))) {
+		store_evict(store);
+	}
+
+	if (store->tail == NULL || store->tail->size - store->tail->used < need) {
+		struct store_block *block = store_get_block(store, need);
+		if (block == NULL) {
+			fprintf(logfile, "ERROR: Out Of Memory!\n");
+			dbus_free(wire);
+			return false;
+		}
+		if (store->tail != NULL && store->count > 0) {
+			store->tail->next = block;
+		} else {
+			/* The recorder may have emptied the last block. */
+			if (store->tail != NULL) {
+				store->tail->next = store->spare;
+				store->spare = store->tail;
+			}
+			store->head = block;
+			store->head_offset = 0;
+		}
+		store->tail = block;
+	}
+
+	record = (struct message_record *)(store->tail->data + store->tail->used);
+	record->timestamp = (int64_t)timestamp->tv_sec * 1000000000 + timestamp->tv_nsec;
+	record->serial = dbus_message_get_serial(message);
+	record->reply_serial = dbus_message_get_reply_serial(message);
+	record->type = dbus_message_get_type(message);
+	record->bus = bus;
+	record->flags = 0;
+	record->length = wire_len;
+	record->weight = weight < UINT32_MAX ? weight : UINT32_MAX;
+	record_set_string(record, &record->sender, dbus_message_get_sender(message));
+	record_set_string(record, &record->destination, dbus_message_get_destination(message));
+	record_set_string(record, &record->path, dbus_message_get_path(message));
+	record_set_string(record, &record->interface, dbus_message_get_interface(message));
+	record_set_string(record, &record->member, dbus_message_get_member(message));
+	record_set_string(record, &record->error_name, dbus_message_get_error_name(message));
+	memcpy(record + 1, wire, wire_len);
+	dbus_free(wire);
+
+	store->tail->used += need;
+	store->count++;
+	store->bytes += need;
+	return true;
+}
+
+static struct message_record *store_first(struct message_store *store, struct store_iter *iter) {
+	iter->block = store->head;
+	iter->offset = store->head_offset;
+
+	if (store->count == 0) {
+		return NULL;
+	}
+	return (struct message_record *)(iter->block->data + iter->offset);
+}
+
+static struct message_record *store_next(struct store_iter *iter) {
+	struct message_record *record = (struct message_record *)(iter->block->data + iter->offset);
+
+	iter->offset += sizeof (struct message_record) + STORE_PAD(record->length);
+	if (iter->offset >= iter->block->used) {
+		do {
+			iter->block = iter->block->next;
+		} while (iter->block != NULL && iter->block->used == 0);
+		iter->offset = 0;
+		if (iter->block == NULL) {
+			return NULL;
+		}
+	}
+	return (struct message_record *)(iter->block->data + iter->offset);
+}
+
+static void store_free_blocks(struct store_block *block) {
+	while (block != NULL) {
+		struct store_block *next = block->next;
+		free(block);
+		block = next;
+	}
+}
+
+/* Drop every record. The limits are kept. */
+static void store_clear(struct message_store *store) {
+	size_t max_count = store->max_count;
+	size_t max_bytes = store->max_bytes;
+
+	store_free_blocks(store->head);
+	store_free_blocks(store->spare);
+	memset(store, 0, sizeof *store);
+	store->max_count = max_count;
+	store->max_bytes = max_bytes;
+}
+
+static void print_store_stats(struct message_store *store) {
+	fprintf(logfile, "STATS: Message store: %zu messages, %zu bytes (%.0f bytes per message).\n",
+		store->count, store->bytes,
+		store->count == 0 ? 0.0 : (double)store->bytes / store->count);
+	if (store->max_count != 0 || store->max_bytes != 0) {
+		fprintf(logfile, "STATS: Flight recorder: %lu messages evicted.\n", store->evicted);
+	}
+}
+
+
+/**
+ * HTML report
+ *
+ * One table row per stored message:
+   <tr>
+   <td>1344361353.210869</td>
+   <td>17:42:33</td>
+   <td>method_call</td>
+   <td>:1.68</td>
+   <td>org.freedesktop.DBus</td>
+   <td>2</td>
+   <td>-</td>
+   <td>/org/freedesktop/DBus</td>
+   <td>org.freedesktop.DBus</td>
+   <td>Addmatch</td>
+   <td>string="eavesdrop=true" </td>
+   </tr>
+ *
+ * Header fields are read straight from the record. Only the arguments need the
+ * message to be decoded.
+ */
+#define MEM_CHUNK 32768
+#define HTML_EMPTY_FIELD "-"
+#define HTML_DATA_LIMIT 255
+
+/* Growing string. */
+struct html_buffer {
+	char *data;
+	size_t length;
+	size_t size;
+};
+
+static void html_append(struct html_buffer *buf, const char *s, size_t length) {
+	if (buf->length + length + 1 > buf->size) {
+		char *data;
+		size_t size = buf->size;
+
+		while (buf->length + length + 1 > size) {
+			size += MEM_CHUNK;
+		}
+		data = realloc(buf->data, size);
+		if (data == NULL) {
+			perror("HTML message memory error");
+			return;
+		}
+		buf->data = data;
+		buf->size = size;
+	}
+	memcpy(buf->data + buf->length, s, length);
+	buf->length += length;
+	buf->data[buf->length] = '\0';
+}
+
+static void html_append_cell(struct html_buffer *buf, const char *s) {
+	html_append(buf, "<td>", 4);
+	html_append(buf, s, strlen(s));
+	html_append(buf, "</td>\n", 6);
+}
+
+/* Arguments as 'type=value' pairs, with long values cut. */
+static void html_append_args(struct html_buffer *buf, const struct message_record *record) {
+	DBusMessage *message;
+	DBusMessageIter args;
+	DBusError error;
+	JsonArena *previous;
+	bool empty = true;
+
+	dbus_error_init(&error);
+	message = dbus_message_demarshal((const char *)(record + 1), record->length, &error);
+	if (message == NULL) {
+		fprintf(logfile, "ERROR: Could not decode stored message (%s).\n", error.message);
+		dbus_error_free(&error);
+		html_append_cell(buf, HTML_EMPTY_FIELD);
+		return;
+	}
+
+	html_append(buf, "<td>", 4);
+	previous = json_arena_use(scratch_arena);
+	if (!decode_limits.header_only && dbus_message_iter_init(message, &args)) {
+		struct decode_budget budget = { 0, 0, 0 };
+		unsigned int count = 0;
+
+		do {
+			if (decode_enough_args(&budget, count++)) {
+				break;
+			}
+			JsonNode *arg = args_mangler(&args, &budget);
+			const char *type = json_find_member(arg, DBUS_JSON_ARG_TYPE)->string_;
+			char *value = json_stringify(json_find_member(arg, DBUS_JSON_ARG_VALUE), JSON_FORMAT_NONE);
+			size_t value_len = strlen(value);
+
+			html_append(buf, type, strlen(type));
+			html_append(buf, "=", 1);
+			if (value_len > HTML_DATA_LIMIT) {
+				html_append(buf, value, HTML_DATA_LIMIT - 3);
+				html_append(buf, "...", 3);
+			} else {
+				html_append(buf, value, value_len);
+			}
+			html_append(buf, " ", 1);
+			free(value);
+			empty = false;
+		} while (dbus_message_iter_next(&args));
+		decode_finish(&budget);
+	}
+	json_arena_use(previous);
+	json_arena_reset(scratch_arena);
+	dbus_message_unref(message);
+
+	if (empty) {
+		html_append(buf, HTML_EMPTY_FIELD, strlen(HTML_EMPTY_FIELD));
+	}
+	html_append(buf, "</td>\n", 6);
+}
+
+static void html_append_record(struct html_buffer *buf, const struct message_record *record) {
+	char field[32];
+	time_t sec = record->timestamp / 1000000000;
+	const struct tm *tm = timestamp_human(sec);
+	const char *sender = record->sender;
+	const char *destination = record->destination;
+	const char *path = record->path;
+	const char *interface = record->interface;
+	const char *member = record->member;
+	DBusMessage *message = NULL;
+
+	if (record->flags & RECORD_NOT_INTERNED) {
+		message = dbus_message_demarshal((const char *)(record + 1), record->length, NULL);
+	}
+	if (message != NULL) {
+		sender = dbus_message_get_sender(message);
+		destination = dbus_message_get_destination(message);
+		path = dbus_message_get_path(message);
+		interface = dbus_message_get_interface(message);
+		member = dbus_message_get_member(message);
+	}
+
+	html_append(buf, "\n<tr>", 5);
+
+	snprintf(field, sizeof field, "%lld.%06ld", (long long)sec,
+		(long)(record->timestamp % 1000000000) / 1000);
+	html_append_cell(buf, field);
+	snprintf(field, sizeof field, "%02d:%02d:%02d", tm->tm_hour, tm->tm_min, tm->tm_sec);
+	html_append_cell(buf, field);
+
+	html_append_cell(buf, message_type_name(record->type));
+	html_append_cell(buf, TRAP_NULL_STRING(sender));
+	html_append_cell(buf, TRAP_NULL_STRING(destination));
+
+	snprintf(field, sizeof field, "%u", record->serial);
+	html_append_cell(buf, field);
+	if (record->type == DBUS_MESSAGE_TYPE_METHOD_RETURN || record->type == DBUS_MESSAGE_TYPE_ERROR) {
+		snprintf(field, sizeof field, "%u", record->reply_serial);
+		html_append_cell(buf, field);
+	} else {
+		html_append_cell(buf, HTML_EMPTY_FIELD);
+	}
+
+	html_append_cell(buf, path != NULL ? path : HTML_EMPTY_FIELD);
+	html_append_cell(buf, interface != NULL ? interface : HTML_EMPTY_FIELD);
+	html_append_cell(buf, member != NULL ? member : HTML_EMPTY_FIELD);
+	if (message != NULL) {
+		dbus_message_unref(message);
+	}
+
+	html_append_args(buf, record);
+
+	snprintf(field, sizeof field, "%u", record->weight);
+	html_append_cell(buf, field);
+
+	html_append(buf, "</tr>\n", 6);
+}
+
+/* HTML rows for all stored messages. WARNING: manual free. */
+static char *store_to_html(struct message_store *store) {
+	struct store_iter iter;
+	struct message_record *record;
+	struct html_buffer buf = { NULL, 0, 0 };
+
+	for (record = store_first(store, &iter); record != NULL; record = store_next(&iter)) {
+		html_append_record(&buf, record);
+	}
+
+	return buf.data;
+}
+
+
+/**
+ * PCAP
+ *
+ * Captures can be saved to and read from pcap files with the DLT_DBUS link
+ * type, as written by 'dbus-monitor --pcap' and understood by Wireshark. Each
+ * packet is a message in D-Bus wire format.
+ *
+ * Writing goes through a large buffer so that it costs one write() every few
+ * hundred messages and no formatting at all. Reading maps the file in memory
+ * and feeds every message to the same path as live capture.
+ */
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+#define PCAP_VERSION_MAJOR 2
+#define PCAP_VERSION_MINOR 4
+#define PCAP_LINKTYPE_DBUS 231
+#define PCAP_SNAPLEN DBUS_MAXIMUM_MESSAGE_LENGTH
+#define PCAP_GLOBAL_HEADER_SIZE 24
+#define PCAP_RECORD_HEADER_SIZE 16
+#define PCAP_BUFFER_SIZE (256 * 1024)
+
+struct pcap_writer {
+	int fd;
+	unsigned char *buffer;
+	size_t used;
+	unsigned long count;
+	unsigned long long bytes;
+};
+
+static const char *pcap_output_path = NULL;
+static const char *pcap_input_path = NULL;
+static struct pcap_writer *pcap_output = NULL;
+
+static void put_u32(unsigned char *p, uint32_t v) {
+	memcpy(p, &v, sizeof v);
+}
+
+static void put_u16(unsigned char *p, uint16_t v) {
+	memcpy(p, &v, sizeof v);
+}
+
+static uint32_t get_u32(const unsigned char *p, bool swap) {
+	uint32_t v;
+	memcpy(&v, p, sizeof v);
+	if (swap) {
+		v = (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24);
+	}
+	return v;
+}
+
+static bool pcap_flush(struct pcap_writer *writer) {
+	size_t done = 0;
+
+	while (done < writer->used) {
+		ssize_t n = write(writer->fd, writer->buffer + done, writer->used - done);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("PCAP write");
+			writer->used = 0;
+			return false;
+		}
+		done += n;
+	}
+	writer->used = 0;
+	return true;
+}
+
+static bool pcap_put(struct pcap_writer *writer, const void *data, size_t len) {
+	if (writer->used + len > PCAP_BUFFER_SIZE) {
+		if (!pcap_flush(writer)) {
+			return false;
+		}
+		/* Bigger than the buffer: write it directly. */
+		if (len > PCAP_BUFFER_SIZE) {
+			const unsigned char *p = data;
+			while (len > 0) {
+				ssize_t n = write(writer->fd, p, len);
+				if (n == -1) {
+					if (errno == EINTR) {
+						continue;
+					}
+					perror("PCAP write");
+					return false;
+				}
+				p += n;
+				len -= n;
+			}
+			return true;
+		}
+	}
+	memcpy(writer->buffer + writer->used, data, len);
+	writer->used += len;
+	return true;
+}
+
+/* Start a PCAP stream at the current position of 'fd'. NULL if out of */
+/* memory, in which case 'fd' is left open. */
+static struct pcap_writer *pcap_writer_new(int fd) {
+	struct pcap_writer *writer;
+	unsigned char header[PCAP_GLOBAL_HEADER_SIZE];
+
+	writer = calloc(1, sizeof (struct pcap_writer));
+	if (writer == NULL) {
+		return NULL;
+	}
+	writer->buffer = malloc(PCAP_BUFFER_SIZE);
+	if (writer->buffer == NULL) {
+		free(writer);
+		return NULL;
+	}
+	writer->fd = fd;
+
+	/* Host byte order and nanosecond timestamps; readers check the magic */
+	/* number. */
+	put_u32(header, PCAP_MAGIC_NSEC);
+	put_u16(header + 4, PCAP_VERSION_MAJOR);
+	put_u16(header + 6, PCAP_VERSION_MINOR);
+	put_u32(header + 8, 0);
+	put_u32(header + 12, 0);
+	put_u32(header + 16, PCAP_SNAPLEN);
+	put_u32(header + 20, PCAP_LINKTYPE_DBUS);
+	pcap_put(writer, header, sizeof header);
+
+	return writer;
+}
+
+/* Create 'path', honoring option_force_overwrite. */
+static struct pcap_writer *pcap_open(const char *path) {
+	int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+	struct pcap_writer *writer;
+	int fd;
+
+	if (!option_force_overwrite) {
+		flags |= O_EXCL;
+	}
+
+	fd = open(path, flags, 0644);
+	if (fd == -1) {
+		if (errno == EEXIST) {
+			fprintf(logfile, "ERROR: File exists! Use -f to overwrite it.\n");
+		} else {
+			perror(path);
+		}
+		return NULL;
+	}
+	writer = pcap_writer_new(fd);
+	if (writer == NULL) {
+		fprintf(logfile, "ERROR: Out Of Memory!\n");
+		close(fd);
+	}
+	return writer;
+}
+
+static void pcap_write_message(struct pcap_writer *writer, DBusMessage *message, const struct timespec *timestamp) {
+	unsigned char header[PCAP_RECORD_HEADER_SIZE];
+	char *wire;
+	int wire_len;
+
+	if (!dbus_message_marshal(message, &wire, &wire_len)) {
+		fprintf(logfile, "ERROR: Out Of Memory!\n");
+		return;
+	}
+
+	put_u32(header, timestamp->tv_sec);
+	put_u32(header + 4, timestamp->tv_nsec);
+	put_u32(header + 8, wire_len);
+	put_u32(header + 12, wire_len);
+
+	if (pcap_put(writer, header, sizeof header) && pcap_put(writer, wire, wire_len)) {
+		writer->count++;
+		writer->bytes += sizeof header + wire_len;
+	}
+	dbus_free(wire);
+}
+
+static void pcap_close(struct pcap_writer *writer) {
+	pcap_flush(writer);
+	close(writer->fd);
+	free(writer->buffer);
+	free(writer);
+}
+
+static void print_pcap_stats(struct pcap_writer *writer) {
+	fprintf(logfile, "STATS: PCAP: %lu messages, %llu bytes written.\n",
+		writer->count, writer->bytes);
+}
+
+
+/**
+ * Capture log
+ *
+ * For unattended recording, -O writes caught messages to a directory of
+ * fixed-size segment files instead of a single file. A segment is a small
+ * header followed by a PCAP stream, so 'tail -c +65' turns it back into a
+ * regular PCAP file, and -r reads it as is.
+ *
+ * The header gives the time range of the segment, its number of messages and
+ * the length of the PCAP stream. It is written when the segment is opened,
+ * whenever the buffered messages are flushed, at most SEGMENT_FLUSH_DELAY
+ * milliseconds after they were caught, and when the segment is closed. A
+ * segment which was never closed, e.g. after a crash, ends at the first empty
+ * record, so a crash loses at most that delay's worth of messages.
+ *
+ * Segments are preallocated so that the file system can lay them out
+ * contiguously, and written sequentially through the PCAP writer buffer. A
+ * segment is closed once it reaches its size or its age limit. Closed segments
+ * can be compressed by a background gzip, and only the last ones are kept if a
+ * retention limit is given.
+ */
+#define SEGMENT_MAGIC "DAHSEESG"
+#define SEGMENT_VERSION 1
+#define SEGMENT_HEADER_SIZE 64
+#define SEGMENT_CLOSED 1
+#define SEGMENT_DEFAULT_SIZE (64 * 1024 * 1024)
+#define SEGMENT_FLUSH_DELAY 1000
+
+struct capture_log_child {
+	pid_t pid;
+	unsigned int sequence;
+	/* Retention removed the segment while gzip was running on it. */
+	bool dropped;
+};
+
+struct capture_log {
+	/* Settings. */
+	const char *dir;
+	size_t segment_size;
+	unsigned int segment_time;
+	unsigned int keep;
+	bool compress;
+
+	/* Current segment, NULL between two segments. */
+	struct pcap_writer *writer;
+	char *path;
+	unsigned int sequence;
+	struct timespec opened;
+	/* When the oldest message still in the writer buffer was caught. */
+	struct timespec unflushed;
+	int64_t first;
+	int64_t last;
+
+	/* Closed segments on disk, oldest first. */
+	unsigned int *segments;
+	size_t segment_count;
+	size_t segment_alloc;
+
+	/* Running gzip processes. */
+	struct capture_log_child *children;
+	size_t child_count;
+	size_t child_alloc;
+
+	/* Counters. */
+	unsigned long written;
+	unsigned long messages;
+	unsigned long long bytes;
+	unsigned long removed;
+};
+
+static char *capture_log_spec = NULL;
+static struct capture_log *capture_log = NULL;
+
+extern char **environ;
+
+static size_t parse_size(const char *arg);
+static long timespec_ms_until(const struct timespec *deadline, const struct timespec *now);
+static void timespec_add_ms(struct timespec *ts, int ms);
+
+static void put_u64(unsigned char *p, uint64_t v) {
+	memcpy(p, &v, sizeof v);
+}
+
+static uint64_t get_u64(const unsigned char *p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof v);
+	return v;
+}
+
+static char *segment_path(const struct capture_log *log, unsigned int sequence, const char *suffix) {
+	size_t size = strlen(log->dir) + 32;
+	char *path = malloc(size);
+	snprintf(path, size, "%s/dahsee-%08u.seg%s", log->dir, sequence, suffix);
+	return path;
+}
+
+static void segment_write_header(struct capture_log *log, bool closed) {
+	unsigned char header[SEGMENT_HEADER_SIZE];
+
+	memset(header, 0, sizeof header);
+	memcpy(header, SEGMENT_MAGIC, 8);
+	put_u32(header + 8, SEGMENT_VERSION);
+	put_u32(header + 12, SEGMENT_HEADER_SIZE);
+	put_u64(header + 16, log->first);
+	put_u64(header + 24, log->last);
+	put_u64(header + 32, log->writer->count);
+	put_u64(header + 40, PCAP_GLOBAL_HEADER_SIZE + log->writer->bytes);
+	put_u32(header + 48, closed ? SEGMENT_CLOSED : 0);
+
+	if (pwrite(log->writer->fd, header, sizeof header, 0) != sizeof header) {
+		perror(log->path);
+	}
+}
+
+/* Remove segment 'sequence', compressed or not. True if anything was. */
+static bool capture_log_unlink(struct capture_log *log, unsigned int sequence) {
+	char *plain = segment_path(log, sequence, "");
+	char *packed = segment_path(log, sequence, ".gz");
+	bool removed = unlink(plain) == 0;
+
+	if (unlink(packed) == 0) {
+		removed = true;
+	}
+	free(plain);
+	free(packed);
+	return removed;
+}
+
+/* Reap the gzip processes which are done. Wait for all of them if 'block'. */
+static void capture_log_reap(struct capture_log *log, bool block) {
+	size_t i = 0;
+
+	while (i < log->child_count) {
+		struct capture_log_child *child = &log->children[i];
+		int status;
+		pid_t pid = waitpid(child->pid, &status, block ? 0 : WNOHANG);
+
+		if (pid == 0 || (pid == -1 && errno == EINTR)) {
+			i++;
+			continue;
+		}
+		/* Retention went by while gzip was running. */
+		if (child->dropped) {
+			capture_log_unlink(log, child->sequence);
+		} else if (pid > 0 && (!WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+			fprintf(logfile, "WARNING: Could not compress a capture log segment.\n");
+		}
+		*child = log->children[--log->child_count];
+	}
+}
+
+static void capture_log_compress(struct capture_log *log, const char *path, unsigned int sequence) {
+	posix_spawnattr_t attr;
+	sigset_t none;
+	char *argv[] = { "gzip", "-q", "--", (char *)path, NULL };
+	pid_t pid;
+
+	/* spy() blocks the signals it reads from its signalfd. */
+	sigemptyset(&none);
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigmask(&attr, &none);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+	if (posix_spawnp(&pid, "gzip", NULL, &attr, argv, environ) != 0) {
+		fprintf(logfile, "WARNING: Could not run gzip on %s.\n", path);
+		pid = -1;
+	}
+	posix_spawnattr_destroy(&attr);
+
+	if (pid == -1) {
+		return;
+	}
+	if (log->child_count == log->child_alloc) {
+		log->child_alloc = log->child_alloc != 0 ? log->child_alloc * 2 : 8;
+		log->children = realloc(log->children, log->child_alloc * sizeof (struct capture_log_child));
+	}
+	log->children[log->child_count].pid = pid;
+	log->children[log->child_count].sequence = sequence;
+	log->children[log->child_count].dropped = false;
+	log->child_count++;
+}
+
+/* Drop the oldest segments beyond the retention limit. */
+static void capture_log_retain(struct capture_log *log) {
+	size_t drop;
+	size_t i;
+
+	if (log->keep == 0 || log->segment_count <= log->keep) {
+		return;
+	}
+
+	drop = log->segment_count - log->keep;
+	for (i = 0; i < drop; i++) {
+		bool compressing = false;
+		size_t j;
+
+		/* Leave it to gzip, it is removed once gzip is reaped. */
+		for (j = 0; j < log->child_count; j++) {
+			if (log->children[j].sequence == log->segments[i]) {
+				log->children[j].dropped = true;
+				compressing = true;
+			}
+		}
+		if (compressing || capture_log_unlink(log, log->segments[i])) {
+			log->removed++;
+		}
+	}
+	memmove(log->segments, log->segments + drop, (log->segment_count - drop) * sizeof (unsigned int));
+	log->segment_count -= drop;
+}
+
+static void capture_log_add_segment(struct capture_log *log, unsigned int sequence) {
+	if (log->segment_count == log->segment_alloc) {
+		log->segment_alloc = log->segment_alloc != 0 ? log->segment_alloc * 2 : 64;
+		log->segments = realloc(log->segments, log->segment_alloc * sizeof (unsigned int));
+	}
+	log->segments[log->segment_count++] = sequence;
+}
+
+static int compare_uint(const void *a, const void *b) {
+	unsigned int x = *(const unsigned int *)a;
+	unsigned int y = *(const unsigned int *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* Pick up the segments of previous runs, so that numbering goes on and */
+/* retention applies to them as well. */
+static bool capture_log_scan(struct capture_log *log) {
+	DIR *dir;
+	struct dirent *entry;
+
+	if (mkdir(log->dir, 0755) == -1 && errno != EEXIST) {
+		perror(log->dir);
+		return false;
+	}
+	dir = opendir(log->dir);
+	if (dir == NULL) {
+		perror(log->dir);
+		return false;
+	}
+
+	while ((entry = readdir(dir)) != NULL) {
+		unsigned int sequence;
+		int length = 0;
+
+		if (sscanf(entry->d_name, "dahsee-%8u.seg%n", &sequence, &length) == 1 && length > 0 &&
+			(entry->d_name[length] == '\0' || strcmp(entry->d_name + length, ".gz") == 0)) {
+			capture_log_add_segment(log, sequence);
+			if (sequence >= log->sequence) {
+				log->sequence = sequence + 1;
+			}
+		}
+	}
+	closedir(dir);
+
+	/* A segment may have been found both compressed and not. */
+	if (log->segment_count > 1) {
+		size_t i, j = 1;
+
+		qsort(log->segments, log->segment_count, sizeof (unsigned int), compare_uint);
+		for (i = 1; i < log->segment_count; i++) {
+			if (log->segments[i] != log->segments[j - 1]) {
+				log->segments[j++] = log->segments[i];
+			}
+		}
+		log->segment_count = j;
+	}
+	return true;
+}
+
+static bool capture_log_open_segment(struct capture_log *log) {
+	int fd;
+	int error;
+
+	log->path = segment_path(log, log->sequence, "");
+	fd = open(log->path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		perror(log->path);
+		free(log->path);
+		log->path = NULL;
+		return false;
+	}
+
+	/* Not every file system can preallocate: this is only a hint. */
+	error = posix_fallocate(fd, 0, log->segment_size);
+	if (error != 0 && error != EINVAL && error != EOPNOTSUPP) {
+		fprintf(logfile, "WARNING: Could not preallocate %s: %s.\n", log->path, strerror(error));
+	}
+
+	lseek(fd, SEGMENT_HEADER_SIZE, SEEK_SET);
+	log->writer = pcap_writer_new(fd);
+	if (log->writer == NULL) {
+		fprintf(logfile, "ERROR: Out Of Memory!\n");
+		close(fd);
+		unlink(log->path);
+		free(log->path);
+		log->path = NULL;
+		return false;
+	}
+	/* So that the segment is readable even if we never get to close it. */
+	pcap_flush(log->writer);
+	log->first = 0;
+	log->last = 0;
+	clock_gettime(CLOCK_MONOTONIC, &log->opened);
+	segment_write_header(log, false);
+	return true;
+}
+
+static void capture_log_close_segment(struct capture_log *log) {
+	struct pcap_writer *writer = log->writer;
+
+	pcap_flush(writer);
+	segment_write_header(log, true);
+	/* Give back what was preallocated and not used. */
+	if (ftruncate(writer->fd, SEGMENT_HEADER_SIZE + PCAP_GLOBAL_HEADER_SIZE + writer->bytes) == -1) {
+		perror(log->path);
+	}
+
+	log->written++;
+	log->messages += writer->count;
+	log->bytes += writer->bytes;
+	pcap_close(writer);
+	log->writer = NULL;
+
+	capture_log_add_segment(log, log->sequence);
+	capture_log_reap(log, false);
+	capture_log_retain(log);
+	if (log->compress) {
+		capture_log_compress(log, log->path, log->sequence);
+	}
+	log->sequence++;
+
+	free(log->path);
+	log->path = NULL;
+}
+
+/* When the current segment is due for closing on CLOCK_MONOTONIC. False if */
+/* there is none or it has no age limit. */
+static bool capture_log_close_deadline(const struct capture_log *log, struct timespec *deadline) {
+	if (log->writer == NULL || log->segment_time == 0) {
+		return false;
+	}
+	*deadline = log->opened;
+	deadline->tv_sec += log->segment_time;
+	return true;
+}
+
+/* When the buffered messages are due for writing on CLOCK_MONOTONIC. False */
+/* if there are none. */
+static bool capture_log_flush_deadline(const struct capture_log *log, struct timespec *deadline) {
+	if (log->writer == NULL || log->writer->used == 0) {
+		return false;
+	}
+	*deadline = log->unflushed;
+	timespec_add_ms(deadline, SEGMENT_FLUSH_DELAY);
+	return true;
+}
+
+/* When the event loop must call capture_log_tick() next. False if it need */
+/* not. */
+static bool capture_log_deadline(const struct capture_log *log, struct timespec *deadline) {
+	struct timespec flush;
+
+	if (!capture_log_close_deadline(log, deadline)) {
+		return capture_log_flush_deadline(log, deadline);
+	}
+	if (capture_log_flush_deadline(log, &flush) && timespec_ms_until(&flush, deadline) == 0) {
+		*deadline = flush;
+	}
+	return true;
+}
+
+/* Close the current segment if it is too old, or else write out the messages */
+/* which have waited long enough, along with an updated header. The event */
+/* loop calls this on every wakeup, so that an idle bus does not keep a */
+/* segment open nor messages in memory. */
+static void capture_log_tick(struct capture_log *log, const struct timespec *now) {
+	struct timespec deadline;
+
+	if (capture_log_close_deadline(log, &deadline) && timespec_ms_until(&deadline, now) == 0) {
+		capture_log_close_segment(log);
+	} else if (capture_log_flush_deadline(log, &deadline) && timespec_ms_until(&deadline, now) == 0) {
+		pcap_flush(log->writer);
+		segment_write_header(log, false);
+	}
+}
+
+static void capture_log_write(struct capture_log *log, DBusMessage *message, const struct timespec *timestamp) {
+	int64_t ns = (int64_t)timestamp->tv_sec * 1000000000 + timestamp->tv_nsec;
+
+	size_t used;
+
+	if (log->writer != NULL && log->segment_time > 0) {
+		struct timespec now;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		capture_log_tick(log, &now);
+	}
+
+	if (log->writer == NULL && !capture_log_open_segment(log)) {
+		return;
+	}
+
+	used = log->writer->used;
+	pcap_write_message(log->writer, message, timestamp);
+	/* The buffer was empty, or was flushed to make room. */
+	if (log->writer->used != 0 && (used == 0 || log->writer->used <= used)) {
+		clock_gettime(CLOCK_MONOTONIC, &log->unflushed);
+	}
+	if (log->writer->count == 1) {
+		log->first = ns;
+	}
+	log->last = ns;
+
+	if (SEGMENT_HEADER_SIZE + PCAP_GLOBAL_HEADER_SIZE + log->writer->bytes >= log->segment_size) {
+		capture_log_close_segment(log);
+	}
+}
+
+/* Parse "DIR[,size=BYTES][,time=SEC][,keep=N][,gzip]". */
+static struct capture_log *capture_log_new(char *spec) {
+	enum { OPT_SIZE, OPT_TIME, OPT_KEEP, OPT_GZIP };
+	char *const tokens[] = { "size", "time", "keep", "gzip", NULL };
+	struct capture_log *log = calloc(1, sizeof (struct capture_log));
+	char *options = strchr(spec, ',');
+	char *value;
+
+	log->dir = spec;
+	log->segment_size = SEGMENT_DEFAULT_SIZE;
+
+	if (options != NULL) {
+		*options++ = '\0';
+	}
+	while (options != NULL && *options != '\0') {
+		switch (getsubopt(&options, tokens, &value)) {
+		case OPT_SIZE:
+			log->segment_size = value != NULL ? parse_size(value) : 0;
+			if (log->segment_size < SEGMENT_HEADER_SIZE + PCAP_GLOBAL_HEADER_SIZE) {
+				fprintf(logfile, "ERROR: Invalid segment size.\n");
+				free(log);
+				return NULL;
+			}
+			break;
+		case OPT_TIME:
+			log->segment_time = value != NULL ? strtoul(value, NULL, 10) : 0;
+			break;
+		case OPT_KEEP:
+			log->keep = value != NULL ? strtoul(value, NULL, 10) : 0;
+			break;
+		case OPT_GZIP:
+			log->compress = true;
+			break;
+		default:
+			fprintf(logfile, "ERROR: Unknown capture log option '%s'.\n", value);
+			free(log);
+			return NULL;
+		}
+	}
+
+	if (!capture_log_scan(log)) {
+		free(log->segments);
+		free(log);
+		return NULL;
+	}
+	return log;
+}
+
+static void capture_log_free(struct capture_log *log) {
+	if (log->writer != NULL) {
+		capture_log_close_segment(log);
+	}
+	capture_log_reap(log, true);
+	free(log->children);
+	free(log->segments);
+	free(log);
+}
+
+static void print_capture_log_stats(struct capture_log *log) {
+	fprintf(logfile, "STATS: Capture log: %lu segments, %lu messages, %llu bytes written, %lu segments removed.\n",
+		log->written + (log->writer != NULL),
+		log->messages + (log->writer != NULL ? log->writer->count : 0),
+		log->bytes + (log->writer != NULL ? log->writer->bytes : 0),
+		log->removed);
+}
+
+
+/**
+ * Event loop
+ *
+ * The capture loop is driven by epoll. libdbus tells us which file descriptors
+ * and timeouts it needs through the watch and timeout callbacks below; we
+ * register them in the epoll set and hand control back to libdbus when they
+ * fire. Every wakeup drains all complete messages queued on the connection, so
+ * that a busy bus costs one epoll_wait() per batch instead of one per message.
+ *
+ * SIGINT (and SIGUSR1, used by the daemon to stop recording) are blocked while
+ * spying and read from a signalfd, so that shutdown is immediate.
+ */
+#define LOOP_MAX_EVENTS 32
+
+/* Maximum number of times a readable watch is handled in a single wakeup. Each */
+/* round reads a few kilobytes from the socket. */
+#define LOOP_READ_ROUNDS 16
+
+/* Batch size histogram buckets: 1, 2-3, 4-7, ..., 2^(n-1) and more. */
+#define LOOP_HISTOGRAM_SIZE 12
+
+struct loop_timeout {
+	DBusTimeout *timeout;
+	struct timespec deadline;
+};
+
+struct event_loop {
+	int epoll_fd;
+	int signal_fd;
+	int timer_fd;
+
+	DBusWatch **watches;
+	size_t watch_count;
+	size_t watch_size;
+
+	struct loop_timeout *timeouts;
+	size_t timeout_count;
+	size_t timeout_size;
+};
+
+struct capture_stats {
+	unsigned long messages;
+	unsigned long wakeups;
+	unsigned long batch_max;
+	unsigned long batch_histogram[LOOP_HISTOGRAM_SIZE];
+};
+
+static struct capture_stats capture_stats;
+
+static void print_capture_stats() {
+	struct capture_stats *st = &capture_stats;
+	int i;
+
+	fprintf(logfile, "STATS: %lu messages in %lu wakeups (%.2f per wakeup, max %lu).\n",
+		st->messages, st->wakeups,
+		st->wakeups == 0 ? 0.0 : (double)st->messages / st->wakeups,
+		st->batch_max);
+
+	fprintf(logfile, "STATS: Messages per wakeup:");
+	for (i = 0; i < LOOP_HISTOGRAM_SIZE; i++) {
+		if (st->batch_histogram[i] == 0) {
+			continue;
+		}
+		if (i == 0) {
+			fprintf(logfile, " [1]=%lu", st->batch_histogram[i]);
+		} else if (i == LOOP_HISTOGRAM_SIZE - 1) {
+			fprintf(logfile, " [%lu+]=%lu", 1UL << i, st->batch_histogram[i]);
+		} else {
+			fprintf(logfile, " [%lu-%lu]=%lu", 1UL << i, (2UL << i) - 1, st->batch_histogram[i]);
+		}
+	}
+	fprintf(logfile, "\n");
+}
+
+static void record_batch(unsigned long batch) {
+	int bucket = 0;
+
+	if (batch == 0) {
+		return;
+	}
+
+	capture_stats.wakeups++;
+	if (batch > capture_stats.batch_max) {
+		capture_stats.batch_max = batch;
+	}
+
+	while (bucket < LOOP_HISTOGRAM_SIZE - 1 && (batch >> (bucket + 1)) != 0) {
+		bucket++;
+	}
+	capture_stats.batch_histogram[bucket]++;
+}
+
+static void timespec_add_ms(struct timespec *ts, int ms) {
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (long)(ms % 1000) * 1000000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+/* Milliseconds from 'now' to 'deadline', rounded up. 0 if already passed. */
+static long timespec_ms_until(const struct timespec *deadline, const struct timespec *now) {
+	long ms = (deadline->tv_sec - now->tv_sec) * 1000
+		+ (deadline->tv_nsec - now->tv_nsec + 999999) / 1000000;
+	return ms < 0 ? 0 : ms;
+}
+
+/* Register the union of the enabled watches on 'fd' in the epoll set. */
+static void loop_update_fd(struct event_loop *loop, int fd) {
+	struct epoll_event event;
+	size_t i;
+
+	memset(&event, 0, sizeof event);
+	event.data.fd = fd;
+
+	for (i = 0; i < loop->watch_count; i++) {
+		DBusWatch *watch = loop->watches[i];
+		unsigned int flags;
+
+		if (dbus_watch_get_unix_fd(watch) != fd || !dbus_watch_get_enabled(watch)) {
+			continue;
+		}
+
+		flags = dbus_watch_get_flags(watch);
+		if (flags & DBUS_WATCH_READABLE) {
+			event.events |= EPOLLIN;
+		}
+		if (flags & DBUS_WATCH_WRITABLE) {
+			event.events |= EPOLLOUT;
+		}
+	}
+
+	if (event.events == 0) {
+		epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+		return;
+	}
+
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, fd, &event) == -1 && errno == ENOENT) {
+		if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+			fprintf(logfile, "ERROR: Could not watch file descriptor %d (%s).\n", fd, strerror(errno));
+		}
+	}
+}
+
+static dbus_bool_t loop_add_watch(DBusWatch *watch, void *data) {
+	struct event_loop *loop = data;
+
+	if (loop->watch_count == loop->watch_size) {
+		size_t size = loop->watch_size == 0 ? 4 : 2 * loop->watch_size;
+		DBusWatch **watches = realloc(loop->watches, size * sizeof (DBusWatch *));
+		if (watches == NULL) {
+			return FALSE;
+		}
+		loop->watches = watches;
+		loop->watch_size = size;
+	}
+
+	loop->watches[loop->watch_count++] = watch;
+	loop_update_fd(loop, dbus_watch_get_unix_fd(watch));
+	return TRUE;
+}
+
+static void loop_remove_watch(DBusWatch *watch, void *data) {
+	struct event_loop *loop = data;
+	size_t i;
+
+	for (i = 0; i < loop->watch_count; i++) {
+		if (loop->watches[i] == watch) {
+			loop->watches[i] = loop->watches[--loop->watch_count];
+			break;
+		}
+	}
+	loop_update_fd(loop, dbus_watch_get_unix_fd(watch));
+}
+
+static void loop_toggle_watch(DBusWatch *watch, void *data) {
+	loop_update_fd(data, dbus_watch_get_unix_fd(watch));
+}
+
+static void loop_arm_timeout(struct loop_timeout *lt) {
+	clock_gettime(CLOCK_MONOTONIC, &lt->deadline);
+	timespec_add_ms(&lt->deadline, dbus_timeout_get_interval(lt->timeout));
+}
+
+static dbus_bool_t loop_add_timeout(DBusTimeout *timeout, void *data) {
+	struct event_loop *loop = data;
+
+	if (loop->timeout_count == loop->timeout_size) {
+		size_t size = loop->timeout_size == 0 ? 4 : 2 * loop->timeout_size;
+		struct loop_timeout *timeouts = realloc(loop->timeouts, size * sizeof (struct loop_timeout));
+		if (timeouts == NULL) {
+			return FALSE;
+		}
+		loop->timeouts = timeouts;
+		loop->timeout_size = size;
+	}
+
+	loop->timeouts[loop->timeout_count].timeout = timeout;
+	loop_arm_timeout(&loop->timeouts[loop->timeout_count]);
+	loop->timeout_count++;
+	return TRUE;
+}
+
+static void loop_remove_timeout(DBusTimeout *timeout, void *data) {
+	struct event_loop *loop = data;
+	size_t i;
+
+	for (i = 0; i < loop->timeout_count; i++) {
+		if (loop->timeouts[i].timeout == timeout) {
+			loop->timeouts[i] = loop->timeouts[--loop->timeout_count];
+			return;
+		}
+	}
+}
+
+static void loop_toggle_timeout(DBusTimeout *timeout, void *data) {
+	struct event_loop *loop = data;
+	size_t i;
+
+	/* Re-arm on toggle, as libdbus expects the interval to restart. */
+	for (i = 0; i < loop->timeout_count; i++) {
+		if (loop->timeouts[i].timeout == timeout) {
+			loop_arm_timeout(&loop->timeouts[i]);
+			return;
+		}
+	}
+}
+
+/* Return the epoll_wait() timeout in milliseconds before the next D-Bus */
+/* timeout, or -1 if there is none. */
+static int loop_next_timeout(struct event_loop *loop) {
+	struct timespec now;
+	long best = -1;
+	size_t i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	for (i = 0; i < loop->timeout_count; i++) {
+		struct loop_timeout *lt = &loop->timeouts[i];
+		long ms;
+
+		if (!dbus_timeout_get_enabled(lt->timeout)) {
+			continue;
+		}
+
+		ms = timespec_ms_until(&lt->deadline, &now);
+		if (best == -1 || ms < best) {
+			best = ms;
+		}
+	}
+
+	return (int)best;
+}
+
+static void loop_handle_timeouts(struct event_loop *loop) {
+	struct timespec now;
+	size_t i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	/* dbus_timeout_handle() may add or remove timeouts, so restart the scan */
+	/* after every call. */
+	for (i = 0; i < loop->timeout_count; i++) {
+		struct loop_timeout *lt = &loop->timeouts[i];
+
+		if (!dbus_timeout_get_enabled(lt->timeout)) {
+			continue;
+		}
+		if (lt->deadline.tv_sec > now.tv_sec ||
+			(lt->deadline.tv_sec == now.tv_sec && lt->deadline.tv_nsec > now.tv_nsec)) {
+			continue;
+		}
+
+		loop_arm_timeout(lt);
+		dbus_timeout_handle(lt->timeout);
+		i = (size_t)-1;
+	}
+}
+
+/* Forward the epoll events of 'fd' to the matching watches. Returns true if */
+/* the fd was readable. */
+#define LOOP_MAX_FD_WATCHES 4
+static bool loop_handle_fd(struct event_loop *loop, int fd, uint32_t events) {
+	DBusWatch *matching[LOOP_MAX_FD_WATCHES];
+	size_t match_count = 0;
+	unsigned int flags = 0;
+	size_t i, j;
+
+	if (events & EPOLLIN) {
+		flags |= DBUS_WATCH_READABLE;
+	}
+	if (events & EPOLLOUT) {
+		flags |= DBUS_WATCH_WRITABLE;
+	}
+	if (events & EPOLLERR) {
+		flags |= DBUS_WATCH_ERROR;
+	}
+	if (events & EPOLLHUP) {
+		flags |= DBUS_WATCH_HANGUP;
+	}
+
+	/* libdbus usually has one watch for reading and one for writing on the */
+	/* same socket. Collect them first since handling may change the list. */
+	for (i = 0; i < loop->watch_count && match_count < LOOP_MAX_FD_WATCHES; i++) {
+		if (dbus_watch_get_unix_fd(loop->watches[i]) == fd) {
+			matching[match_count++] = loop->watches[i];
+		}
+	}
+
+	for (j = 0; j < match_count; j++) {
+		unsigned int watch_flags;
+
+		/* Skip watches removed by a previous handler. */
+		for (i = 0; i < loop->watch_count && loop->watches[i] != matching[j]; i++) {
+		}
+		if (i == loop->watch_count || !dbus_watch_get_enabled(matching[j])) {
+			continue;
+		}
+
+		/* Errors and hangups are always reported. */
+		watch_flags = dbus_watch_get_flags(matching[j]) | DBUS_WATCH_ERROR | DBUS_WATCH_HANGUP;
+		if ((flags & watch_flags) != 0) {
+			dbus_watch_handle(matching[j], flags & watch_flags);
+		}
+	}
+
+	return (flags & DBUS_WATCH_READABLE) != 0;
+}
+
+static int loop_init(struct event_loop *loop, const sigset_t *sigmask) {
+	struct epoll_event event;
+
+	memset(loop, 0, sizeof *loop);
+	loop->signal_fd = -1;
+	loop->timer_fd = -1;
+
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epoll_fd == -1) {
+		perror("epoll_create1");
+		return -1;
+	}
+
+	loop->signal_fd = signalfd(-1, sigmask, SFD_CLOEXEC | SFD_NONBLOCK);
+	if (loop->signal_fd == -1) {
+		perror("signalfd");
+		return -1;
+	}
+
+	memset(&event, 0, sizeof event);
+	event.events = EPOLLIN;
+	event.data.fd = loop->signal_fd;
+	epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->signal_fd, &event);
+
+	if (option_stats_interval > 0) {
+		struct itimerspec period;
+
+		loop->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+		if (loop->timer_fd == -1) {
+			perror("timerfd_create");
+			return -1;
+		}
+
+		memset(&period, 0, sizeof period);
+		period.it_value.tv_sec = option_stats_interval;
+		period.it_interval.tv_sec = option_stats_interval;
+		timerfd_settime(loop->timer_fd, 0, &period, NULL);
+
+		event.data.fd = loop->timer_fd;
+		epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->timer_fd, &event);
+	}
+
+	return 0;
+}
+
+static void loop_free(struct event_loop *loop) {
+	if (loop->timer_fd != -1) {
+		close(loop->timer_fd);
+	}
+	if (loop->signal_fd != -1) {
+		close(loop->signal_fd);
+	}
+	if (loop->epoll_fd != -1) {
+		close(loop->epoll_fd);
+	}
+	free(loop->watches);
+	free(loop->timeouts);
+}
+
+
+/**
+ * Eavesdrop messages and store them internally. Parameter is a NULL-terminated
+ * list of user-defined filters, one match rule each.
+ *
+ * We first ask the bus to turn our connection into a monitor with
+ * org.freedesktop.DBus.Monitoring.BecomeMonitor. A monitor is not a regular
+ * participant: it cannot send anything, nobody can call it, and the daemon
+ * copies messages to it without waiting for us. Older or restrictive daemons
+ * refuse, in which case we fall back to AddMatch with 'eavesdrop=true'.
+ */
+
+#define EAVES "eavesdrop=true"
+#define LIVE_OUTPUT_OFF 0
+#define LIVE_OUTPUT_ON 1
+
+#define DBUS_INTERFACE_MONITORING "org.freedesktop.DBus.Monitoring"
+
+/* A bus being captured. */
+struct spy_bus {
+	unsigned int index;
+	DBusConnection *connection;
+	int fd;
+	/* Unique name of the connection before it became a monitor, if it did. */
+	char *monitor_unique_name;
+	/* Disconnected, and out of the event loop. */
+	bool lost;
+};
+
+/**
+ * Output
+ *
+ * Live output is not written message by message, nor by the thread which
+ * caught the messages. Formatted messages pile up in an output block: the
+ * capture thread formats them one after the other in the block's writer
+ * buffer, and the pipeline output thread hands over the texts of the decode
+ * workers, which are freed once written.
+ *
+ * Once OUTPUT_BATCH_SIZE bytes are pending, or once the oldest pending message
+ * has waited for OUTPUT_BATCH_DELAY milliseconds, the block is queued for the
+ * writer thread, which writes it with writev(), and a free block takes its
+ * place. Two blocks are enough when the output keeps up. When it does not,
+ * e.g. a slow pipe or a network file system, more blocks are queued so that
+ * the capture thread keeps reading the bus. It only waits for the writer thread
+ * once OUTPUT_QUEUE_MAX bytes are queued.
+ *
+ * What a write error leaves unwritten is dropped and counted as lost, so that
+ * a broken pipe or a full disk does not hold up the capture.
+ *
+ * With -c, every message is a single line of compact JSON.
+ */
+#define OUTPUT_BATCH_SIZE (256 * 1024)
+#define OUTPUT_BATCH_DELAY 100
+#define OUTPUT_BATCH_IOV 256
+#define OUTPUT_QUEUE_MAX (64 * 1024 * 1024)
+
+struct output_block {
+	struct output_block *next;
+
+	/* Messages formatted in place. */
+	JsonWriter *writer;
+	size_t written_length;
+
+	/* Messages formatted elsewhere. */
+	struct iovec *iov;
+	int count;
+	int size;
+
+	size_t pending;
+	unsigned long messages;
+};
+
+struct output_batch {
+	int fd;
+
+	/* Block being filled. Only touched by the producer. */
+	struct output_block *current;
+	struct timespec since;
+
+	pthread_t thread;
+	bool running;
+	bool stopping;
+
+	/* Queue to the writer thread, and blocks ready for reuse. */
+	pthread_mutex_t lock;
+	pthread_cond_t queued;
+	pthread_cond_t room;
+	struct output_block *head;
+	struct output_block *tail;
+	struct output_block *spare;
+	size_t queued_bytes;
+	size_t queued_peak;
+
+	/* Counters, under the lock. */
+	unsigned long messages;
+	unsigned long writes;
+	unsigned long long bytes;
+	double write_time;
+	double write_max;
+	unsigned long stalls;
+	double stall_time;
+	unsigned long long lost_bytes;
+	unsigned long lost_messages;
+};
+
+static struct output_batch output_batch = {
+	.fd = -1,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.queued = PTHREAD_COND_INITIALIZER,
+	.room = PTHREAD_COND_INITIALIZER
+};
+
+static double timespec_elapsed(const struct timespec *start, const struct timespec *end) {
+	return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* NULL if out of memory. */
+static struct output_block *output_block_new() {
+	struct output_block *block = calloc(1, sizeof (struct output_block));
+
+	if (block == NULL) {
+		return NULL;
+	}
+	block->writer = json_writer_new(output_space());
+	if (block->writer == NULL) {
+		free(block);
+		return NULL;
+	}
+	return block;
+}
+
+static void output_block_free(struct output_block *block) {
+	int i;
+
+	for (i = 0; i < block->count; i++) {
+		free(block->iov[i].iov_base);
+	}
+	free(block->iov);
+	json_writer_free(block->writer);
+	free(block);
+}
+
+static void output_block_reset(struct output_block *block) {
+	int i;
+
+	for (i = 0; i < block->count; i++) {
+		free(block->iov[i].iov_base);
+	}
+	block->count = 0;
+	json_writer_reset(block->writer);
+	block->written_length = 0;
+	block->pending = 0;
+	block->messages = 0;
+}
+
+/* Write the block, OUTPUT_BATCH_IOV buffers at a time. Return the number of */
+/* writev() calls, and the number of bytes written in 'written', less than */
+/* the pending ones after an error. */
+static unsigned long output_block_write(int fd, struct output_block *block, size_t *written) {
+	struct iovec vector[OUTPUT_BATCH_IOV];
+	unsigned long writes = 0;
+	int next = 0;
+	bool tail = block->written_length > 0;
+
+	*written = 0;
+	while (next < block->count || tail) {
+		struct iovec *iov = vector;
+		int count = 0;
+
+		/* Partial writes move the bases, keep the originals for free(). */
+		while (next < block->count && count < OUTPUT_BATCH_IOV) {
+			vector[count++] = block->iov[next++];
+		}
+		if (next == block->count && tail && count < OUTPUT_BATCH_IOV) {
+			vector[count].iov_base = (void *)json_writer_data(block->writer, NULL);
+			vector[count].iov_len = block->written_length;
+			count++;
+			tail = false;
+		}
+
+		while (count > 0) {
+			ssize_t n = writev(fd, iov, count);
+			if (n == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				perror("Output write");
+				return writes;
+			}
+			writes++;
+			*written += n;
+
+			/* Skip what went out, possibly part of a buffer. */
+			while (count > 0 && (size_t)n >= iov->iov_len) {
+				n -= iov->iov_len;
+				iov++;
+				count--;
+			}
+			if (count > 0) {
+				iov->iov_base = (char *)iov->iov_base + n;
+				iov->iov_len -= n;
+			}
+		}
 	}
 
-	/* Free the pending message handle. */
-	dbus_pending_call_unref(pending);
+	return writes;
+}
 
-	/* Read the arguments. */
-	JsonNode *message_node = message_mangler(message);
+/* Count a block once written, 'written' bytes of it. */
+static void output_batch_account(struct output_batch *b, const struct output_block *block, size_t written) {
+	b->bytes += written;
+	if (written < block->pending) {
+		b->lost_bytes += block->pending - written;
+		b->lost_messages += block->messages;
+	} else {
+		b->messages += block->messages;
+	}
+}
 
-	/* free reply and close connection */
-	dbus_message_unref(message);
-	dbus_connection_unref(connection);
+static void *output_writer(void *data) {
+	struct output_batch *b = data;
 
-	return message_node;
+	pthread_mutex_lock(&b->lock);
+	for (;;) {
+		struct output_block *block;
+		struct timespec start, end;
+		unsigned long writes;
+		size_t written;
+		double elapsed;
+
+		while (b->head == NULL && !b->stopping) {
+			pthread_cond_wait(&b->queued, &b->lock);
+		}
+		if (b->head == NULL) {
+			break;
+		}
+
+		/* The block stays queued, and counted, until written. */
+		block = b->head;
+		pthread_mutex_unlock(&b->lock);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		writes = output_block_write(b->fd, block, &written);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		elapsed = timespec_elapsed(&start, &end);
+
+		pthread_mutex_lock(&b->lock);
+		b->head = block->next;
+		if (b->head == NULL) {
+			b->tail = NULL;
+		}
+		b->queued_bytes -= block->pending;
+		output_batch_account(b, block, written);
+		b->writes += writes;
+		b->write_time += elapsed;
+		if (elapsed > b->write_max) {
+			b->write_max = elapsed;
+		}
+
+		output_block_reset(block);
+		block->next = b->spare;
+		b->spare = block;
+		pthread_cond_signal(&b->room);
+	}
+	pthread_mutex_unlock(&b->lock);
+
+	return NULL;
+}
+
+/* Start the writer thread on 'fd'. Without it, blocks are written by the */
+/* producer. */
+static void output_batch_start(struct output_batch *b, int fd) {
+	b->fd = fd;
+	b->current = output_block_new();
+	b->stopping = false;
+	b->lost_bytes = 0;
+	b->lost_messages = 0;
+	b->queued_peak = 0;
+	b->messages = 0;
+	b->writes = 0;
+	b->bytes = 0;
+	b->write_time = 0;
+	b->write_max = 0;
+	b->stalls = 0;
+	b->stall_time = 0;
+
+	/* Messages are counted as lost until the end. */
+	if (b->current == NULL) {
+		fprintf(logfile, "ERROR: Out Of Memory! No live output.\n");
+		b->running = false;
+		return;
+	}
+
+	/* The thread inherits the signal mask of the capture thread, so that */
+	/* signals keep going to the signalfd. */
+	b->running = pthread_create(&b->thread, NULL, output_writer, b) == 0;
+	if (!b->running) {
+		fprintf(logfile, "WARNING: Could not start writer thread, writing from the capture thread.\n");
+	}
 }
 
+/* Queue the current block, if anything is pending. */
+static void output_batch_submit(struct output_batch *b) {
+	struct output_block *block = b->current;
+	struct output_block *spare;
 
+	if (block == NULL || block->pending == 0) {
+		return;
+	}
+
+	if (!b->running) {
+		size_t written;
+
+		b->writes += output_block_write(b->fd, block, &written);
+		output_batch_account(b, block, written);
+		output_block_reset(block);
+		return;
+	}
+
+	pthread_mutex_lock(&b->lock);
+	if (b->head != NULL && b->queued_bytes + block->pending > OUTPUT_QUEUE_MAX) {
+		struct timespec start, end;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		while (b->head != NULL && b->queued_bytes + block->pending > OUTPUT_QUEUE_MAX) {
+			pthread_cond_wait(&b->room, &b->lock);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		b->stalls++;
+		b->stall_time += timespec_elapsed(&start, &end);
+	}
+
+	block->next = NULL;
+	if (b->tail != NULL) {
+		b->tail->next = block;
+	} else {
+		b->head = block;
+	}
+	b->tail = block;
+	b->queued_bytes += block->pending;
+	if (b->queued_bytes > b->queued_peak) {
+		b->queued_peak = b->queued_bytes;
+	}
+	pthread_cond_signal(&b->queued);
+
+	spare = b->spare;
+	if (spare != NULL) {
+		b->spare = spare->next;
+	}
+	pthread_mutex_unlock(&b->lock);
+
+	if (spare == NULL && (spare = output_block_new()) == NULL) {
+		/* Out of memory: the writer thread gives one back once written. */
+		pthread_mutex_lock(&b->lock);
+		while (b->spare == NULL) {
+			pthread_cond_wait(&b->room, &b->lock);
+		}
+		spare = b->spare;
+		b->spare = spare->next;
+		pthread_mutex_unlock(&b->lock);
+	}
+	b->current = spare;
+}
+
+/* Write everything and join the writer thread. */
+static void output_batch_stop(struct output_batch *b) {
+	if (b->current == NULL) {
+		return;
+	}
+
+	output_batch_submit(b);
+	if (b->running) {
+		pthread_mutex_lock(&b->lock);
+		b->stopping = true;
+		pthread_cond_signal(&b->queued);
+		pthread_mutex_unlock(&b->lock);
+		pthread_join(b->thread, NULL);
+		b->running = false;
+	}
+
+	output_block_free(b->current);
+	b->current = NULL;
+	while (b->spare != NULL) {
+		struct output_block *next = b->spare->next;
+		output_block_free(b->spare);
+		b->spare = next;
+	}
+}
+
+/* Start the delay with the first pending message. */
+static void output_batch_touch(struct output_batch *b) {
+	if (b->current->pending == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &b->since);
+	}
+}
+
+/* Format a message after the pending ones. */
+static void output_batch_emit(struct output_batch *b, DBusMessage *message, const struct timespec *timestamp, unsigned int bus,
+		unsigned long weight) {
+	struct output_block *block = b->current;
+	size_t length;
+
+	if (block == NULL) {
+		b->lost_messages++;
+		return;
+	}
+	output_batch_touch(b);
+	message_emit_line(block->writer, message, timestamp, bus, weight);
+	json_writer_data(block->writer, &length);
+
+	block->pending += length - block->written_length;
+	block->written_length = length;
+	block->messages++;
+	if (block->pending >= OUTPUT_BATCH_SIZE) {
+		output_batch_submit(b);
+	}
+}
+
+/* Queue a formatted message, newline included. The batch frees 'text'. */
+static void output_batch_take(struct output_batch *b, char *text, size_t length) {
+	struct output_block *block = b->current;
+
+	if (block == NULL) {
+		b->lost_messages++;
+		free(text);
+		return;
+	}
+	if (block->count == block->size) {
+		int size = block->size != 0 ? block->size * 2 : OUTPUT_BATCH_IOV;
+		struct iovec *iov = realloc(block->iov, size * sizeof (struct iovec));
+
+		if (iov == NULL) {
+			b->lost_messages++;
+			free(text);
+			return;
+		}
+		block->iov = iov;
+		block->size = size;
+	}
+
+	output_batch_touch(b);
+	block->iov[block->count].iov_base = text;
+	block->iov[block->count].iov_len = length;
+	block->count++;
+
+	block->pending += length;
+	block->messages++;
+	if (block->pending >= OUTPUT_BATCH_SIZE) {
+		output_batch_submit(b);
+	}
+}
+
+/* When the pending messages are due on CLOCK_MONOTONIC. False if there are */
+/* none. */
+static bool output_batch_deadline(const struct output_batch *b, struct timespec *deadline) {
+	if (b->current == NULL || b->current->pending == 0) {
+		return false;
+	}
+	*deadline = b->since;
+	timespec_add_ms(deadline, OUTPUT_BATCH_DELAY);
+	return true;
+}
+
+static void print_output_stats(struct output_batch *b) {
+	pthread_mutex_lock(&b->lock);
+	fprintf(logfile, "STATS: Output: %lu messages, %llu bytes in %lu writes (%.1f messages per write).\n",
+		b->messages, b->bytes, b->writes,
+		b->writes == 0 ? 0.0 : (double)b->messages / b->writes);
+	fprintf(logfile, "STATS: Output queue: %zu bytes (peak %zu), writing took %.3f s (max %.3f s), capture waited %lu times (%.3f s).\n",
+		b->queued_bytes, b->queued_peak, b->write_time, b->write_max,
+		b->stalls, b->stall_time);
+	if (b->lost_messages > 0) {
+		fprintf(logfile, "STATS: Output: %llu bytes of %lu messages lost to errors.\n",
+			b->lost_bytes, b->lost_messages);
+	}
+	pthread_mutex_unlock(&b->lock);
+}
 
-/* D-Bus Messages only. */
-/* WARNING: manual free. */
-/* TODO: add 'error_name' field. */
 
 /**
-   <tr>
-   <td>1344361353.210869</td>
-   <td>17:42:33</td>
-   <td>method_call</td>
-   <td>:1.68</td>
-   <td>org.freedesktop.DBus</td>
-   <td>2</td>
-   <td>-</td>
-   <td>/org/freedesktop/DBus</td>
-   <td>org.freedesktop.DBus</td>
-   <td>Addmatch</td>
-   <td>String:eavesdrop=true</td>
-   </tr>
+ * Capture pipeline
+ *
+ * With decode workers enabled (-j), the thread running the event loop only
+ * timestamps the messages it pops and pushes them, with their sequence number,
+ * into a bounded lock-free ring. Workers take messages from the ring and format
+ * them with message_emit(). A single output thread puts the results back in
+ * arrival order: each worker stores its result in the reorder window at the
+ * slot of its sequence number, and the output thread queues the messages for
+ * output as soon as the next expected one is ready.
+ *
+ * The ring is the multi-producer multi-consumer bounded queue by Dmitry Vyukov:
+ * every cell carries a sequence counter telling whether it is ready to be
+ * written or read for a given lap. Sleeping workers wait on a semaphore that
+ * counts the queued messages.
+ *
+ * The window bounds the number of messages in flight, i.e. pushed but not
+ * written yet. When it is full, the capture thread waits and the kernel socket
+ * buffer absorbs the burst.
  */
-#define MEM_CHUNK 32768
-#define HTML_EMPTY_FIELD "-"
-#define HTML_DATA_LIMIT 255
-char *message_to_html(JsonNode *message) {
-	char *result = NULL;
-	size_t result_size = 0;
-	size_t result_size_real = 0;
-
-	JsonNode *node = message;
-
-	char *html_row_begin = "\n<tr>";
-	size_t html_row_begin_len = strlen(html_row_begin);
-	char *html_row_end = "</tr>\n";
-	size_t html_row_end_len = strlen(html_row_end);
-	char *html_column_begin = "<td>";
-	size_t html_column_begin_len = strlen(html_column_begin);
-	char *html_column_end = "</td>\n";
-	size_t html_column_end_len = strlen(html_column_end);
-
-	while (node != NULL && node->tag == JSON_ARRAY) {
-		node = json_first_child(node);
-	}
-
-	while (node != NULL) {
-		/* Get machine time. */
-		char *sec = json_stringify(json_find_member(node, DBUS_JSON_SEC), JSON_FORMAT_NONE);
-		char *usec = json_stringify(json_find_member(node, DBUS_JSON_USEC), JSON_FORMAT_NONE);
-
-		/* The '+1' is for the separator. */
-		char *mtime = malloc((strlen(sec) + strlen(usec) + 1 + 1) * sizeof (char));
-		strcpy(mtime, sec);
-		strcat(mtime, ".");
-		strcat(mtime, usec);
-
-		/* Get Human time. */
-		JsonNode *htime_node = json_find_member(node, DBUS_JSON_TIME_HUMAN);
-
-		/* Get time in 2-digits format. */
-		/* TODO: stupid code. */
-		char hour[3];
-		long hour_val = (long)json_find_member(htime_node, DBUS_JSON_HOUR)->number_;
-		hour[0] = '0' + hour_val / 10;
-		hour[1] = '0' + hour_val % 10;
-		hour[2] = '\0';
-		char minute[3];
-		long minute_val = (long)json_find_member(htime_node, DBUS_JSON_MINUTE)->number_;
-		minute[0] = '0' + (minute_val / 10);
-		minute[1] = '0' + (minute_val % 10);
-		minute[2] = '\0';
-		char second[3];
-		long second_val = (long)json_find_member(htime_node, DBUS_JSON_SECOND)->number_;
-		second[0] = '0' + second_val / 10;
-		second[1] = '0' + second_val % 10;
-		second[2] = '\0';
-
-		/* The '+2' is for the separator. */
-		char *htime = malloc((strlen(hour) + strlen(minute) + strlen(second) + 2 + 1) * sizeof (char));
-		strcpy(htime, hour);
-		strcat(htime, ":");
-		strcat(htime, minute);
-		strcat(htime, ":");
-		strcat(htime, second);
-
-
-		/* Note that strings returned from string_ should not be freed. */
-
-		char *type = json_find_member(node, DBUS_JSON_TYPE)->string_;
-		char *sender = json_find_member(node, DBUS_JSON_SENDER)->string_;
-		char *destination = json_find_member(node, DBUS_JSON_DESTINATION)->string_;
-
-		/* Strings returned from stringify should be freed. */
-		JsonNode *temp;
-
-		char *serial = NULL;
-		temp = json_find_member(node, DBUS_JSON_SERIAL);
-		if (temp != NULL) {
-			serial = json_stringify(temp, JSON_FORMAT_NONE);
+#define PIPELINE_SIZE 4096
+#define PIPELINE_MAX_WORKERS 64
+
+struct pipeline_item {
+	uint64_t seq;
+	DBusMessage *message;
+	struct timespec timestamp;
+	unsigned int bus;
+	unsigned long weight;
+	char *text;
+	size_t length;
+};
+
+struct ring_cell {
+	atomic_size_t sequence;
+	struct pipeline_item *item;
+};
+
+struct pipeline {
+	int opt;
+
+	/* Ring between the capture thread and the workers. */
+	struct ring_cell ring[PIPELINE_SIZE];
+	atomic_size_t enqueue_pos;
+	atomic_size_t dequeue_pos;
+	sem_t queued;
+
+	/* Reorder window between the workers and the output thread. */
+	struct pipeline_item *window[PIPELINE_SIZE];
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	pthread_cond_t space;
+
+	/* Sequence numbers. 'pushed' is only written by the capture thread and */
+	/* 'written' by the output thread. */
+	atomic_uint_least64_t pushed;
+	atomic_uint_least64_t written;
+	bool finished;
+
+	/* Gauges. */
+	atomic_size_t ring_peak;
+	atomic_ulong stalls;
+	/* Messages which could not be queued, out of memory. */
+	atomic_ulong dropped;
+
+	pthread_t workers[PIPELINE_MAX_WORKERS];
+	unsigned int worker_count;
+	pthread_t writer;
+};
+
+/* Number of decode workers. 0 means everything is done by the capture thread. */
+static unsigned int option_workers = 0;
+
+/* Non-NULL while a pipeline is running. */
+static struct pipeline *pipeline = NULL;
+
+static void ring_init(struct pipeline *p) {
+	size_t i;
+
+	for (i = 0; i < PIPELINE_SIZE; i++) {
+		atomic_init(&p->ring[i].sequence, i);
+		p->ring[i].item = NULL;
+	}
+	atomic_init(&p->enqueue_pos, 0);
+	atomic_init(&p->dequeue_pos, 0);
+}
+
+static bool ring_push(struct pipeline *p, struct pipeline_item *item) {
+	size_t pos = atomic_load_explicit(&p->enqueue_pos, memory_order_relaxed);
+
+	for (;;) {
+		struct ring_cell *cell = &p->ring[pos & (PIPELINE_SIZE - 1)];
+		size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&p->enqueue_pos, &pos, pos + 1,
+					memory_order_relaxed, memory_order_relaxed)) {
+				cell->item = item;
+				atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+				return true;
+			}
+		} else if (diff < 0) {
+			/* Full. */
+			return false;
 		} else {
-			serial = HTML_EMPTY_FIELD;
+			pos = atomic_load_explicit(&p->enqueue_pos, memory_order_relaxed);
 		}
+	}
+}
+
+static struct pipeline_item *ring_pop(struct pipeline *p) {
+	size_t pos = atomic_load_explicit(&p->dequeue_pos, memory_order_relaxed);
 
-		char *reply_serial = NULL;
-		temp = json_find_member(node, DBUS_JSON_REPLY_SERIAL);
-		if (temp != NULL) {
-			reply_serial = json_stringify(temp, JSON_FORMAT_NONE);
+	for (;;) {
+		struct ring_cell *cell = &p->ring[pos & (PIPELINE_SIZE - 1)];
+		size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&p->dequeue_pos, &pos, pos + 1,
+					memory_order_relaxed, memory_order_relaxed)) {
+				struct pipeline_item *item = cell->item;
+				atomic_store_explicit(&cell->sequence, pos + PIPELINE_SIZE, memory_order_release);
+				return item;
+			}
+		} else if (diff < 0) {
+			/* Empty. */
+			return NULL;
 		} else {
-			reply_serial = HTML_EMPTY_FIELD;
+			pos = atomic_load_explicit(&p->dequeue_pos, memory_order_relaxed);
 		}
+	}
+}
 
-		char *path = NULL;
-		temp = json_find_member(node, DBUS_JSON_PATH);
-		if (temp != NULL) {
-			path = temp->string_;
-		} else {
-			path = HTML_EMPTY_FIELD;
+/* Number of messages waiting for a worker. */
+static size_t ring_depth(struct pipeline *p) {
+	size_t head = atomic_load_explicit(&p->enqueue_pos, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&p->dequeue_pos, memory_order_relaxed);
+	return head >= tail ? head - tail : 0;
+}
+
+static void *pipeline_worker(void *data) {
+	struct pipeline *p = data;
+	JsonWriter *writer = json_writer_new(output_space());
+
+	for (;;) {
+		struct pipeline_item *item;
+		const char *text;
+		size_t length;
+
+		while (sem_wait(&p->queued) == -1 && errno == EINTR) {
 		}
 
-		char *interface = NULL;
-		temp = json_find_member(node, DBUS_JSON_INTERFACE);
-		if (temp != NULL) {
-			interface = temp->string_;
-		} else {
-			interface = HTML_EMPTY_FIELD;
+		/* The semaphore guarantees that an item has been published. */
+		while ((item = ring_pop(p)) == NULL) {
+		}
+
+		/* Poison pill. */
+		if (item->message == NULL) {
+			free(item);
+			break;
 		}
 
-		char *member = NULL;
-		temp = json_find_member(node, DBUS_JSON_MEMBER);
-		if (temp != NULL) {
-			member = temp->string_;
+		message_emit_line(writer, item->message, &item->timestamp, item->bus, item->weight);
+		text = json_writer_data(writer, &length);
+		/* The output thread skips the message if there is no text. */
+		item->text = malloc(length);
+		if (item->text != NULL) {
+			memcpy(item->text, text, length);
 		} else {
-			member = HTML_EMPTY_FIELD;
-		}
-
-		/* TODO: args. */
-		/* Separator: ', ' */
-		char *args = NULL;
-		size_t args_len = 1;
-		args = malloc(1);
-		args[0] = '\0';
-		temp = json_find_member(node, DBUS_JSON_ARGS);
-		if (temp != NULL) {
-			JsonNode *arg_iter = json_first_child(temp);
-			JsonNode *arg_iter_element;
-			json_foreach(arg_iter, temp) {
-				/* '+1' for the separator. */
-				arg_iter_element = json_find_member(arg_iter, DBUS_JSON_ARG_TYPE);
-				args_len += strlen(arg_iter_element->string_) + 1;
-				args = realloc(args, args_len * sizeof (char));
-				strcat(args, arg_iter_element->string_);
-
-				strcat(args, "=");
-
-				arg_iter_element = json_find_member(arg_iter, DBUS_JSON_ARG_VALUE);
-				char *temp_str = json_stringify(arg_iter_element, JSON_FORMAT_NONE);
-				size_t temp_str_len = strlen(temp_str);
-				if (temp_str_len > HTML_DATA_LIMIT) {
-					char *buf = malloc((HTML_DATA_LIMIT + 1) * sizeof (char));
-					strncpy(buf, temp_str, HTML_DATA_LIMIT - 3);
-					strcpy(buf + 252, "...");
-					free(temp_str);
-					temp_str = buf;
+			atomic_fetch_add(&p->dropped, 1);
+		}
+		item->length = length;
+		json_writer_reset(writer);
+		dbus_message_unref(item->message);
+		item->message = NULL;
+
+		pthread_mutex_lock(&p->lock);
+		p->window[item->seq & (PIPELINE_SIZE - 1)] = item;
+		if (item->seq == atomic_load(&p->written)) {
+			pthread_cond_signal(&p->ready);
+		}
+		pthread_mutex_unlock(&p->lock);
+	}
 
-				}
+	json_writer_free(writer);
+	return NULL;
+}
+
+static void *pipeline_writer(void *data) {
+	struct pipeline *p = data;
+	struct pipeline_item *batch[PIPELINE_SIZE];
 
-				args_len += temp_str_len + 1;
-				args = realloc(args, args_len * sizeof (char));
-				strcat(args, temp_str);
-				free(temp_str);
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		uint64_t next = atomic_load(&p->written);
+		size_t count = 0;
+		size_t i;
 
-				strcat(args, " ");
+		while (p->window[next & (PIPELINE_SIZE - 1)] == NULL) {
+			struct timespec deadline;
+
+			if (p->finished && next == atomic_load(&p->pushed)) {
+				pthread_mutex_unlock(&p->lock);
+				output_batch_submit(&output_batch);
+				return NULL;
 			}
-		} else {
-			args = HTML_EMPTY_FIELD;
+			if (!output_batch_deadline(&output_batch, &deadline)) {
+				pthread_cond_wait(&p->ready, &p->lock);
+			} else if (pthread_cond_timedwait(&p->ready, &p->lock, &deadline) == ETIMEDOUT) {
+				pthread_mutex_unlock(&p->lock);
+				output_batch_submit(&output_batch);
+				pthread_mutex_lock(&p->lock);
+			}
+		}
+
+		/* Take every consecutive result that is ready. */
+		while (count < PIPELINE_SIZE && p->window[(next + count) & (PIPELINE_SIZE - 1)] != NULL) {
+			batch[count] = p->window[(next + count) & (PIPELINE_SIZE - 1)];
+			p->window[(next + count) & (PIPELINE_SIZE - 1)] = NULL;
+			count++;
+		}
+		pthread_mutex_unlock(&p->lock);
+
+		for (i = 0; i < count; i++) {
+			struct pipeline_item *item = batch[i];
+
+			if (item->text != NULL) {
+				output_batch_take(&output_batch, item->text, item->length);
+			}
+			free(item);
+		}
+
+		pthread_mutex_lock(&p->lock);
+		atomic_store(&p->written, next + count);
+		pthread_cond_signal(&p->space);
+	}
+}
+
+static struct pipeline *pipeline_start(unsigned int worker_count, int opt) {
+	struct pipeline *p = calloc(1, sizeof (struct pipeline));
+	pthread_condattr_t attr;
+	unsigned int i;
+
+	if (p == NULL) {
+		return NULL;
+	}
+
+	p->opt = opt;
+	ring_init(p);
+	sem_init(&p->queued, 0, 0);
+	pthread_mutex_init(&p->lock, NULL);
+	/* The output thread waits for the output deadline on this clock. */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&p->ready, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_cond_init(&p->space, NULL);
+	atomic_init(&p->pushed, 0);
+	atomic_init(&p->written, 0);
+	atomic_init(&p->ring_peak, 0);
+	atomic_init(&p->stalls, 0);
+	atomic_init(&p->dropped, 0);
+
+	if (worker_count > PIPELINE_MAX_WORKERS) {
+		worker_count = PIPELINE_MAX_WORKERS;
+	}
+
+	/* The threads inherit the signal mask of the capture thread, so that */
+	/* signals keep going to the signalfd. */
+	if (pthread_create(&p->writer, NULL, pipeline_writer, p) != 0) {
+		fprintf(logfile, "ERROR: Could not start output thread.\n");
+		free(p);
+		return NULL;
+	}
+	for (i = 0; i < worker_count; i++) {
+		if (pthread_create(&p->workers[i], NULL, pipeline_worker, p) != 0) {
+			fprintf(logfile, "WARNING: Could only start %u decode workers.\n", i);
+			break;
+		}
+	}
+	p->worker_count = i;
+
+	return p;
+}
+
+/* Hand a message over to the workers. The pipeline steals the reference. */
+static void pipeline_push(struct pipeline *p, DBusMessage *message, const struct timespec *timestamp, unsigned int bus,
+		unsigned long weight) {
+	struct pipeline_item *item = malloc(sizeof (struct pipeline_item));
+	uint64_t seq = atomic_load_explicit(&p->pushed, memory_order_relaxed);
+	size_t depth;
+
+	if (item == NULL) {
+		dbus_message_unref(message);
+		atomic_fetch_add(&p->dropped, 1);
+		return;
+	}
+
+	item->seq = seq;
+	item->message = message;
+	item->bus = bus;
+	item->weight = weight;
+	item->text = NULL;
+	if (timestamp != NULL) {
+		item->timestamp = *timestamp;
+	} else {
+		timestamp_now(&item->timestamp);
+	}
+
+	/* Wait for room in the reorder window. This also guarantees room in the */
+	/* ring. */
+	if (seq - atomic_load(&p->written) >= PIPELINE_SIZE) {
+		atomic_fetch_add(&p->stalls, 1);
+		pthread_mutex_lock(&p->lock);
+		while (seq - atomic_load(&p->written) >= PIPELINE_SIZE) {
+			pthread_cond_wait(&p->space, &p->lock);
+		}
+		pthread_mutex_unlock(&p->lock);
+	}
+
+	while (!ring_push(p, item)) {
+		sched_yield();
+	}
+	atomic_store(&p->pushed, seq + 1);
+	sem_post(&p->queued);
+
+	depth = ring_depth(p);
+	if (depth > atomic_load_explicit(&p->ring_peak, memory_order_relaxed)) {
+		atomic_store_explicit(&p->ring_peak, depth, memory_order_relaxed);
+	}
+}
+
+/* Flush every pending message and join the threads. */
+static void pipeline_stop(struct pipeline *p) {
+	unsigned int i;
+
+	for (i = 0; i < p->worker_count; i++) {
+		struct pipeline_item *pill = calloc(1, sizeof (struct pipeline_item));
+		while (!ring_push(p, pill)) {
+			sched_yield();
+		}
+		sem_post(&p->queued);
+	}
+	for (i = 0; i < p->worker_count; i++) {
+		pthread_join(p->workers[i], NULL);
+	}
+
+	pthread_mutex_lock(&p->lock);
+	p->finished = true;
+	pthread_cond_signal(&p->ready);
+	pthread_mutex_unlock(&p->lock);
+	pthread_join(p->writer, NULL);
+
+	sem_destroy(&p->queued);
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->ready);
+	pthread_cond_destroy(&p->space);
+	free(p);
+}
+
+static void print_pipeline_stats(struct pipeline *p) {
+	uint64_t pushed = atomic_load(&p->pushed);
+	uint64_t written = atomic_load(&p->written);
+
+	fprintf(logfile, "STATS: Pipeline: %u workers, ring depth %zu/%d (peak %zu), %llu in flight, %lu stalls.\n",
+		p->worker_count, ring_depth(p), PIPELINE_SIZE,
+		(size_t)atomic_load(&p->ring_peak),
+		(unsigned long long)(pushed - written),
+		(unsigned long)atomic_load(&p->stalls));
+	if (atomic_load(&p->dropped) > 0) {
+		fprintf(logfile, "STATS: Pipeline: %lu messages dropped, out of memory.\n",
+			(unsigned long)atomic_load(&p->dropped));
+	}
+}
+
+
+static void capture_message(DBusMessage *message, const struct timespec *timestamp, unsigned int bus, int opt) {
+	unsigned long weight = 1;
+
+	if (message_filter != NULL && !message_filter->on_bus && !filter_match(message_filter, message, bus)) {
+		return;
+	}
+	if (sampler != NULL && (weight = sample(sampler, message, timestamp)) == 0) {
+		return;
+	}
+
+	/* Recording to a pcap file or a capture log needs no decoding at all. */
+	if (pcap_output != NULL) {
+		pcap_write_message(pcap_output, message, timestamp);
+		return;
+	}
+	if (capture_log != NULL) {
+		capture_log_write(capture_log, message, timestamp);
+		return;
+	}
+
+	/* Only the daemon reads the store back. */
+	if (opt == LIVE_OUTPUT_OFF) {
+		store_append(&message_store, message, timestamp, bus, weight);
+		return;
+	}
+
+	if (pipeline != NULL) {
+		pipeline_push(pipeline, dbus_message_ref(message), timestamp, bus, weight);
+		return;
+	}
+
+	output_batch_emit(&output_batch, message, timestamp, bus, weight);
+}
+
+/* Pop every complete message queued on the connection to 'bus'. With -t */
+/* batch, they all get 'wakeup', the time the event loop woke up. */
+static unsigned long drain_messages(struct spy_bus *bus, const struct timespec *wakeup, int opt) {
+	DBusMessage *message;
+	unsigned long count = 0;
+	struct timespec timestamp;
+
+	if (option_clock == TIMESTAMP_BATCH) {
+		timestamp = *wakeup;
+	}
+
+	while ((message = dbus_connection_pop_message(bus->connection)) != NULL) {
+
+		/* The bus tells us that we acquired our unique name, then that we */
+		/* lost it when becoming a monitor. This is about us, not about the */
+		/* monitored traffic. */
+		if (bus->monitor_unique_name != NULL &&
+			(dbus_message_is_signal(message, DBUS_INTERFACE_DBUS, "NameAcquired") ||
+				dbus_message_is_signal(message, DBUS_INTERFACE_DBUS, "NameLost")) &&
+			dbus_message_get_destination(message) != NULL &&
+			strcmp(dbus_message_get_destination(message), bus->monitor_unique_name) == 0) {
+			dbus_message_unref(message);
+			continue;
 		}
 
+		if (option_clock != TIMESTAMP_BATCH) {
+			timestamp_now(&timestamp);
+		}
+		capture_message(message, &timestamp, bus->index, opt);
+		dbus_message_unref(message);
+		count++;
+	}
+
+	capture_stats.messages += count;
+	return count;
+}
+
+static void report_stats() {
+	print_capture_stats();
+	if (pipeline != NULL) {
+		print_pipeline_stats(pipeline);
+	}
+	if (message_store.count > 0) {
+		print_store_stats(&message_store);
+	}
+	if (pcap_output != NULL) {
+		print_pcap_stats(pcap_output);
+	}
+	if (capture_log != NULL) {
+		print_capture_log_stats(capture_log);
+	}
+	if (message_filter != NULL) {
+		print_filter_stats(message_filter);
+	}
+	if (sampler != NULL) {
+		print_sampler_stats(sampler);
+	}
+	print_decode_stats();
+	if (output_batch.current != NULL || output_batch.messages > 0 || output_batch.lost_messages > 0) {
+		print_output_stats(&output_batch);
+	}
+	if (plan_cache.count > 0) {
+		print_plan_stats(&plan_cache);
+	}
+	/* Only the message store interns strings, the sampler has its own. */
+	if (intern_table.count > 0) {
+		print_intern_stats(&intern_table);
+	}
+	fflush(logfile);
+}
+
+/* Reset the message storage and start the decode workers, if any. */
+static void capture_begin(int opt) {
+	if (scratch_arena == NULL) {
+		scratch_arena = json_arena_new(0);
+	}
+
+	store_clear(&message_store);
+	memset(&capture_stats, 0, sizeof capture_stats);
+
+	/* Live output bypasses stdio from now on. */
+	if (opt == LIVE_OUTPUT_ON && pcap_output == NULL && capture_log == NULL) {
+		fflush(output);
+		output_batch_start(&output_batch, fileno(output));
+	}
 
-		/* Note: do not forget +1 for the null terminating byte. */
-		result_size += html_row_begin_len + html_row_end_len + 1;
+	/* The workers format the live output. Profile lines cost less than */
+	/* handing the messages over. */
+	if (option_workers > 0 && pcap_output == NULL && capture_log == NULL && opt == LIVE_OUTPUT_ON &&
+		option_output_format != FORMAT_PROFILE) {
+		pipeline = pipeline_start(option_workers, opt);
+		if (pipeline == NULL) {
+			fprintf(logfile, "WARNING: Decoding in the capture thread.\n");
+		}
+	}
+}
 
-		result_size += html_column_begin_len + html_column_end_len + strlen(mtime);
-		result_size += html_column_begin_len + html_column_end_len + strlen(htime);
-		result_size += html_column_begin_len + html_column_end_len + strlen(type);
-		result_size += html_column_begin_len + html_column_end_len + strlen(sender);
-		result_size += html_column_begin_len + html_column_end_len + strlen(destination);
+/* Wait for the decode workers to finish and write the pending output. */
+static void capture_end() {
+	if (pipeline != NULL) {
+		print_pipeline_stats(pipeline);
+		pipeline_stop(pipeline);
+		pipeline = NULL;
+	}
+	output_batch_stop(&output_batch);
+}
 
-		result_size += html_column_begin_len + html_column_end_len + strlen(serial);
-		result_size += html_column_begin_len + html_column_end_len + strlen(reply_serial);
-		result_size += html_column_begin_len + html_column_end_len + strlen(path);
-		result_size += html_column_begin_len + html_column_end_len + strlen(interface);
-		result_size += html_column_begin_len + html_column_end_len + strlen(member);
+static void print_filter_help() {
+	fprintf(logfile, "==> Filter syntax is as defined by D-Bus specification. Void filter will catch all messages.\n==> Example:\n");
+	fprintf(logfile, "==>    \"type='signal',sender='org.gnome.TypingMonitor',interface='org.gnome.TypingMonitor'\"\n");
+}
 
-		result_size += html_column_begin_len + html_column_end_len + strlen(args);
+/* Return true if the user takes control of eavesdropping in 'rule', in which */
+/* case the rule only makes sense with AddMatch. */
+static bool rule_sets_eavesdrop(const char *rule) {
+	const char *key = strstr(rule, "eavesdrop");
 
-		/* TODO: why does the following not work ? */
-		/* result = realloc( result, result_size * sizeof(char)); */
-		if (result_size_real <= result_size) {
-			result_size_real += MEM_CHUNK;
-			result = realloc(result, result_size_real * sizeof (char));
+	while (key != NULL) {
+		const char *end = key + strlen("eavesdrop");
+		while (*end == ' ') {
+			end++;
 		}
-
-		if (result == NULL) {
-			perror("HTML message memory error");
+		if ((key == rule || key[-1] == ',' || key[-1] == ' ') && *end == '=') {
+			return true;
 		}
+		key = strstr(end, "eavesdrop");
+	}
+	return false;
+}
 
-		strcat(result, html_row_begin);
+/* Ask the bus to turn 'connection' into a monitor for 'filters'. An empty */
+/* list of rules means all messages. */
+static bool become_monitor(DBusConnection *connection, char **filters, DBusError *error) {
+	DBusMessage *message;
+	DBusMessage *reply;
+	DBusMessageIter args, rules;
+	dbus_uint32_t flags = 0;
+	bool match_all = false;
+	char **filter;
+
+	message = dbus_message_new_method_call(DBUS_SERVICE_DBUS, DBUS_PATH_DBUS,
+			DBUS_INTERFACE_MONITORING, "BecomeMonitor");
+	if (message == NULL) {
+		fprintf(logfile, "ERROR: Message creation error.\n");
+		return false;
+	}
 
-		strcat(result, html_column_begin);
-		strcat(result, mtime);
-		strcat(result, html_column_end);
+	/* An empty rule matches everything, so it makes the other rules moot: */
+	/* send an empty list then. */
+	for (filter = filters; *filter != NULL; filter++) {
+		if (**filter == '\0') {
+			match_all = true;
+		}
+	}
 
-		strcat(result, html_column_begin);
-		strcat(result, htime);
-		strcat(result, html_column_end);
+	dbus_message_iter_init_append(message, &args);
+	dbus_message_iter_open_container(&args, DBUS_TYPE_ARRAY, DBUS_TYPE_STRING_AS_STRING, &rules);
+	for (filter = filters; !match_all && *filter != NULL; filter++) {
+		dbus_message_iter_append_basic(&rules, DBUS_TYPE_STRING, filter);
+	}
+	dbus_message_iter_close_container(&args, &rules);
+	dbus_message_iter_append_basic(&args, DBUS_TYPE_UINT32, &flags);
 
-		strcat(result, html_column_begin);
-		strcat(result, type);
-		strcat(result, html_column_end);
+	reply = dbus_connection_send_with_reply_and_block(connection, message, -1, error);
+	dbus_message_unref(message);
 
-		strcat(result, html_column_begin);
-		strcat(result, sender);
-		strcat(result, html_column_end);
+	if (reply == NULL) {
+		return false;
+	}
+	dbus_message_unref(reply);
+	return true;
+}
 
-		strcat(result, html_column_begin);
-		strcat(result, destination);
-		strcat(result, html_column_end);
+/* Legacy path: one eavesdropping AddMatch per filter. */
+static bool add_eavesdrop_matches(DBusConnection *connection, char **filters, DBusError *error) {
+	char *empty[] = { "", NULL };
+	char **filter;
 
-		strcat(result, html_column_begin);
-		strcat(result, serial);
-		strcat(result, html_column_end);
+	if (*filters == NULL) {
+		filters = empty;
+	}
 
-		strcat(result, html_column_begin);
-		strcat(result, reply_serial);
-		strcat(result, html_column_end);
+	for (filter = filters; *filter != NULL; filter++) {
+		/* Note: eavesdropping role is being prepended so that is can be turned */
+		/* off by user in the filter. */
+		size_t filterlength = strlen(EAVES) + 1 + strlen(*filter) + 1;
+		char *eavesfilter = malloc(filterlength * sizeof (char));
+		snprintf(eavesfilter, filterlength, "%s,%s", EAVES, *filter);
+
+		dbus_bus_add_match(connection, eavesfilter, error);
+		if (dbus_error_is_set(error)) {
+			free(eavesfilter);
+			return false;
+		}
 
-		strcat(result, html_column_begin);
-		strcat(result, path);
-		strcat(result, html_column_end);
+		fprintf(logfile, "NOTE: Filter in use is %s\n", eavesfilter);
+		free(eavesfilter);
+	}
 
-		strcat(result, html_column_begin);
-		strcat(result, interface);
-		strcat(result, html_column_end);
+	return true;
+}
 
-		strcat(result, html_column_begin);
-		strcat(result, member);
-		strcat(result, html_column_end);
+/* Set up message capture on 'bus'. Returns false if filters are invalid, or */
+/* on error. */
+static bool spy_setup(struct spy_bus *bus, char **filters) {
+	DBusConnection *connection = bus->connection;
+	DBusError error;
+	bool use_monitor = true;
+	char **filter;
 
-		fprintf(logfile, "[%s]\n", args);
+	dbus_error_init(&error);
 
-		strcat(result, html_column_begin);
-		strcat(result, args);
-		strcat(result, html_column_end);
+	for (filter = filters; *filter != NULL; filter++) {
+		if (rule_sets_eavesdrop(*filter)) {
+			use_monitor = false;
+		}
+	}
 
-		strcat(result, html_row_end);
+	if (use_monitor) {
+		/* The unique name is lost once we are a monitor. */
+		const char *unique_name = dbus_bus_get_unique_name(connection);
+		if (unique_name == NULL) {
+			fprintf(logfile, "ERROR: No unique name on %s bus.\n", bus_name(bus->index));
+			return false;
+		}
+		bus->monitor_unique_name = strdup(unique_name);
+		if (bus->monitor_unique_name == NULL) {
+			fprintf(logfile, "ERROR: Out Of Memory!\n");
+			return false;
+		}
 
-		/* TEST: */
-		/* fprintf (stderr, "%s\n", result); */
+		if (become_monitor(connection, filters, &error)) {
+			fprintf(logfile, "NOTE: Capturing %s bus as monitor.\n", bus_name(bus->index));
+			for (filter = filters; *filter != NULL; filter++) {
+				fprintf(logfile, "NOTE: Filter in use is %s\n", *filter);
+			}
+			return true;
+		}
 
-		/* TODO: Clean properly. */
-		free(mtime);
-		free(sec);
-		free(usec);
+		free(bus->monitor_unique_name);
+		bus->monitor_unique_name = NULL;
 
-		free(htime);
+		if (dbus_error_has_name(&error, DBUS_ERROR_MATCH_RULE_INVALID)) {
+			fprintf(logfile, "ERROR: Bad filter (%s).\n", error.message);
+			print_filter_help();
+			dbus_error_free(&error);
+			return false;
+		}
 
-		node = node->next;
+		fprintf(logfile, "NOTE: BecomeMonitor refused on %s bus (%s), falling back to eavesdropping.\n",
+			bus_name(bus->index), error.message);
+		dbus_error_free(&error);
 	}
 
-	return result;
+	if (!add_eavesdrop_matches(connection, filters, &error)) {
+		fprintf(logfile, "ERROR: Bad filter (%s).\n", error.message);
+		print_filter_help();
+		dbus_error_free(&error);
+		return false;
+	}
+
+	return true;
 }
 
+/* Close the connections of 'buses' opened by spy(). */
+static void spy_close_buses(struct spy_bus *buses, unsigned int count) {
+	unsigned int i;
 
+	for (i = 0; i < count; i++) {
+		dbus_connection_set_watch_functions(buses[i].connection, NULL, NULL, NULL, NULL, NULL);
+		dbus_connection_set_timeout_functions(buses[i].connection, NULL, NULL, NULL, NULL, NULL);
+		free(buses[i].monitor_unique_name);
+		dbus_connection_close(buses[i].connection);
+		dbus_connection_unref(buses[i].connection);
+	}
+}
 
-/**
- * Eavesdrop messages and store them internally. Parameter is a user-defined
- * filter.
- */
+/* Take 'bus' out of the event loop once its connection is lost, so that the */
+/* other buses are still captured. */
+static void spy_drop_bus(struct spy_bus *bus) {
+	dbus_connection_set_watch_functions(bus->connection, NULL, NULL, NULL, NULL, NULL);
+	dbus_connection_set_timeout_functions(bus->connection, NULL, NULL, NULL, NULL, NULL);
+	bus->fd = -1;
+	bus->lost = true;
+}
 
-#define EAVES "eavesdrop=true"
-#define LIVE_OUTPUT_OFF 0
-#define LIVE_OUTPUT_ON 1
+/* Bus whose socket is 'fd', or NULL. */
+static struct spy_bus *spy_find_bus(struct spy_bus *buses, unsigned int count, int fd) {
+	unsigned int i;
 
-void spy(char *filter, int opt) {
-	DBusConnection *connection;
+	for (i = 0; i < count; i++) {
+		if (buses[i].fd == fd) {
+			return &buses[i];
+		}
+	}
+	return NULL;
+}
+
+void spy(char **filters, int opt) {
+	struct spy_bus buses[MAX_BUSES];
+	unsigned int bus_count = option_bus_count > 0 ? option_bus_count : 1;
+	unsigned int b;
 	DBusError error;
 
-	DBusMessage *message = NULL;
+	struct event_loop loop;
+	struct epoll_event events[LOOP_MAX_EVENTS];
+	sigset_t sigmask, old_sigmask;
+	bool done = false;
+	unsigned int live = bus_count;
+	struct timespec wakeup;
+
+	char *no_filters[] = { NULL };
+	if (filters == NULL) {
+		filters = no_filters;
+	}
 
-	if (filter == NULL) {
-		filter = "";
+	/* Let the bus apply as much of the local filter as it can. */
+	if (message_filter != NULL) {
+		filters = filter_bus_rules(message_filter, filters);
 	}
 
 	/**
@@ -1401,93 +6776,381 @@ void spy(char *filter, int opt) {
 	 * -method_return
 	 * -error
 	 */
-	/* Note: eavesdropping role is being prepended so that is can be turned off */
-	/* by user in the filter. */
-	size_t filterlength = strlen(EAVES) + 1 + strlen(filter) + 1;
-	char *eavesfilter = malloc(filterlength * sizeof (char));
-	snprintf(eavesfilter, filterlength, "%s,%s", EAVES, filter);
 
 	/* Init */
 	dbus_error_init(&error);
 
-	connection = dbus_bus_get(DBUS_BUS_SESSION, &error);
-	if (dbus_error_is_set(&error)) {
-		fprintf(logfile, "ERROR: Connection Error (%s)", error.message);
-		dbus_error_free(&error);
+	/* One private connection per bus, since a monitor cannot be reused. */
+	for (b = 0; b < bus_count; b++) {
+		struct spy_bus *bus = &buses[b];
+
+		bus->index = b;
+		bus->monitor_unique_name = NULL;
+		bus->lost = false;
+		bus->connection = bus_open(bus_name(b), true, &error);
+		if (bus->connection == NULL) {
+			fprintf(logfile, "ERROR: Connection Error on %s bus (%s).\n", bus_name(b),
+				dbus_error_is_set(&error) ? error.message : "unknown error");
+			dbus_error_free(&error);
+			spy_close_buses(buses, b);
+			return;
+		}
+		dbus_connection_set_exit_on_disconnect(bus->connection, FALSE);
+		if (!dbus_connection_get_unix_fd(bus->connection, &bus->fd)) {
+			bus->fd = -1;
+		}
+
+		if (!spy_setup(bus, filters)) {
+			spy_close_buses(buses, b + 1);
+			return;
+		}
 	}
-	if (connection == NULL) {
-		exit(1);
+
+	/* Nothing left to check locally. When eavesdropping, the messages sent */
+	/* to us, such as NameAcquired, come whatever the match rules. */
+	if (message_filter != NULL) {
+		message_filter->on_bus = message_filter->exact;
+		for (b = 0; b < bus_count; b++) {
+			if (buses[b].monitor_unique_name == NULL && message_filter->on_bus) {
+				fprintf(logfile, "NOTE: Eavesdropping, the filter is also evaluated locally.\n");
+				message_filter->on_bus = false;
+			}
+		}
 	}
 
-	dbus_bus_add_match(connection, eavesfilter, &error);
-	/* TODO: useless here? */
-	dbus_connection_flush(connection);
+	/* SIGUSR1 is the daemon's way of stopping the recording. */
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask, SIGINT);
+	sigaddset(&sigmask, SIGTERM);
+	sigaddset(&sigmask, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &sigmask, &old_sigmask);
 
-	if (dbus_error_is_set(&error)) {
-		fprintf(logfile, "ERROR: Bad filter (%s).\n", error.message);
-		fprintf(logfile, "==> Filter syntax is as defined by D-Bus specification. Void filter will catch all messages.\n==> Example:\n");
-		fprintf(logfile, "==>    \"type='signal',sender='org.gnome.TypingMonitor',interface='org.gnome.TypingMonitor'\"\n");
-		return;
+	/* All the connections share the same event loop. */
+	if (loop_init(&loop, &sigmask) == -1) {
+		done = true;
+	}
+	for (b = 0; b < bus_count && !done; b++) {
+		if (!dbus_connection_set_watch_functions(buses[b].connection, loop_add_watch,
+				loop_remove_watch, loop_toggle_watch, &loop, NULL) ||
+			!dbus_connection_set_timeout_functions(buses[b].connection, loop_add_timeout,
+				loop_remove_timeout, loop_toggle_timeout, &loop, NULL)) {
+			done = true;
+		}
+	}
+	if (done) {
+		fprintf(logfile, "ERROR: Could not set up the event loop.\n");
 	}
 
-	fprintf(logfile, "NOTE: Filter in use is %s\n", eavesfilter);
+	capture_begin(opt);
 
-	/* World available array containing all messages. */
-	if (message_array != NULL) {
-		json_delete(message_array);
+	/* Messages may have been queued while we were waiting for AddMatch. */
+	timestamp_now(&wakeup);
+	for (b = 0; b < bus_count; b++) {
+		record_batch(drain_messages(&buses[b], &wakeup, opt));
 	}
-	message_array = json_mkarray();
 
-	/* TEST: */
-	/* int i; */
-	/* for (i = 0; i<3; i++) */
-	while (doneflag == 0) {
-		/* Next available message. The use of the "dispatch" version handles the */
-		/* queue for us. The timeout (in ms) is meant to find a balance between */
-		/* signal response and CPU load). */
-		/* dbus_connection_read_write_dispatch (connection, -1); */
-		dbus_connection_read_write_dispatch(connection, 1000);
-		message = dbus_connection_pop_message(connection);
+	while (!done) {
+		unsigned long batch = 0;
+		struct timespec deadline;
+		int timeout;
+		int i, n;
+
+		/* Wake up for pending output as well. The output thread of the */
+		/* pipeline queues its own. */
+		timeout = loop_next_timeout(&loop);
+		if (pipeline == NULL && output_batch_deadline(&output_batch, &deadline)) {
+			struct timespec now;
+			int ms;
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			ms = timespec_ms_until(&deadline, &now);
+			if (timeout == -1 || ms < timeout) {
+				timeout = ms;
+			}
+		}
+		/* And for the capture log segment, to flush or close it. */
+		if (capture_log != NULL && capture_log_deadline(capture_log, &deadline)) {
+			struct timespec now;
+			int ms;
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			ms = timespec_ms_until(&deadline, &now);
+			if (timeout == -1 || ms < timeout) {
+				timeout = ms;
+			}
+		}
+
+		n = epoll_wait(loop.epoll_fd, events, LOOP_MAX_EVENTS, timeout);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("epoll_wait");
+			break;
+		}
+		/* One clock read per wakeup for -t batch. */
+		if (option_clock == TIMESTAMP_BATCH) {
+			timestamp_now(&wakeup);
+		}
+
+		for (i = 0; i < n; i++) {
+			int fd = events[i].data.fd;
+
+			if (fd == loop.signal_fd) {
+				struct signalfd_siginfo info;
+				while (read(loop.signal_fd, &info, sizeof info) == sizeof info) {
+					fprintf(logfile, "NOTE: Caught signal %u, closing...\n", info.ssi_signo);
+					done = true;
+				}
+			} else if (fd == loop.timer_fd) {
+				uint64_t expirations;
+				if (read(loop.timer_fd, &expirations, sizeof expirations) == sizeof expirations) {
+					report_stats();
+				}
+			} else if (loop_handle_fd(&loop, fd, events[i].events)) {
+				struct spy_bus *bus = spy_find_bus(buses, bus_count, fd);
+				int round;
+				unsigned long popped;
 
-		if (message != NULL) {
-			JsonNode *message_node = message_mangler(message);
-			json_append_element(message_array, message_node);
+				if (bus == NULL) {
+					continue;
+				}
 
-			if (opt == LIVE_OUTPUT_ON) {
-				json_print(message_node);
+				/* Keep reading while the socket delivers new messages, up */
+				/* to a fixed budget so that timeouts and signals are not */
+				/* starved. */
+				popped = drain_messages(bus, &wakeup, opt);
+				batch += popped;
+				for (round = 1; round < LOOP_READ_ROUNDS && popped > 0; round++) {
+					loop_handle_fd(&loop, fd, EPOLLIN);
+					popped = drain_messages(bus, &wakeup, opt);
+					batch += popped;
+				}
 			}
+		}
 
-			dbus_message_unref(message);
+		loop_handle_timeouts(&loop);
+		for (b = 0; b < bus_count; b++) {
+			if (!buses[b].lost) {
+				batch += drain_messages(&buses[b], &wakeup, opt);
+			}
+		}
+		record_batch(batch);
+
+		if (pipeline == NULL && output_batch_deadline(&output_batch, &deadline)) {
+			struct timespec now;
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (timespec_ms_until(&deadline, &now) == 0) {
+				output_batch_submit(&output_batch);
+			}
+		}
+		if (capture_log != NULL) {
+			struct timespec now;
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			capture_log_tick(capture_log, &now);
+		}
+
+		/* Go on with the other buses, if any. */
+		for (b = 0; b < bus_count; b++) {
+			if (!buses[b].lost && !dbus_connection_get_is_connected(buses[b].connection)) {
+				fprintf(logfile, "ERROR: Connection to %s bus lost.\n", bus_name(b));
+				spy_drop_bus(&buses[b]);
+				live--;
+				if (live == 0) {
+					done = true;
+				}
+			}
 		}
 	}
-	doneflag = 0;
 
-	if (opt == LIVE_OUTPUT_OFF) {
-		html_message = message_to_html(message_array);
+	/* Report once the output is written. */
+	capture_end();
+	report_stats();
+
+	spy_close_buses(buses, bus_count);
+	loop_free(&loop);
+	/* Once capture is over, main() closes the PCAP file and the capture log: */
+	/* keep SIGINT and SIGTERM blocked so that another Ctrl-C does not cut */
+	/* their last write short. The daemon goes on serving, so it gets them */
+	/* back. */
+	if (opt == LIVE_OUTPUT_ON) {
+		sigaddset(&old_sigmask, SIGINT);
+		sigaddset(&old_sigmask, SIGTERM);
 	}
+	sigprocmask(SIG_SETMASK, &old_sigmask, NULL);
 
-	dbus_connection_unref(connection);
+	if (opt == LIVE_OUTPUT_OFF) {
+		html_message = store_to_html(&message_store);
+	}
 }
 
 
-static void nice_exit(int sig) {
-	(void)sig;
+/**
+ * Read messages from a pcap file, as if they were caught live. Match rules
+ * cannot be applied offline.
+ */
+static int pcap_replay(const char *path, int opt) {
+	struct stat st;
+	const unsigned char *data;
+	const unsigned char *start;
+	const unsigned char *end;
+	const unsigned char *p;
+	uint32_t magic;
+	bool swap = false;
+	bool nsec = false;
+	bool segment = false;
+	bool unclosed = false;
+	int fd;
+	int status = 0;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		perror(path);
+		return 1;
+	}
+	if (fstat(fd, &st) == -1) {
+		perror(path);
+		close(fd);
+		return 1;
+	}
+	if (st.st_size < PCAP_GLOBAL_HEADER_SIZE) {
+		fprintf(logfile, "ERROR: %s is not a PCAP file.\n", path);
+		close(fd);
+		return 1;
+	}
 
-	doneflag = 1;
-	puts("\nClosing...\n");
-}
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		perror(path);
+		return 1;
+	}
+	posix_madvise((void *)data, st.st_size, POSIX_MADV_SEQUENTIAL);
+	start = data;
+	end = data + st.st_size;
+
+	/* Capture log segment: the PCAP stream follows the header. */
+	if (st.st_size >= SEGMENT_HEADER_SIZE + PCAP_GLOBAL_HEADER_SIZE &&
+		memcmp(data, SEGMENT_MAGIC, 8) == 0) {
+		segment = true;
+		start = data + SEGMENT_HEADER_SIZE;
+		if (!(get_u32(data + 48, false) & SEGMENT_CLOSED)) {
+			unclosed = true;
+		} else if (get_u64(data + 40) <= (uint64_t)(end - start)) {
+			end = start + get_u64(data + 40);
+		}
+	}
 
-static void daemon_handler(int sig) {
-	(void)sig;
-	/* Toggle spyflag so that it does not get recalled */
-	if (spyflag == 0) {
-		spyflag = 1;
-		spy(NULL, LIVE_OUTPUT_OFF);
+	memcpy(&magic, start, sizeof magic);
+	if (magic == PCAP_MAGIC || magic == PCAP_MAGIC_NSEC) {
+		nsec = magic == PCAP_MAGIC_NSEC;
+	} else if (get_u32(start, true) == PCAP_MAGIC || get_u32(start, true) == PCAP_MAGIC_NSEC) {
+		swap = true;
+		nsec = get_u32(start, true) == PCAP_MAGIC_NSEC;
 	} else {
-		spyflag = 0;
-		doneflag = 1;
+		fprintf(logfile, "ERROR: %s is not a PCAP file.\n", path);
+		munmap((void *)data, st.st_size);
+		return 1;
+	}
+
+	if (get_u32(start + 20, swap) != PCAP_LINKTYPE_DBUS) {
+		fprintf(logfile, "ERROR: %s does not contain D-Bus messages (link type %u).\n",
+			path, get_u32(start + 20, swap));
+		munmap((void *)data, st.st_size);
+		return 1;
+	}
+
+	capture_begin(opt);
+
+	for (p = start + PCAP_GLOBAL_HEADER_SIZE; p + PCAP_RECORD_HEADER_SIZE <= end; ) {
+		struct timespec timestamp;
+		uint32_t incl_len = get_u32(p + 8, swap);
+		uint32_t orig_len = get_u32(p + 12, swap);
+		DBusMessage *message;
+		DBusError error;
+
+		/* The preallocated end of a segment which was not closed. */
+		if (segment && incl_len == 0) {
+			break;
+		}
+
+		timestamp.tv_sec = get_u32(p, swap);
+		timestamp.tv_nsec = get_u32(p + 4, swap);
+		if (!nsec) {
+			timestamp.tv_nsec *= 1000;
+		}
+		p += PCAP_RECORD_HEADER_SIZE;
+
+		if ((size_t)(end - p) < incl_len) {
+			fprintf(logfile, "WARNING: %s is truncated.\n", path);
+			break;
+		}
+		if (incl_len < orig_len) {
+			fprintf(logfile, "WARNING: Skipping message truncated by the capture (%u of %u bytes).\n",
+				incl_len, orig_len);
+			p += incl_len;
+			continue;
+		}
+
+		dbus_error_init(&error);
+		message = dbus_message_demarshal((const char *)p, incl_len, &error);
+		p += incl_len;
+		if (message == NULL && unclosed) {
+			/* The last write before a crash may have been partial. */
+			fprintf(logfile, "WARNING: %s was not closed, stopping at a partial message.\n", path);
+			dbus_error_free(&error);
+			break;
+		}
+		if (message == NULL) {
+			fprintf(logfile, "WARNING: Skipping invalid message (%s).\n", error.message);
+			dbus_error_free(&error);
+			status = 1;
+			continue;
+		}
+
+		capture_message(message, &timestamp, 0, opt);
+		dbus_message_unref(message);
+		capture_stats.messages++;
+	}
+
+	munmap((void *)data, st.st_size);
+	capture_end();
+
+	fprintf(logfile, "NOTE: Read %lu messages from %s.\n", capture_stats.messages, path);
+	if (output_batch.messages > 0 || output_batch.lost_messages > 0) {
+		print_output_stats(&output_batch);
+	}
+	if (message_store.count > 0) {
+		print_store_stats(&message_store);
 	}
+	if (pcap_output != NULL) {
+		print_pcap_stats(pcap_output);
+	}
+	if (capture_log != NULL) {
+		print_capture_log_stats(capture_log);
+	}
+	if (message_filter != NULL) {
+		print_filter_stats(message_filter);
+	}
+	if (sampler != NULL) {
+		print_sampler_stats(sampler);
+	}
+	print_decode_stats();
+	if (plan_cache.count > 0) {
+		print_plan_stats(&plan_cache);
+	}
+
+	return status;
+}
+
 
+/* Recording is started by the first SIGUSR1. spy() blocks SIGUSR1 and stops on */
+/* the next one. */
+static void daemon_handler(int sig) {
+	(void)sig;
+	spy(NULL, LIVE_OUTPUT_OFF);
 }
 
 
@@ -1539,34 +7202,80 @@ static void prepare_file(const char *path, FILE **file, const char *mode) {
 /******************************************************************************/
 /* Information */
 
+/* Parse a size with an optional k, M or G suffix. Returns 0 on error. */
+static size_t parse_size(const char *arg) {
+	char *end;
+	unsigned long long value = strtoull(arg, &end, 10);
+
+	switch (*end) {
+	case 'G':
+		value *= 1024;
+		/* Fall through. */
+	case 'M':
+		value *= 1024;
+		/* Fall through. */
+	case 'k':
+	case 'K':
+		value *= 1024;
+		end++;
+		break;
+	default:
+		break;
+	}
+
+	if (end == arg || *end != '\0') {
+		return 0;
+	}
+	return value;
+}
+
 static void print_help(const char *executable) {
 	puts("A D-Bus monitoring tool.\n");
-	printf("Usage: %s [FILTER]\n", executable);
+	printf("Usage: %s [FILTER...]\n", executable);
 	printf("   or: %s OPTION [ARG]\n\n", executable);
 
 	puts("  -a        List activatable bus names.");
+	puts("  -b BUS    Connect to BUS: session, system or an address. Repeat to");
+	puts("            capture several buses.");
+	puts("  -c        Compact output: one line of JSON per message.");
 	#if DAHSEE_UI_WEB != 0
 	printf("  -d        Daemonize on port %d.\n", PORT);
 	#else
 	puts("  -d        Daemonize.");
 	#endif
+	puts("  -D LIMITS Limit argument decoding. Options: none or");
+	puts("            args=N,depth=N,elements=N,bytes=BYTES");
+	puts("  -e EXPR   Only keep messages matching the filter EXPR.");
 	puts("  -f        Force overwriting when output file exists.");
 	puts("  -h        Print this help.");
 	puts("  -I NAME   Return introspection of NAME.");
+	puts("  -j N      Decode messages with N worker threads.");
+	puts("  -k COUNT  Only keep the last COUNT messages for the report.");
+	puts("  -K BYTES  Only keep the last BYTES of messages for the report.");
 	puts("  -L FILE   Write log to FILE (default is stderr).");
 	puts("  -l        List registered bus names.");
 	puts("  -n NAME   Return unique name associated to NAME.");
 	puts("  -o FILE   Write output to FILE (default is stdout).");
+	puts("  -O DIR    Record caught messages to a rotating capture log in DIR.");
+	puts("            Options: DIR,size=BYTES,time=SEC,keep=N,gzip");
 	puts("  -p NAME   Return PID associated to NAME.");
+	puts("  -P        Profile output: one tab-separated line per message, without");
+	puts("            arguments.");
+	puts("  -r FILE   Read messages from PCAP FILE instead of the bus.");
+	puts("  -s SEC    Report capture statistics every SEC seconds.");
+	puts("  -S N      Keep one message in N. Options: N,hash,rate=MSG/S");
+	puts("  -t CLOCK  Timestamp with CLOCK: realtime, coarse, monotonic or batch.");
 	puts("  -u NAME   Return UID who owns NAME.");
 	puts("  -v        Print version.");
+	puts("  -w FILE   Write caught messages to PCAP FILE instead of printing them.");
+	puts("  -y FORMAT Write byte arrays as FORMAT: array, base64 or hex.");
 
 	/* puts ("  -X        Set output format to XML."); */
 	/* puts ("  -H        Set output format to HTML."); */
 	/* puts ("  -i FILE   Read input FILE."); */
 
 	puts("");
-	puts("With no argument, it will catch D-Bus messages matching FILTER. The syntax follows D-Bus specification. If FILTER is empty, all messages are caught.");
+	puts("With no argument, it will catch D-Bus messages matching any FILTER. The syntax follows D-Bus specification. If no FILTER is given, all messages are caught.");
 
 	puts("");
 	printf("See the %s(1) man page for more information.\n", APPNAME);
@@ -1597,27 +7306,31 @@ int main(int argc, char **argv) {
 	bool set_output = false;
 	bool set_logfile = false;
 
-	/* Catch SIGINT (Ctrl-C). */
-	struct sigaction act;
-	act.sa_handler = nice_exit;
-	act.sa_flags = 0;
-
-	if ((sigemptyset(&act.sa_mask) == -1) ||
-		(sigaction(SIGINT, &act, NULL) == -1)) {
-		perror("Failed to set SIGINT handler");
-		return 1;
-	}
-
 	/* Fork variables. */
 	pid_t pid, sid;
 	bool daemonize = false;
-	while ((c = getopt(argc, argv, ":adfhi:I:L:ln:o:p:vu:")) != -1) {
+
+	int status = 0;
+
+	while ((c = getopt(argc, argv, ":ab:cdD:e:fhi:I:j:k:K:L:ln:o:O:p:Pr:s:S:t:vu:w:y:")) != -1) {
 		switch (c) {
 		case 'a':
 			exclusive_opt++;
 			query = QUERY_ACTIVATABLE_NAMES;
 			break;
 
+		case 'b':
+			if (option_bus_count == MAX_BUSES) {
+				fprintf(logfile, "ERROR: At most %d buses can be captured.\n", MAX_BUSES);
+				return 1;
+			}
+			option_buses[option_bus_count++] = optarg;
+			break;
+
+		case 'c':
+			option_compact = true;
+			break;
+
 		case 'd':
 			exclusive_opt++;
 			daemonize = true;
@@ -1637,6 +7350,22 @@ int main(int argc, char **argv) {
 			query = QUERY_INTROSPECT;
 			break;
 
+		case 'j':
+			option_workers = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'k':
+			message_store.max_count = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'K':
+			message_store.max_bytes = parse_size(optarg);
+			if (message_store.max_bytes == 0) {
+				fprintf(logfile, "ERROR: Invalid size '%s'.\n", optarg);
+				return 1;
+			}
+			break;
+
 		case 'L':
 			logfile_path = optarg;
 			set_logfile = true;
@@ -1658,12 +7387,48 @@ int main(int argc, char **argv) {
 			set_output = true;
 			break;
 
+		case 'O':
+			capture_log_spec = optarg;
+			break;
+
+		case 'P':
+			option_output_format = FORMAT_PROFILE;
+			break;
+
+		case 'e':
+			filter_expression = optarg;
+			break;
+
+		case 'S':
+			sample_spec = optarg;
+			break;
+
+		case 'D':
+			decode_spec = optarg;
+			break;
+
 		case 'p':
 			exclusive_opt++;
 			parameter = optarg;
 			query = QUERY_GET_CONNECTION_UNIX_PROCESS_ID;
 			break;
 
+		case 'r':
+			exclusive_opt++;
+			pcap_input_path = optarg;
+			break;
+
+		case 's':
+			option_stats_interval = strtoul(optarg, NULL, 10);
+			break;
+
+		case 't':
+			if (timestamp_parse_clock(optarg) == -1) {
+				fprintf(logfile, "ERROR: Unknown clock '%s'.\n==> Try '%s -h' for more information.\n", optarg, argv[0]);
+				return 1;
+			}
+			break;
+
 		case 'u':
 			exclusive_opt++;
 			parameter = optarg;
@@ -1674,6 +7439,17 @@ int main(int argc, char **argv) {
 			print_version();
 			return 0;
 
+		case 'w':
+			pcap_output_path = optarg;
+			break;
+
+		case 'y':
+			if (byte_format_parse(optarg) == -1) {
+				fprintf(logfile, "ERROR: Unknown byte array format '%s'.\n==> Try '%s -h' for more information.\n", optarg, argv[0]);
+				return 1;
+			}
+			break;
+
 		/* case 'X': */
 		/*     option_output_format = FORMAT_XML; */
 		/*     break; */
@@ -1712,6 +7488,56 @@ int main(int argc, char **argv) {
 		prepare_file(output_path, &output, "w");
 	}
 
+	if (pcap_output_path != NULL && capture_log_spec != NULL) {
+		fprintf(logfile, "ERROR: -w and -O cannot be used together.\n");
+		return 1;
+	}
+
+	/* Records of a PCAP file and segment time ranges are wall clock times. */
+	if ((pcap_output_path != NULL || capture_log_spec != NULL) && option_clock == TIMESTAMP_MONOTONIC) {
+		fprintf(logfile, "ERROR: -t monotonic cannot be used with -w or -O.\n");
+		return 1;
+	}
+
+	if ((pcap_output_path != NULL || capture_log_spec != NULL) && option_bus_count > 1) {
+		fprintf(logfile, "WARNING: PCAP files do not record which bus a message comes from.\n");
+	}
+
+	if (pcap_output_path != NULL && query == QUERY_NONE) {
+		pcap_output = pcap_open(pcap_output_path);
+		if (pcap_output == NULL) {
+			return 1;
+		}
+	}
+
+	if (filter_expression != NULL && query == QUERY_NONE) {
+		message_filter = filter_new(filter_expression);
+		if (message_filter == NULL) {
+			return 1;
+		}
+	}
+
+	if (decode_spec != NULL && !decode_limits_parse(decode_spec)) {
+		return 1;
+	}
+
+	if (sample_spec != NULL && query == QUERY_NONE) {
+		sampler = sampler_new(sample_spec);
+		if (sampler == NULL) {
+			return 1;
+		}
+		if (pcap_output_path != NULL || capture_log_spec != NULL) {
+			fprintf(logfile, "WARNING: PCAP files do not record sample weights.\n");
+		}
+	}
+
+	if (capture_log_spec != NULL && query == QUERY_NONE) {
+		capture_log = capture_log_new(capture_log_spec);
+		if (capture_log == NULL) {
+			return 1;
+		}
+	}
+
 
 	/* TODO: check if useful. */
 	/* Set stdout to be unbuffered; this is basically so that if people
@@ -1777,6 +7603,13 @@ int main(int argc, char **argv) {
 			break;
 		}
 	}
+	/* Offline */
+	else if (pcap_input_path != NULL) {
+		if (argv[optind] != NULL) {
+			fprintf(logfile, "WARNING: Filters are ignored when reading a PCAP file.\n");
+		}
+		status = pcap_replay(pcap_input_path, LIVE_OUTPUT_ON);
+	}
 	/* Daemon */
 	else if (daemonize == true) {
 		/* Fork off the parent process */
@@ -1812,14 +7645,8 @@ int main(int argc, char **argv) {
 		/* WARNING: considering that all remaining args are arguments may be */
 		/* POSIXLY_INCORRECT.  TODO: check behaviour when POSIXLY_CORRECT is set. */
 
-		char *filter;
-		if (argc - optind != 1) {
-			filter = NULL;
-		} else {
-			filter = argv[optind];
-		}
-
-		spy(filter, LIVE_OUTPUT_ON);
+		/* Each remaining argument is a match rule. */
+		spy(argv + optind, LIVE_OUTPUT_ON);
 
 		/* TEST: */
 		/* if (html_message != NULL) */
@@ -1828,8 +7655,26 @@ int main(int argc, char **argv) {
 
 
 	/* Clean global stuff. */
-	if (message_array != NULL) {
-		json_delete(message_array);
+	json_arena_free(scratch_arena);
+	intern_clear(&intern_table);
+	plan_cache_clear(&plan_cache);
+
+	store_clear(&message_store);
+
+	if (pcap_output != NULL) {
+		pcap_close(pcap_output);
+	}
+
+	if (capture_log != NULL) {
+		capture_log_free(capture_log);
+	}
+
+	if (message_filter != NULL) {
+		filter_free(message_filter);
+	}
+
+	if (sampler != NULL) {
+		sampler_free(sampler);
 	}
 
 	if (html_message != NULL) {
@@ -1848,5 +7693,5 @@ int main(int argc, char **argv) {
 		fclose(output);
 	}
 
-	return 0;
+	return status;
 }
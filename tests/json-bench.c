@@ -0,0 +1,360 @@
+#include <dbus/dbus.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "json.h"
+
+/**
+ * Measure the string code of ccan/json on the strings of real messages, once
+ * for each instruction set the CPU has.
+ *
+ * Usage: json-bench CAPTURE.pcap [SECONDS]
+ *
+ * The capture can come from 'dahsee -w' or 'dbus-monitor --pcap'. Every string,
+ * object path and signature is taken, from the header and from the arguments.
+ *
+ * - encode: json_encode_string() on each string.
+ * - decode: json_decode() of an array holding all of them.
+ * - check: json_check() of that array, i.e. UTF-8 validation.
+ *
+ * The levels take turns over several trials and the best rate of each is kept,
+ * so that a busy machine does not favor one of them.
+ */
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+#define PCAP_GLOBAL_HEADER_SIZE 24
+#define PCAP_RECORD_HEADER_SIZE 16
+
+#define TRIALS 5
+#define LEVELS 3
+#define WORKLOADS 3
+
+struct strings {
+    char **items;
+    size_t count;
+    size_t size;
+    size_t bytes;
+};
+
+static const char *simd_names[LEVELS] = { "scalar", "sse2", "avx2" };
+
+static uint32_t
+get_u32(const unsigned char *p, int swap)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+    if (swap)
+    {
+        v = (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24);
+    }
+    return v;
+}
+
+static void
+strings_add(struct strings *list, const char *str)
+{
+    if (str == NULL)
+    {
+        return;
+    }
+    if (list->count == list->size)
+    {
+        list->size = list->size == 0 ? 1024 : list->size * 2;
+        list->items = realloc(list->items, list->size * sizeof (char *));
+        if (list->items == NULL)
+        {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+    }
+    list->items[list->count++] = strdup(str);
+    list->bytes += strlen(str);
+}
+
+static void
+strings_add_args(struct strings *list, DBusMessageIter *args)
+{
+    do
+    {
+        int type = dbus_message_iter_get_arg_type(args);
+
+        if (type == DBUS_TYPE_STRING || type == DBUS_TYPE_OBJECT_PATH || type == DBUS_TYPE_SIGNATURE)
+        {
+            const char *value;
+            dbus_message_iter_get_basic(args, &value);
+            strings_add(list, value);
+        }
+        else if (dbus_type_is_container(type))
+        {
+            DBusMessageIter sub;
+            dbus_message_iter_recurse(args, &sub);
+            if (dbus_message_iter_get_arg_type(&sub) != DBUS_TYPE_INVALID)
+            {
+                strings_add_args(list, &sub);
+            }
+        }
+    } while (dbus_message_iter_next(args));
+}
+
+/* Return the number of messages read, or -1. */
+static long
+load_capture(const char *path, struct strings *list)
+{
+    FILE *file = fopen(path, "rb");
+    unsigned char *data;
+    const unsigned char *p;
+    const unsigned char *end;
+    long size;
+    long messages = 0;
+    int swap;
+
+    if (file == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    rewind(file);
+    data = malloc(size > 0 ? size : 1);
+    if (data == NULL || fread(data, 1, size, file) != (size_t)size || size < PCAP_GLOBAL_HEADER_SIZE)
+    {
+        fprintf(stderr, "Could not read %s.\n", path);
+        fclose(file);
+        free(data);
+        return -1;
+    }
+    fclose(file);
+
+    swap = get_u32(data, 0) != PCAP_MAGIC && get_u32(data, 0) != PCAP_MAGIC_NSEC;
+    if (swap && get_u32(data, 1) != PCAP_MAGIC && get_u32(data, 1) != PCAP_MAGIC_NSEC)
+    {
+        fprintf(stderr, "%s is not a PCAP file.\n", path);
+        free(data);
+        return -1;
+    }
+
+    end = data + size;
+    for (p = data + PCAP_GLOBAL_HEADER_SIZE; p + PCAP_RECORD_HEADER_SIZE <= end; )
+    {
+        uint32_t length = get_u32(p + 8, swap);
+        DBusMessage *message;
+        DBusMessageIter args;
+        DBusError error;
+
+        p += PCAP_RECORD_HEADER_SIZE;
+        if ((size_t)(end - p) < length)
+        {
+            break;
+        }
+
+        dbus_error_init(&error);
+        message = dbus_message_demarshal((const char *)p, length, &error);
+        p += length;
+        if (message == NULL)
+        {
+            dbus_error_free(&error);
+            continue;
+        }
+
+        strings_add(list, dbus_message_get_path(message));
+        strings_add(list, dbus_message_get_interface(message));
+        strings_add(list, dbus_message_get_member(message));
+        strings_add(list, dbus_message_get_sender(message));
+        strings_add(list, dbus_message_get_destination(message));
+        strings_add(list, dbus_message_get_signature(message));
+        if (dbus_message_iter_init(message, &args))
+        {
+            strings_add_args(list, &args);
+        }
+        dbus_message_unref(message);
+        messages++;
+    }
+
+    free(data);
+    return messages;
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* MB/s of 'workload' on 'bytes', repeated for 'seconds'. */
+static double
+measure(void (*workload)(void *), void *data, size_t bytes, double seconds)
+{
+    double start = now();
+    double elapsed;
+    unsigned long rounds = 0;
+
+    do
+    {
+        workload(data);
+        rounds++;
+        elapsed = now() - start;
+    } while (elapsed < seconds);
+
+    return bytes * (double)rounds / elapsed / 1e6;
+}
+
+static void
+run_encode(void *data)
+{
+    struct strings *list = data;
+    size_t i;
+
+    for (i = 0; i < list->count; i++)
+    {
+        free(json_encode_string(list->items[i]));
+    }
+}
+
+static void
+run_decode(void *data)
+{
+    json_delete(json_decode(data));
+}
+
+static void
+run_check(void *data)
+{
+    if (!json_check(data, NULL))
+    {
+        fprintf(stderr, "json_check() failed.\n");
+        exit(1);
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    struct strings list = { NULL, 0, 0, 0 };
+    JsonNode *array;
+    JsonNode *tree;
+    char *document;
+    char *reference;
+    double seconds = 3;
+    double rates[LEVELS][WORKLOADS];
+    long messages;
+    size_t i;
+    int trial;
+    int level;
+    int best;
+    int j;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s CAPTURE.pcap [SECONDS]\n", argv[0]);
+        return 1;
+    }
+    if (argc > 2)
+    {
+        seconds = atof(argv[2]);
+    }
+
+    messages = load_capture(argv[1], &list);
+    if (messages < 0)
+    {
+        return 1;
+    }
+    if (list.count == 0)
+    {
+        fprintf(stderr, "No strings in %s.\n", argv[1]);
+        return 1;
+    }
+
+    /* The startup level is the best the CPU has. */
+    best = json_simd();
+    json_simd_limit(JSON_SIMD_NONE);
+
+    array = json_mkarray();
+    for (i = 0; i < list.count; i++)
+    {
+        json_append_element(array, json_mkstring(list.items[i]));
+    }
+    document = json_encode(array);
+    json_delete(array);
+
+    /* All levels must give the same result. */
+    tree = json_decode(document);
+    reference = json_encode(tree);
+    json_delete(tree);
+    for (level = JSON_SIMD_NONE + 1; level <= best; level++)
+    {
+        char *encoded;
+
+        json_simd_limit(level);
+        tree = json_decode(document);
+        encoded = json_encode(tree);
+        json_delete(tree);
+        if (strcmp(reference, encoded) != 0)
+        {
+            fprintf(stderr, "%s: output differs from scalar.\n", simd_names[level]);
+            return 1;
+        }
+        free(encoded);
+    }
+
+    printf("%ld messages, %zu strings, %zu bytes (%.0f per string), %zu bytes of JSON.\n",
+           messages, list.count, list.bytes, (double)list.bytes / list.count, strlen(document));
+
+    memset(rates, 0, sizeof rates);
+    tree = json_decode(document);
+    for (trial = 0; trial < TRIALS; trial++)
+    {
+        for (level = JSON_SIMD_NONE; level <= best; level++)
+        {
+            double slice = seconds / TRIALS / (best + 1) / WORKLOADS;
+            double rate[WORKLOADS];
+
+            json_simd_limit(level);
+            rate[0] = measure(run_encode, &list, list.bytes, slice);
+            rate[1] = measure(run_decode, document, strlen(document), slice);
+            rate[2] = measure(run_check, tree, list.bytes, slice);
+            for (j = 0; j < WORKLOADS; j++)
+            {
+                if (rate[j] > rates[level][j])
+                {
+                    rates[level][j] = rate[j];
+                }
+            }
+        }
+    }
+    json_delete(tree);
+
+    printf("%-8s %16s %16s %16s\n", "", "encode MB/s", "decode MB/s", "check MB/s");
+    for (level = JSON_SIMD_NONE; level <= best; level++)
+    {
+        printf("%-8s", simd_names[level]);
+        for (j = 0; j < WORKLOADS; j++)
+        {
+            if (level == JSON_SIMD_NONE)
+            {
+                printf(" %16.1f", rates[level][j]);
+            }
+            else
+            {
+                printf(" %9.1f (x%.2f)", rates[level][j], rates[level][j] / rates[JSON_SIMD_NONE][j]);
+            }
+        }
+        printf("\n");
+    }
+
+    json_simd_limit(best);
+    free(reference);
+    free(document);
+    for (i = 0; i < list.count; i++)
+    {
+        free(list.items[i]);
+    }
+    free(list.items);
+    return 0;
+}